@@ -20,12 +20,20 @@
 #include "image8bit.h"
 
 #include "instrumentation.h"
+#include "threadpool.h"
 #include <assert.h>
 #include <ctype.h>
+#include <limits.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 // The data structure
 //
@@ -72,12 +80,15 @@ struct image {
 // this purpose.
 //
 // Additional information:  man 3 errno;  man 3 error;
+//
+// Like errno, errCause is kept per thread, so images may be loaded and
+// saved concurrently by different threads.
 
 // Variable to preserve errno temporarily
-static int errsave = 0;
+static __thread int errsave = 0;
 
 // Error cause
-static char *errCause;
+static __thread char *errCause;
 
 /// Error cause.
 /// After some other module function fails (and returns an error code),
@@ -138,46 +149,354 @@ static int check(int condition, const char *failmsg) {
   return condition;
 }
 
+#ifdef IMAGE_INSTR
+static void hugeUpdate(void); // see bufAllocate
+#endif
+
 /// Init Image library.  (Call once!)
-/// Currently, simply calibrate instrumentation and set names of counters.
+/// Set names of instrumentation counters, and set up the thread pool
+/// (see ImageSetThreads).  Instrumentation is calibrated only when needed
+/// (see InstrGetCTU).
+/// The counters are only named (and counted) in builds with IMAGE_INSTR.
 void ImageInit(void) { ///
-  InstrCalibrate();
+  PoolInit(0);
+#ifdef IMAGE_INSTR
   InstrName[0] = "pixmem"; // InstrCount[0] will count pixel array acesses
+  InstrName[1] = "hugemem"; // InstrCount[1] will count huge page bytes
+  InstrUpdate = hugeUpdate;  // (set when the counters are printed)
   // Name other counters here...
+#endif
 }
 
+// Instrumentation counters are compiled in only if IMAGE_INSTR is defined
+// (make imageTool-instr).  Otherwise, PIXMEM_ADD and pixmemAdd do nothing
+// and the counting code is optimized away.
+// Operations count in bulk, once per call, row or chunk, never per pixel
+// (except for ImageGetPixel and ImageSetPixel themselves).
+
 // Macros to simplify accessing instrumentation counters:
 #define PIXMEM InstrCount[0]
+#define HUGEMEM InstrCount[1]
 // Add more macros here...
 
+// Add n to PIXMEM.  Safe to call from parallel tasks.
+static inline void pixmemAdd(unsigned long n) {
+#ifdef IMAGE_INSTR
+  __atomic_fetch_add(&PIXMEM, n, __ATOMIC_RELAXED);
+#else
+  (void)n;
+#endif
+}
+
+// PIXMEM is also atomic in serial code, since images may be loaded by
+// other threads at the same time (as imageTool does to prefetch files).
+#define PIXMEM_ADD(n) pixmemAdd(n)
+
+/// Set the number of threads used by image operations.
+/// If nthreads <= 0, use the value of environment variable IMAGE_THREADS,
+/// or else the number of online CPUs (this is the default).
+void ImageSetThreads(int nthreads) { ///
+  PoolInit(nthreads);
+}
+
+/// Get the number of threads used by image operations.
+int ImageThreads(void) { ///
+  return PoolThreads();
+}
+
+// Parallel loops
+//
+// Operations split their work (pixels, rows, tiles or bands) into chunks
+// that run on the shared thread pool (see threadpool.h), with a task
+// function and a struct with its arguments.  Each chunk should cover at
+// least PAR_MIN_PIXELS pixels, so that small images are processed by a
+// single thread, with no synchronization costs.
+//
+// PIXMEM is counted by the caller when the count is known in advance.
+// Otherwise, tasks count locally and call pixmemAdd once per chunk.
+#define PAR_MIN_PIXELS (1L << 16)
+
+// Number of items per chunk, for items of itemPixels pixels each.
+static long parGrain(long itemPixels) {
+  if (itemPixels >= PAR_MIN_PIXELS)
+    return 1;
+  return PAR_MIN_PIXELS / (itemPixels > 0 ? itemPixels : 1);
+}
+
+// Allocation of large buffers
+//
+// Pixel arrays and other large buffers are allocated with bufAlloc and
+// released with bufFree.  In the IMAGE_ALLOC_HUGE modes, buffers of at
+// least allocThreshold bytes are mapped with mmap, aligned to a huge page
+// and marked with MADV_HUGEPAGE, so the kernel may back them with
+// transparent huge pages.  IMAGE_ALLOC_HUGE_POPULATE also pre-faults them
+// (after the advice, so the faults can already get huge pages).
+// Other buffers, or mappings that fail, use calloc.
+//
+// A header before each buffer records how it was allocated.  Mappings end
+// with an inaccessible guard page, so the kernel never merges two of them,
+// and bufFree can read the huge page usage of each one in /proc/self/smaps.
+
+#define HUGE_PAGE ((size_t)2 << 20)
+#define GUARD_PAGE ((size_t)4096)
+
+static ImageAllocMode allocMode = IMAGE_ALLOC_MALLOC;
+static size_t allocThreshold = 16 * HUGE_PAGE;
+
+// Header of each buffer (64 bytes, to keep buffers cache-line aligned)
+struct buf_header {
+  size_t mapsize; // size of the mapping, without guard page, or 0 (calloc)
+  struct buf_header *prev, *next; // list of mappings (IMAGE_INSTR builds)
+  size_t unused[5];
+};
+
+/// Set how pixel arrays and other large buffers are allocated.
+/// Buffers of at least threshold bytes are allocated according to mode;
+/// smaller ones always use calloc.
+/// Huge pages reduce TLB misses and page faults on large images.
+/// In builds with IMAGE_INSTR, the "hugemem" instrumentation counter
+/// reports how many bytes of the buffers in use are backed by huge pages,
+/// when the counters are printed.
+void ImageSetAlloc(ImageAllocMode mode, size_t threshold) { ///
+  allocMode = mode;
+  allocThreshold = threshold;
+}
+
+// Map size bytes aligned to a huge page, followed by a guard page.
+// Returns NULL on failure.
+static void *hugeMap(size_t size, int populate) {
+  size_t span = size + HUGE_PAGE + GUARD_PAGE;
+  uint8 *map = (uint8 *)mmap(NULL, span, PROT_READ | PROT_WRITE,
+                             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (map == (uint8 *)MAP_FAILED)
+    return NULL;
+  // Trim to an aligned start; keep a guard page after the end
+  uint8 *start = (uint8 *)(((uintptr_t)map + HUGE_PAGE - 1) & ~(HUGE_PAGE - 1));
+  uint8 *end = start + size + GUARD_PAGE;
+  if (start > map)
+    munmap(map, (size_t)(start - map));
+  if (map + span > end)
+    munmap(end, (size_t)(map + span - end));
+  mprotect(start + size, GUARD_PAGE, PROT_NONE);
+#ifdef MADV_HUGEPAGE
+  madvise(start, size, MADV_HUGEPAGE); // just advice: ignore failures
+#endif
+  if (populate) {
+#ifdef MADV_POPULATE_WRITE
+    if (madvise(start, size, MADV_POPULATE_WRITE) != 0)
+#endif
+      for (size_t i = 0; i < size; i += GUARD_PAGE)
+        start[i] = 0; // touch each page
+  }
+  return start;
+}
+
+#ifdef IMAGE_INSTR
+// Mapped buffers in use, so that hugeUpdate can find them in smaps.
+// Buffers may be allocated and freed by any thread.
+static struct buf_header *mapList = NULL;
+static pthread_mutex_t mapLock = PTHREAD_MUTEX_INITIALIZER;
+
+static void mapListAdd(struct buf_header *hdr) {
+  pthread_mutex_lock(&mapLock);
+  hdr->prev = NULL;
+  hdr->next = mapList;
+  if (mapList != NULL)
+    mapList->prev = hdr;
+  mapList = hdr;
+  pthread_mutex_unlock(&mapLock);
+}
+
+static void mapListRemove(struct buf_header *hdr) {
+  pthread_mutex_lock(&mapLock);
+  if (hdr->prev != NULL)
+    hdr->prev->next = hdr->next;
+  else
+    mapList = hdr->next;
+  if (hdr->next != NULL)
+    hdr->next->prev = hdr->prev;
+  pthread_mutex_unlock(&mapLock);
+}
+
+// Set HUGEMEM to the bytes backed by huge pages in the mapped buffers in
+// use.  Reading /proc/self/smaps is slow, so this is only done when the
+// counters are printed (see ImageInit), not as buffers are freed.
+static void hugeUpdate(void) {
+  errsave = errno;
+  FILE *f = fopen("/proc/self/smaps", "r");
+  if (f == NULL) {
+    errno = errsave;
+    return;
+  }
+  char line[256];
+  int inside = 0;
+  size_t kb, total = 0;
+  pthread_mutex_lock(&mapLock);
+  while (fgets(line, sizeof(line), f) != NULL) {
+    unsigned long lo, hi;
+    if (sscanf(line, "%lx-%lx ", &lo, &hi) == 2) {
+      inside = 0;
+      for (struct buf_header *hdr = mapList; hdr != NULL && !inside; hdr = hdr->next)
+        inside = lo == (uintptr_t)hdr;
+    } else if (inside && sscanf(line, "AnonHugePages: %zu kB", &kb) == 1) {
+      total += kb * 1024;
+      inside = 0;
+    }
+  }
+  pthread_mutex_unlock(&mapLock);
+  fclose(f);
+  HUGEMEM = total;
+  errno = errsave;
+}
+#endif
+
+// Allocate a buffer of size bytes, zeroed if zero is nonzero.
+// (Mappings are always zeroed by the kernel, as their pages are touched.)
+// Returns NULL on failure (errno set).
+static void *bufAllocate(size_t size, int zero) {
+  const size_t total = size + sizeof(struct buf_header);
+  struct buf_header *hdr = NULL;
+  if (allocMode != IMAGE_ALLOC_MALLOC && total >= allocThreshold) {
+    const size_t mapsize = (total + GUARD_PAGE - 1) & ~(GUARD_PAGE - 1);
+    errsave = errno;
+    hdr = (struct buf_header *)hugeMap(
+        mapsize, allocMode == IMAGE_ALLOC_HUGE_POPULATE);
+    errno = errsave; // on failure, fall back to calloc
+    if (hdr != NULL) {
+      hdr->mapsize = mapsize;
+#ifdef IMAGE_INSTR
+      mapListAdd(hdr);
+#endif
+    }
+  }
+  if (hdr == NULL) {
+    hdr = (struct buf_header *)(zero ? calloc(1, total) : malloc(total));
+    if (hdr == NULL)
+      return NULL;
+    hdr->mapsize = 0;
+  }
+  return hdr + 1;
+}
+
+// Allocate a zeroed buffer of size bytes.
+// Returns NULL on failure (errno set).
+static void *bufAlloc(size_t size) {
+  return bufAllocate(size, 1);
+}
+
+// Release a buffer from bufAlloc.  Does nothing if buf is NULL.
+// Preserves errno.
+static void bufFree(void *buf) {
+  if (buf == NULL)
+    return;
+  struct buf_header *hdr = (struct buf_header *)buf - 1;
+  if (hdr->mapsize == 0) {
+    free(hdr);
+    return;
+  }
+  errsave = errno;
+#ifdef IMAGE_INSTR
+  mapListRemove(hdr);
+#endif
+  munmap(hdr, hdr->mapsize + GUARD_PAGE);
+  errno = errsave;
+}
+
+// Buffers that are fully overwritten
+//
+// Zeroing a new pixel array costs a pass over its memory.  Operations that
+// write every pixel of a new array (rotations, mirror, copy, crop, resize,
+// conversions, and filters that write to a separate array) skip it: they
+// allocate the array with bufAllocRaw (or imageCreateRaw), and write it
+// with fillPixels.  ImageLoad also skips it, as it fails unless fread
+// reads every pixel.
+//
+// To check that these operations do write every pixel, compile with
+// -DIMAGE_POISON (make imageTool-poison).  Then bufAllocRaw fills new
+// buffers with a poison byte, and fillPixels runs its task twice, with
+// another poison byte in between.  Pixels that still hold the poison byte
+// after each run were not written: the first is reported, and the program
+// aborts.  (Pixel memory counts are not meaningful in such builds.)
+
+#define POISON1 0xa5
+#define POISON2 0x5a
+
+// Allocate a buffer of size bytes, with undefined contents.
+// Returns NULL on failure (errno set).
+static void *bufAllocRaw(size_t size) {
+  void *buf = bufAllocate(size, 0);
+#ifdef IMAGE_POISON
+  if (buf != NULL)
+    memset(buf, POISON1, size);
+#endif
+  return buf;
+}
+
+// Write all pixels of a new width x height array pix, from bufAllocRaw,
+// by running task over items [0, n) with PoolParallelFor.
+// what names the operation, in error messages.
+static void fillPixels(const char *what, uint8 *pix, int width, int height,
+                       long n, long grain, PoolTask task, void *job) {
+  PoolParallelFor(n, grain, task, job);
+#ifdef IMAGE_POISON
+  const size_t size = (size_t)width * height;
+  uint8 *first = (uint8 *)malloc(size);
+  if (first == NULL)
+    return; // cannot check
+  memcpy(first, pix, size);
+  memset(pix, POISON2, size);
+  PoolParallelFor(n, grain, task, job);
+  for (size_t i = 0; i < size; i++) {
+    if (first[i] == POISON1 && pix[i] == POISON2) {
+      fprintf(stderr, "%s: pixel (%zu,%zu) of %dx%d result not written\n",
+              what, i % (size_t)width, i / (size_t)width, width, height);
+      abort();
+    }
+  }
+  free(first);
+#else
+  (void)what;
+  (void)pix;
+  (void)width;
+  (void)height;
+#endif
+}
+
 // TIP: Search for PIXMEM or InstrCount to see where it is incremented!
 
+// Image sizes
+//
+// Widths and heights are ints, but an image may have more than INT_MAX
+// pixels, so pixel counts, indices and offsets are size_t (or long, for
+// the thread pool).  Products of dimensions are always computed in those
+// types, never in int.
+
+// Can width*height elements of elemsize bytes be addressed with a size_t?
+static int pixelsFit(int width, int height, size_t elemsize) {
+  return height == 0 || (size_t)width <= SIZE_MAX / elemsize / (size_t)height;
+}
+
 /// Image management functions
 
-/// Create a new black image.
-///   width, height : the dimensions of the new image.
-///   maxval: the maximum gray level (corresponding to white).
-/// Requires: width and height must be non-negative, maxval > 0.
-///
-/// On success, a new image is returned.
-/// (The caller is responsible for destroying the returned image!)
-/// On failure, returns NULL and errno/errCause are set accordingly.
-Image ImageCreate(int width, int height, uint8 maxval) { ///
-  assert(width >= 0);
-  assert(height >= 0);
-  assert(0 < maxval && maxval <= PixMax);
+// Create a new image, with zeroed pixels if zero is nonzero, or with
+// undefined pixels (from bufAllocRaw) otherwise.
+static Image imageAlloc(int width, int height, uint8 maxval, int zero) {
   // Written by us
 
   Image img = NULL; // Define uma variável do tipo Image
   int success = // Verifica se a criação da imagem foi bem sucedida (1) ou não (0)
       // Alocação de memória para a imagem e para o array de pixeis
+      check(pixelsFit(width, height, 1), "Image too large") &&
       check((img = (Image)malloc(sizeof(struct image))) != NULL, "Allocation failed") &&
-      check((img->pixel = (uint8 *)calloc(width * height, sizeof(uint8))) != NULL,"Allocation failed");
+      check((img->pixel = (uint8 *)(zero ? bufAlloc((size_t)width * height)
+                                          : bufAllocRaw((size_t)width * height))) != NULL,"Allocation failed");
 
   // Alocar o conteúdo
-  img->width = width;
-  img->height = height;
-  img->maxval = maxval;
+  if (img != NULL) {
+    img->width = width;
+    img->height = height;
+    img->maxval = maxval;
+  }
 
   // Cleanup caso a criação da imagem não tenha sido bem sucedida
   if (!success) {
@@ -188,6 +507,31 @@ Image ImageCreate(int width, int height, uint8 maxval) { ///
   return img;
 }
 
+/// Create a new black image.
+///   width, height : the dimensions of the new image.
+///   maxval: the maximum gray level (corresponding to white).
+/// Requires: width and height must be non-negative, maxval > 0.
+///
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageCreate(int width, int height, uint8 maxval) { ///
+  assert(width >= 0);
+  assert(height >= 0);
+  assert(0 < maxval && maxval <= PixMax);
+  return imageAlloc(width, height, maxval, 1);
+}
+
+// Create a new image with undefined pixels, for operations that write
+// all of them (see fillPixels).
+// Returns the new image, or NULL on failure (errno/errCause set).
+static Image imageCreateRaw(int width, int height, uint8 maxval) {
+  assert(width >= 0);
+  assert(height >= 0);
+  assert(0 < maxval && maxval <= PixMax);
+  return imageAlloc(width, height, maxval, 0);
+}
+
 /// Destroy the image pointed to by (*imgp).
 ///   imgp : address of an Image variable.
 /// If (*imgp)==NULL, no operation is performed.
@@ -197,7 +541,7 @@ void ImageDestroy(Image *imgp) { ///
   assert(imgp != NULL);
   // Written by us
   if (*imgp != NULL) {    // Verifica se a imagem existe
-    free((*imgp)->pixel); // Liberta a memória alocada para o array de pixeis
+    bufFree((*imgp)->pixel); // Liberta a memória alocada para o array de pixeis
     free(*imgp);          // Liberta a memória alocada para a imagem
     *imgp = NULL;         // Define o endereço da imagem como NULL
   }
@@ -220,37 +564,50 @@ static int skipComments(FILE *f) {
   return i;
 }
 
+// Parse the header of a raw PGM file, up to its first pixel.
+// Dimensions that do not fit in an int are rejected.
+// Returns 0 on failure (errCause set).
+static int readHeaderPGM(FILE *f, int *w, int *h, int *maxval) {
+  long lw, lh;
+  char c;
+  int success =
+      check(fscanf(f, "P%c ", &c) == 1 && c == '5', "Invalid file format") &&
+      skipComments(f) >= 0 &&
+      check(fscanf(f, "%ld ", &lw) == 1 && 0 <= lw && lw <= INT_MAX,
+            "Invalid width") &&
+      skipComments(f) >= 0 &&
+      check(fscanf(f, "%ld ", &lh) == 1 && 0 <= lh && lh <= INT_MAX,
+            "Invalid height") &&
+      skipComments(f) >= 0 &&
+      check(fscanf(f, "%d", maxval) == 1 && 0 < *maxval &&
+                *maxval <= (int)PixMax,
+            "Invalid maxval") &&
+      check(fscanf(f, "%c", &c) == 1 && isspace(c), "Whitespace expected");
+  *w = success ? (int)lw : 0;
+  *h = success ? (int)lh : 0;
+  return success;
+}
+
 /// Load a raw PGM file.
 /// Only 8 bit PGM files are accepted.
 /// On success, a new image is returned.
 /// (The caller is responsible for destroying the returned image!)
 /// On failure, returns NULL and errno/errCause are set accordingly.
 Image ImageLoad(const char *filename) { ///
-  int w, h;
+  int w = 0, h = 0;
   int maxval;
-  char c;
   FILE *f = NULL;
   Image img = NULL;
 
   int success =
       check((f = fopen(filename, "rb")) != NULL, "Open failed") &&
-      // Parse PGM header
-      check(fscanf(f, "P%c ", &c) == 1 && c == '5', "Invalid file format") &&
-      skipComments(f) >= 0 &&
-      check(fscanf(f, "%d ", &w) == 1 && w >= 0, "Invalid width") &&
-      skipComments(f) >= 0 &&
-      check(fscanf(f, "%d ", &h) == 1 && h >= 0, "Invalid height") &&
-      skipComments(f) >= 0 &&
-      check(fscanf(f, "%d", &maxval) == 1 && 0 < maxval &&
-                maxval <= (int)PixMax,
-            "Invalid maxval") &&
-      check(fscanf(f, "%c", &c) == 1 && isspace(c), "Whitespace expected") &&
-      // Allocate image
-      (img = ImageCreate(w, h, (uint8)maxval)) != NULL &&
+      readHeaderPGM(f, &w, &h, &maxval) &&
+      // Allocate image (all pixels are read below)
+      (img = imageCreateRaw(w, h, (uint8)maxval)) != NULL &&
       // Read pixels
-      check(fread(img->pixel, sizeof(uint8), w * h, f) == w * h,
+      check(fread(img->pixel, sizeof(uint8), (size_t)w * h, f) == (size_t)w * h,
             "Reading pixels");
-  PIXMEM += (unsigned long)(w * h); // count pixel memory accesses
+  pixmemAdd((unsigned long)w * h); // count pixel memory accesses
 
   // Cleanup
   if (!success) {
@@ -277,9 +634,10 @@ int ImageSave(Image img, const char *filename) { ///
   int success = check((f = fopen(filename, "wb")) != NULL, "Open failed") &&
                 check(fprintf(f, "P5\n%d %d\n%u\n", w, h, maxval) > 0,
                       "Writing header failed") &&
-                check(fwrite(img->pixel, sizeof(uint8), w * h, f) == w * h,
+                check(fwrite(img->pixel, sizeof(uint8), (size_t)w * h, f) ==
+                          (size_t)w * h,
                       "Writing pixels failed");
-  PIXMEM += (unsigned long)(w * h); // count pixel memory accesses
+  pixmemAdd((unsigned long)w * h); // count pixel memory accesses
 
   // Cleanup
   if (f != NULL)
@@ -309,6 +667,57 @@ int ImageMaxval(Image img) { ///
   return img->maxval;
 }
 
+// ImageStats scans the pixels in parallel chunks.  PIXMEM counts one access
+// for each update of the running min or max in a sequential scan, so each
+// chunk also records its own running-min and running-max "records": levels
+// smaller (larger) than all previous pixels of the chunk.  Given the min of
+// all previous chunks, the sequential scan updates the min exactly at the
+// chunk records below it (and likewise for the max).
+
+// Per-chunk results of ImageStats
+struct stats_chunk {
+  int min;
+  int max;
+  uint64_t minrec[4]; // bit v is set if level v is a running-min record
+  uint64_t maxrec[4]; // bit v is set if level v is a running-max record
+};
+
+struct stats_job {
+  Image img;
+  long grain;
+  struct stats_chunk *chunk;
+};
+
+static void statsTask(void *arg, long begin, long end) {
+  const struct stats_job *job = arg;
+  struct stats_chunk *c = &job->chunk[begin / job->grain];
+  const uint8 *pixel = job->img->pixel;
+  int min = 256;
+  int max = -1;
+  memset(c, 0, sizeof(*c));
+  for (long i = begin; i < end; i++) {
+    int v = pixel[i];
+    if (v < min) {
+      min = v;
+      c->minrec[v >> 6] |= 1ull << (v & 63);
+    }
+    if (v > max) {
+      max = v;
+      c->maxrec[v >> 6] |= 1ull << (v & 63);
+    }
+  }
+  c->min = min;
+  c->max = max;
+}
+
+// Number of bits set in rec[] at positions in [lo, hi).
+static int countRecords(const uint64_t rec[4], int lo, int hi) {
+  int n = 0;
+  for (int v = lo; v < hi; v++)
+    n += (rec[v >> 6] >> (v & 63)) & 1;
+  return n;
+}
+
 /// Pixel stats
 /// Find the minimum and maximum gray levels in image.
 /// On return,
@@ -318,25 +727,42 @@ void ImageStats(Image img, uint8 *min, uint8 *max) { ///
   assert(img != NULL);
   // Written by us
   //  Tamanho do array
-  int size = img->width * img->height;
+  long size = (long)img->width * img->height;
+  if (size == 0) {
+    *min = *max = 0;
+    return;
+  }
 
   // Inicializar min e max
-  *min = img->pixel[0];
-  *max = *min;
-  PIXMEM += 1;
+  int mn = img->pixel[0];
+  int mx = mn;
+  unsigned long count = 1;
+
+  // Percorrer o array (em paralelo) para dar Update caso necessário
+  struct stats_chunk one;
+  struct stats_job job = {img, PAR_MIN_PIXELS, &one};
+  long nchunks = (size + job.grain - 1) / job.grain;
+  if (nchunks > 1 &&
+      (job.chunk = (struct stats_chunk *)malloc(
+           (size_t)nchunks * sizeof(struct stats_chunk))) == NULL) {
+    job.chunk = &one; // no memory: use a single chunk
+    job.grain = size;
+    nchunks = 1;
+  }
+  PoolParallelFor(size, job.grain, statsTask, &job);
 
-  // Percorrer o array para dar Update caso necessário
-  for (int i = 0; i < size; i++) {
-    uint8 pixel_val = img->pixel[i];
-    if (pixel_val < *min) {
-      *min = pixel_val;
-      PIXMEM += 1;
-    } // Update no min
-    if (pixel_val > *max) {
-      *max = pixel_val;
-      PIXMEM += 1;
-    } // Update no max
+  for (long i = 0; i < nchunks; i++) {
+    const struct stats_chunk *c = &job.chunk[i];
+    count += countRecords(c->minrec, 0, mn);      // Update no min
+    count += countRecords(c->maxrec, mx + 1, 256); // Update no max
+    mn = c->min < mn ? c->min : mn;
+    mx = c->max > mx ? c->max : mx;
   }
+  if (job.chunk != &one)
+    free(job.chunk);
+  *min = (uint8)mn;
+  *max = (uint8)mx;
+  PIXMEM_ADD(count);
 }
 
 /// Check if pixel position (x,y) is inside img.
@@ -367,12 +793,13 @@ int ImageValidRect(Image img, int x, int y, int w, int h) { ///
 // Transform (x, y) coords into linear pixel index.
 // This internal function is used in ImageGetPixel / ImageSetPixel.
 // The returned index must satisfy (0 <= index < img->width*img->height)
-static inline int G(Image img, int x, int y) {
-  int index;
+// It is a size_t, as images may have more than INT_MAX pixels.
+static inline size_t G(Image img, int x, int y) {
+  size_t index;
   // Written by us
   //  Transformar para um index linear
-  index = y * img->width + x; // Transformar (33,0) -> [33] e (22,1) -> [122]
-  assert(0 <= index && index < img->width * img->height);
+  index = (size_t)y * img->width + x; // Transformar (33,0) -> [33] e (22,1) -> [122]
+  assert(index < (size_t)img->width * img->height);
   return index;
 }
 
@@ -380,7 +807,7 @@ static inline int G(Image img, int x, int y) {
 uint8 ImageGetPixel(Image img, int x, int y) { ///
   assert(img != NULL);
   assert(ImageValidPos(img, x, y));
-  PIXMEM += 1; // count one pixel access (read)
+  PIXMEM_ADD(1); // count one pixel access (read)
   return img->pixel[G(img, x, y)];
 }
 
@@ -388,7 +815,7 @@ uint8 ImageGetPixel(Image img, int x, int y) { ///
 void ImageSetPixel(Image img, int x, int y, uint8 level) { ///
   assert(img != NULL);
   assert(ImageValidPos(img, x, y));
-  PIXMEM += 1; // count one pixel access (store)
+  PIXMEM_ADD(1); // count one pixel access (store)
   img->pixel[G(img, x, y)] = level;
 }
 
@@ -402,60 +829,135 @@ void ImageSetPixel(Image img, int x, int y, uint8 level) { ///
 /// Transform image to negative image.
 /// This transforms dark pixels to light pixels and vice-versa,
 /// resulting in a "photographic negative" effect.
+static void negativeTask(void *arg, long begin, long end) {
+  Image img = arg;
+  uint8 maxval = img->maxval;
+  for (long i = begin; i < end; i++)
+    img->pixel[i] = maxval - img->pixel[i]; // Aplicar a transformação
+}
+
 void ImageNegative(Image img) { ///
   assert(img != NULL);
   // Written by us
-  int size = img->width * img->height;
-  uint8 maxval = img->maxval;
-  // Percorrer o array de pixeis e aplicar a transformação
-  for (int i = 0; i < size; i++) {
-    PIXMEM += 1;
-    img->pixel[i] = maxval - img->pixel[i]; // Aplicar a transformação
-  }
+  long size = (long)img->width * img->height;
+  // Percorrer o array de pixeis (em paralelo) e aplicar a transformação
+  PoolParallelFor(size, PAR_MIN_PIXELS, negativeTask, img);
+  PIXMEM_ADD((unsigned long)size);
 }
 
 /// Apply threshold to image.
 /// Transform all pixels with level<thr to black (0) and
 /// all pixels with level>=thr to white (maxval).
+struct threshold_job {
+  Image img;
+  uint8 thr;
+};
+
+static void thresholdTask(void *arg, long begin, long end) {
+  const struct threshold_job *job = arg;
+  uint8 *pixel = job->img->pixel;
+  uint8 maxval = job->img->maxval;
+  for (long i = begin; i < end; i++)
+    pixel[i] = pixel[i] < job->thr ? 0 : maxval; // preto ou branco
+}
+
 void ImageThreshold(Image img, uint8 thr) { ///
   assert(img != NULL);
   // Written by us
-  int size = img->width * img->height;
-  for (int i = 0; i < size; i++) {
-    PIXMEM += 1;
-    if (img->pixel[i] < thr)
-      img->pixel[i] = 0; // Se < thr -> preto
-    else
-      img->pixel[i] = img->maxval; // Se >= thr -> branco
-  }
+  long size = (long)img->width * img->height;
+  struct threshold_job job = {img, thr};
+  PoolParallelFor(size, PAR_MIN_PIXELS, thresholdTask, &job);
+  PIXMEM_ADD((unsigned long)size);
 }
 
 /// Brighten image by a factor.
 /// Multiply each pixel level by a factor, but saturate at maxval.
 /// This will brighten the image if factor>1.0 and
 /// darken the image if factor<1.0.
-void ImageBrighten(Image img, double factor) { ///
-  assert(img != NULL);
-  assert(factor >= 0.0);
-  // Written by us
-  int size = img->width * img->height;
-  uint8 maxval = img->maxval;
-  // Percorrer o array de pixeis e aplicar a transformação
-  for (int i = 0; i < size; i++) {
-    double new_pixel = img->pixel[i] * factor; // multiplicar pelo fator
-    PIXMEM += 1;
+struct brighten_job {
+  Image img;
+  double factor;
+};
+
+static void brightenTask(void *arg, long begin, long end) {
+  const struct brighten_job *job = arg;
+  uint8 *pixel = job->img->pixel;
+  uint8 maxval = job->img->maxval;
+  for (long i = begin; i < end; i++) {
+    double new_pixel = pixel[i] * job->factor; // multiplicar pelo fator
     if (new_pixel > maxval) {
       // Saturar
-      img->pixel[i] = maxval;
-      PIXMEM += 1; 
+      pixel[i] = maxval;
     } else {
       // Não saturar (0.5 é para arredondar)
-      img->pixel[i] = (int)(new_pixel + 0.5);
-      PIXMEM += 1; 
+      pixel[i] = (int)(new_pixel + 0.5);
     }
   }
 }
 
+void ImageBrighten(Image img, double factor) { ///
+  assert(img != NULL);
+  assert(factor >= 0.0);
+  // Written by us
+  long size = (long)img->width * img->height;
+  struct brighten_job job = {img, factor};
+  // Percorrer o array de pixeis (em paralelo) e aplicar a transformação
+  PoolParallelFor(size, PAR_MIN_PIXELS, brightenTask, &job);
+  PIXMEM_ADD(2 * (unsigned long)size); // one read and one write per pixel
+}
+
+/// Rectangle variants.
+/// These apply the transformation above only to the pixels inside the
+/// rectangle with top left corner (x, y), width w and height h.
+/// Requires: the rectangle must be inside img.
+
+// The rectangle variants run the tasks above on the pixel range of each
+// row of the rectangle, with rows in parallel.
+struct rect_job {
+  Image img;
+  int x, y, w;
+  PoolTask task; // task on a range of pixel indices
+  void *arg;     // argument of task
+};
+
+static void rectRowsTask(void *arg, long begin, long end) {
+  const struct rect_job *job = arg;
+  for (long r = begin; r < end; r++) {
+    const long i = G(job->img, job->x, job->y + (int)r);
+    job->task(job->arg, i, i + job->w);
+  }
+}
+
+// Run task on the pixels of each row of the rectangle.
+static void rectApply(Image img, int x, int y, int w, int h, PoolTask task,
+                      void *arg) {
+  assert(ImageValidRect(img, x, y, w, h));
+  struct rect_job job = {img, x, y, w, task, arg};
+  if (w > 0)
+    PoolParallelFor(h, parGrain(w), rectRowsTask, &job);
+}
+
+void ImageNegativeRect(Image img, int x, int y, int w, int h) { ///
+  assert(img != NULL);
+  rectApply(img, x, y, w, h, negativeTask, img);
+  PIXMEM_ADD((unsigned long)w * h);
+}
+
+void ImageThresholdRect(Image img, int x, int y, int w, int h, uint8 thr) { ///
+  assert(img != NULL);
+  struct threshold_job job = {img, thr};
+  rectApply(img, x, y, w, h, thresholdTask, &job);
+  PIXMEM_ADD((unsigned long)w * h);
+}
+
+void ImageBrightenRect(Image img, int x, int y, int w, int h, double factor) { ///
+  assert(img != NULL);
+  assert(factor >= 0.0);
+  struct brighten_job job = {img, factor};
+  rectApply(img, x, y, w, h, brightenTask, &job);
+  PIXMEM_ADD(2 * (unsigned long)w * h); // one read and one write per pixel
+}
+
 /// Geometric transformations
 
 /// These functions apply geometric transformations to an image,
@@ -469,6 +971,80 @@ void ImageBrighten(Image img, double factor) { ///
 // Implementation hint:
 // Call ImageCreate whenever you need a new image!
 
+// Tile size (in pixels) for rotations.
+// Quarter turns read and write one tile at a time, so that both the rows
+// of the source and the columns of the result are cache-friendly.
+#define ROT_TILE 64
+
+// Work shared by the rows of a quarter turn
+struct rotate_job {
+  Image img;
+  Image out;
+  int q;
+};
+
+// Rotate source rows [begin, end) (q == 2) or rows of tiles [begin, end)
+// (q == 1 or 3) of job->img.
+static void rotateTask(void *arg, long begin, long end) {
+  const struct rotate_job *job = arg;
+  const int w = job->img->width;
+  const int h = job->img->height;
+  const int q = job->q;
+  const uint8 *src = job->img->pixel;
+  uint8 *dst = job->out->pixel;
+  if (q == 2) {
+    for (int y = (int)begin; y < end; y++) {
+      const uint8 *s = &src[(size_t)y * w];
+      uint8 *d = &dst[(size_t)(h - 1 - y) * w + (w - 1)];
+      for (int x = 0; x < w; x++)
+        d[-x] = s[x];
+    }
+    return;
+  }
+  for (long t = begin; t < end; t++) {
+    int y0 = (int)t * ROT_TILE;
+    int y1 = y0 + ROT_TILE < h ? y0 + ROT_TILE : h;
+    for (int x0 = 0; x0 < w; x0 += ROT_TILE) {
+      int x1 = x0 + ROT_TILE < w ? x0 + ROT_TILE : w;
+      for (int x = x0; x < x1; x++) {
+        // Column x of src becomes row w-1-x (q == 1) or row x (q == 3)
+        if (q == 1) {
+          uint8 *d = &dst[(size_t)(w - 1 - x) * h];
+          for (int y = y0; y < y1; y++)
+            d[y] = src[(size_t)y * w + x];
+        } else {
+          uint8 *d = &dst[(size_t)x * h + (h - 1)];
+          for (int y = y0; y < y1; y++)
+            d[-y] = src[(size_t)y * w + x];
+        }
+      }
+    }
+  }
+}
+
+// Rotate img by q quarter turns anti-clockwise (q = 1, 2 or 3).
+// Rows of tiles are rotated in parallel.
+// Returns the new image, or NULL on failure (errno/errCause set).
+static Image rotateQuarter(Image img, int q) {
+  assert(1 <= q && q <= 3);
+  const int w = img->width;
+  const int h = img->height;
+  Image out = q == 2 ? imageCreateRaw(w, h, img->maxval)
+                     : imageCreateRaw(h, w, img->maxval);
+  if (out == NULL)
+    return NULL;
+  struct rotate_job job = {img, out, q};
+  if (q == 2)
+    fillPixels("ImageRotate", out->pixel, out->width, out->height, h,
+               parGrain(w), rotateTask, &job);
+  else
+    fillPixels("ImageRotate", out->pixel, out->width, out->height,
+               (h + ROT_TILE - 1) / ROT_TILE, parGrain((long)ROT_TILE * w),
+               rotateTask, &job);
+  PIXMEM_ADD(2 * (unsigned long)w * h); // count pixel memory accesses
+  return out;
+}
+
 /// Rotate an image.
 /// Returns a rotated version of the image.
 /// The rotation is 90 degrees anti-clockwise.
@@ -480,20 +1056,161 @@ void ImageBrighten(Image img, double factor) { ///
 Image ImageRotate(Image img) { ///
   assert(img != NULL);
   // Written by us
-  // Criação da nova imagem
-  Image img_rotated = ImageCreate(img->height, img->width, img->maxval);
-  // Percorrer linhas & colunas
-  for (int x = 0; x < img->width; x++) {
-    for (int y = 0; y < img->height;
-         y++) { // aqui não é preciso o Pixmem++, pois já é contado nas funções
-                // chamadas
-      uint8 pixel = ImageGetPixel(img, x, y);
-      ImageSetPixel(img_rotated, y, img->width - x - 1,
-                    pixel); // 90 graus anti-clockwise
+  return rotateQuarter(img, 1); // 90 graus anti-clockwise
+}
+
+// Work shared by the rows of tiles of an arbitrary rotation
+struct rotangle_job {
+  Image img;
+  Image out;
+  ImageInterp interp;
+  uint8 fill;
+  double c, s;    // cosine and sine of the angle
+  int64_t du, dv; // source step per output pixel, in 16.16 fixed point
+};
+
+// Compute rows of tiles [begin, end) of an arbitrary rotation.
+// Source coordinates (in 16.16 fixed point) advance by (du, dv) for each
+// output pixel along a row.  They are recomputed at the start of each
+// row of each tile, so rounding errors do not accumulate.
+static void rotateAngleTask(void *arg, long begin, long end) {
+  const struct rotangle_job *job = arg;
+  const Image out = job->out;
+  const int w = job->img->width;
+  const int h = job->img->height;
+  const int w2 = out->width;
+  const int h2 = out->height;
+  const double c = job->c;
+  const double s = job->s;
+  const double one = 65536.0;
+  const int64_t du = job->du;
+  const int64_t dv = job->dv;
+  const int64_t umax = (int64_t)w << 16;
+  const int64_t vmax = (int64_t)h << 16;
+  const uint8 *src = job->img->pixel;
+  const uint8 fill = job->fill;
+  unsigned long reads = 0;
+
+  for (long t = begin; t < end; t++) {
+    int ty = (int)t * ROT_TILE;
+    int ty1 = ty + ROT_TILE < h2 ? ty + ROT_TILE : h2;
+    for (int tx = 0; tx < w2; tx += ROT_TILE) {
+      int tx1 = tx + ROT_TILE < w2 ? tx + ROT_TILE : w2;
+      for (int y = ty; y < ty1; y++) {
+        // Source position of the center of output pixel (tx, y)
+        double ox = tx + 0.5 - w2 / 2.0;
+        double oy = y + 0.5 - h2 / 2.0;
+        int64_t u = (int64_t)llround((ox * c - oy * s + w / 2.0) * one);
+        int64_t v = (int64_t)llround((ox * s + oy * c + h / 2.0) * one);
+        uint8 *dst = &out->pixel[G(out, 0, y)];
+        for (int x = tx; x < tx1; x++, u += du, v += dv) {
+          if (u < 0 || u >= umax || v < 0 || v >= vmax) {
+            dst[x] = fill;
+          } else if (job->interp == IMAGE_INTERP_NEAREST) {
+            dst[x] = src[(size_t)(v >> 16) * w + (u >> 16)];
+            reads += 1;
+          } else {
+            // Interpolate between pixel centers, clamping at the edges
+            int64_t a = u - 32768;
+            int64_t b = v - 32768;
+            int x0 = (int)(a >> 16), y0 = (int)(b >> 16);
+            uint32_t fx = (uint32_t)((a >> 8) & 255);
+            uint32_t fy = (uint32_t)((b >> 8) & 255);
+            int x1 = x0 + 1 < w ? x0 + 1 : w - 1;
+            int y1 = y0 + 1 < h ? y0 + 1 : h - 1;
+            x0 = x0 < 0 ? 0 : x0;
+            y0 = y0 < 0 ? 0 : y0;
+            const uint8 *r0 = &src[(size_t)y0 * w];
+            const uint8 *r1 = &src[(size_t)y1 * w];
+            uint32_t top = r0[x0] * (256 - fx) + r0[x1] * fx;
+            uint32_t bot = r1[x0] * (256 - fx) + r1[x1] * fx;
+            dst[x] = (uint8)((top * (256 - fy) + bot * fy + 32768) >> 16);
+            reads += 4;
+          }
+        }
+      }
     }
   }
+  pixmemAdd(reads);
+}
+
+/// Rotate an image by an arbitrary angle.
+/// Returns a version of img rotated by the given angle, in degrees,
+/// anti-clockwise (negative angles rotate clockwise).
+/// The result is just large enough to contain the whole rotated image;
+/// its pixels not covered by img are set to fill.
+/// Pixels are sampled with nearest-neighbor or bilinear interpolation.
+/// Multiples of 90 degrees are exact and as fast as ImageRotate.
+/// Requires: fill <= maxval of img.
+/// Ensures: The original img is not modified.
+///
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageRotateAngle(Image img, double degrees, ImageInterp interp,
+                       uint8 fill) { ///
+  assert(img != NULL);
+  assert(fill <= img->maxval);
+  const int w = img->width;
+  const int h = img->height;
+
+  double d = fmod(degrees, 360.0);
+  if (d < 0.0)
+    d += 360.0;
+  if (d == 90.0 || d == 180.0 || d == 270.0)
+    return rotateQuarter(img, (int)(d / 90.0));
+  if (d == 0.0)
+    return ImageCopy(img);
+
+  const double rad = d * M_PI / 180.0;
+  const double c = cos(rad);
+  const double s = sin(rad);
+  // Bounding box of the rotated image (ignore rounding noise)
+  const int w2 = (int)ceil(w * fabs(c) + h * fabs(s) - 1e-4);
+  const int h2 = (int)ceil(w * fabs(s) + h * fabs(c) - 1e-4);
+  Image out = imageCreateRaw(w2, h2, img->maxval);
+  if (out == NULL)
+    return NULL;
+
+  const double one = 65536.0;
+  struct rotangle_job job = {img, out, interp, fill, c, s,
+                             (int64_t)llround(c * one),
+                             (int64_t)llround(s * one)};
+  fillPixels("ImageRotateAngle", out->pixel, w2, h2,
+             (h2 + ROT_TILE - 1) / ROT_TILE, parGrain((long)ROT_TILE * w2),
+             rotateAngleTask, &job);
+  PIXMEM_ADD((unsigned long)w2 * h2); // count pixel memory accesses (writes)
+  return out;
+}
+
+// Copying of rows, with an offset into the source, or mirrored.
+struct copy_job {
+  Image img;
+  Image out;
+  int x, y; // position of out in img
+};
 
-  return img_rotated;
+// Copy rows [begin, end) of job->out from job->img.
+static void copyTask(void *arg, long begin, long end) {
+  const struct copy_job *job = arg;
+  const int w = job->out->width;
+  for (long y = begin; y < end; y++)
+    memcpy(&job->out->pixel[G(job->out, 0, (int)y)],
+           &job->img->pixel[G(job->img, job->x, job->y + (int)y)], (size_t)w);
+  pixmemAdd(2 * (unsigned long)w * (end - begin)); // one read and one write per pixel
+}
+
+// Mirror rows [begin, end) of job->img into job->out.
+static void mirrorTask(void *arg, long begin, long end) {
+  const struct copy_job *job = arg;
+  const int w = job->img->width;
+  for (long y = begin; y < end; y++) {
+    const uint8 *src = &job->img->pixel[G(job->img, 0, (int)y)];
+    uint8 *dst = &job->out->pixel[G(job->out, 0, (int)y)];
+    for (int x = 0; x < w; x++)
+      dst[w - x - 1] = src[x]; // Mirror/Flip left-right
+  }
+  pixmemAdd(2 * (unsigned long)w * (end - begin)); // one read and one write per pixel
 }
 
 /// Mirror an image = flip left-right.
@@ -507,17 +1224,34 @@ Image ImageMirror(Image img) { ///
   assert(img != NULL);
   // written by us
   // Criação da nova imagem
-  Image img_mirrored = ImageCreate(img->width, img->height, img->maxval);
-  for (int x = 0; x < img->width; x++) {
-    for (int y = 0; y < img->height; y++) {
-      uint8 pixel = ImageGetPixel(img, x, y);
-      ImageSetPixel(img_mirrored, img->width - x - 1, y,
-                    pixel); // Mirror/Flip left-right
-    }
-  }
+  Image img_mirrored = imageCreateRaw(img->width, img->height, img->maxval);
+  if (img_mirrored == NULL)
+    return NULL;
+  struct copy_job job = {img, img_mirrored, 0, 0};
+  if (img->width > 0)
+    fillPixels("ImageMirror", img_mirrored->pixel, img->width, img->height,
+               img->height, parGrain(img->width), mirrorTask, &job);
   return img_mirrored;
 }
 
+/// Copy an image.
+/// Returns a new image with the same size, maxval and pixels as img.
+/// Ensures: The original img is not modified.
+///
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageCopy(Image img) { ///
+  assert(img != NULL);
+  Image copy = imageCreateRaw(img->width, img->height, img->maxval);
+  if (copy != NULL && img->width > 0) {
+    struct copy_job job = {img, copy, 0, 0};
+    fillPixels("ImageCopy", copy->pixel, img->width, img->height,
+               img->height, parGrain(img->width), copyTask, &job);
+  }
+  return copy;
+}
+
 /// Crop a rectangular subimage from img.
 /// The rectangle is specified by the top left corner coords (x, y) and
 /// width w and height h.
@@ -535,40 +1269,299 @@ Image ImageCrop(Image img, int x, int y, int w, int h) { ///
   assert(ImageValidRect(img, x, y, w, h));
   // Written by us
   // x,y,w,h já estão asserted no ImageValidRect
-  Image img_cropped = ImageCreate(w, h, img->maxval);
+  Image img_cropped = imageCreateRaw(w, h, img->maxval);
+  if (img_cropped == NULL)
+    return NULL;
 
-  for (int x_cord = x; x_cord < x + w; x_cord++) {
-    for (int y_cord = y; y_cord < y + h; y_cord++) {
-      uint8 pixel = ImageGetPixel(img, x_cord, y_cord);
-      ImageSetPixel(img_cropped, x_cord - x, y_cord - y, pixel);
-    }
-  }
+  struct copy_job job = {img, img_cropped, x, y};
+  if (w > 0)
+    fillPixels("ImageCrop", img_cropped->pixel, w, h, h, parGrain(w),
+               copyTask, &job);
   return img_cropped;
 }
 
-/// Operations on two images
+// Resampling
+//
+// ImageResize computes each output pixel as a separable weighted sum of
+// source pixels, in integer arithmetic.  For each axis, a table gives, for
+// each output coordinate, the first source coordinate, the number of source
+// pixels, and their integer weights.
+//
+// IMAGE_RESIZE_AREA: output pixel j of an axis covers [j*n1, (j+1)*n1) and
+// source pixel i covers [i*n2, (i+1)*n2), in units of 1/n2 source pixels.
+// The weights are the (integer) overlaps, so they add up to n1 exactly.
+// IMAGE_RESIZE_BILINEAR: pixel centers are aligned, and each output pixel
+// takes 2 source pixels with weights in 1/256ths (edges are clamped).
+//
+// Output rows are computed from horizontally resampled source rows, which
+// are kept in a small ring buffer, so each source row is resampled once.
+// The vertical combination runs along whole rows and is vectorized.
+// Bands of output rows are computed in parallel, each by a worker thread
+// with its own ring buffer.
 
-/// Paste an image into a larger image.
-/// Paste img2 into position (x, y) of img1.
-/// This modifies img1 in-place: no allocation involved.
-/// Requires: img2 must fit inside img1 at position (x, y).
-void ImagePaste(Image img1, int x, int y, Image img2) { ///
-  assert(img1 != NULL);
-  assert(img2 != NULL);
-  assert(ImageValidRect(img1, x, y, img2->width, img2->height));
-  // Written by us
-  for (int x_cord = x; x_cord < x + img2->width; x_cord++) {
-    for (int y_cord = y; y_cord < y + img2->height; y_cord++) {
-      uint8 pixel = ImageGetPixel(img2, x_cord - x, y_cord - y);
-      ImageSetPixel(img1, x_cord, y_cord, pixel);
+// Resampling table for one axis
+struct resize_axis {
+  int *first;       // first source coordinate of each output coordinate
+  int *count;       // number of source pixels of each output coordinate
+  size_t *woff;     // offset of weights of each output coordinate
+  uint32_t *weight; // weights (all output coordinates)
+  uint32_t total;   // sum of weights of each output coordinate
+  int maxcount;     // maximum count
+};
+
+static void resizeAxisFree(struct resize_axis *a) {
+  free(a->first);
+  free(a->count);
+  free(a->woff);
+  free(a->weight);
+}
+
+// Build the table to resample an axis of n1 source pixels to n2 pixels.
+// Requires: n1 > 0 and n2 > 0.
+// Returns 0 and sets errCause on failure.
+static int resizeAxisInit(struct resize_axis *a, int n1, int n2,
+                          ImageResizeMode mode) {
+  // Area weights span at most n1/n2 + 2 pixels; bilinear, 2 pixels
+  size_t nweights = (size_t)n1 + 2 * (size_t)n2;
+  memset(a, 0, sizeof(*a));
+  if (!(check((a->first = (int *)malloc((size_t)n2 * sizeof(int))) != NULL,
+              "Allocation failed") &&
+        check((a->count = (int *)malloc((size_t)n2 * sizeof(int))) != NULL,
+              "Allocation failed") &&
+        check((a->woff = (size_t *)malloc((size_t)n2 * sizeof(size_t))) !=
+                  NULL,
+              "Allocation failed") &&
+        check((a->weight = (uint32_t *)malloc(nweights * sizeof(uint32_t))) !=
+                  NULL,
+              "Allocation failed"))) {
+    errsave = errno;
+    resizeAxisFree(a);
+    errno = errsave;
+    return 0;
+  }
+
+  size_t off = 0;
+  for (int j = 0; j < n2; j++) {
+    a->woff[j] = off;
+    if (mode == IMAGE_RESIZE_AREA) {
+      int64_t lo = (int64_t)j * n1;
+      int64_t hi = lo + n1;
+      int i0 = (int)(lo / n2);
+      int i1 = (int)((hi - 1) / n2);
+      a->first[j] = i0;
+      a->count[j] = i1 - i0 + 1;
+      for (int i = i0; i <= i1; i++) {
+        int64_t plo = (int64_t)i * n2;
+        int64_t phi = plo + n2;
+        a->weight[off++] =
+            (uint32_t)((phi < hi ? phi : hi) - (plo > lo ? plo : lo));
+      }
+    } else {
+      // Source coordinate of output pixel center, in 1/256ths
+      int64_t s = (((2 * (int64_t)j + 1) * n1 * 256) / n2 - 256) / 2;
+      if (s <= 0 || s >= (int64_t)(n1 - 1) * 256) {
+        a->first[j] = s <= 0 ? 0 : n1 - 1;
+        a->count[j] = 1;
+        a->weight[off++] = 256;
+      } else {
+        a->first[j] = (int)(s >> 8);
+        a->count[j] = 2;
+        a->weight[off++] = 256 - (uint32_t)(s & 255);
+        a->weight[off++] = (uint32_t)(s & 255);
+      }
     }
+    if (a->count[j] > a->maxcount)
+      a->maxcount = a->count[j];
   }
+  assert(off <= nweights);
+  a->total = mode == IMAGE_RESIZE_AREA ? (uint32_t)n1 : 256;
+  return 1;
 }
 
-/// Blend an image into a larger image.
-/// Blend img2 into position (x, y) of img1.
-/// This modifies img1 in-place: no allocation involved.
-/// Requires: img2 must fit inside img1 at position (x, y).
+// Resample source row sy of img horizontally into hrow (width ax->n2).
+// Returns the number of pixels read.
+static unsigned long resizeRow(Image img, int sy, const struct resize_axis *ax,
+                      int w2, uint32_t *hrow) {
+  const uint8 *src = &img->pixel[G(img, 0, sy)];
+  for (int x = 0; x < w2; x++) {
+    const uint8 *p = &src[ax->first[x]];
+    const uint32_t *wt = &ax->weight[ax->woff[x]];
+    uint32_t sum = 0;
+    for (int i = 0; i < ax->count[x]; i++)
+      sum += wt[i] * p[i];
+    hrow[x] = sum;
+  }
+  return (unsigned long)img->width;
+}
+
+// Compute output rows [y0, y1) of the resized image.
+// ring holds ay->maxcount resampled source rows; rowid, their source rows.
+// Returns the number of pixels accessed.
+static unsigned long resizeBand(Image img, Image out,
+                                const struct resize_axis *ax,
+                                const struct resize_axis *ay, int y0, int y1,
+                                uint32_t *ring, int *rowid, uint64_t *acc) {
+  const int w2 = out->width;
+  const uint64_t total = (uint64_t)ax->total * ay->total;
+  unsigned long count = 0;
+  for (int i = 0; i < ay->maxcount; i++)
+    rowid[i] = -1;
+  for (int y = y0; y < y1; y++) {
+    const uint32_t *wt = &ay->weight[ay->woff[y]];
+    for (int x = 0; x < w2; x++)
+      acc[x] = total / 2; // for rounding
+    for (int i = 0; i < ay->count[y]; i++) {
+      int sy = ay->first[y] + i;
+      int slot = sy % ay->maxcount;
+      uint32_t *hrow = &ring[(size_t)slot * w2];
+      if (rowid[slot] != sy) {
+        count += resizeRow(img, sy, ax, w2, hrow);
+        rowid[slot] = sy;
+      }
+      const uint64_t c = wt[i];
+      for (int x = 0; x < w2; x++)
+        acc[x] += c * hrow[x];
+    }
+    uint8 *dst = &out->pixel[G(out, 0, y)];
+    if (total == 65536) {
+      for (int x = 0; x < w2; x++)
+        dst[x] = (uint8)(acc[x] >> 16);
+    } else {
+      for (int x = 0; x < w2; x++)
+        dst[x] = (uint8)(acc[x] / total);
+    }
+    count += (unsigned long)w2;
+  }
+  return count;
+}
+
+// Per-worker scratch buffers of resizeBand
+struct resize_scratch {
+  uint32_t *ring;
+  int *rowid;
+  uint64_t *acc;
+};
+
+// Work shared by the bands of a resize
+struct resize_job {
+  Image img;
+  Image out;
+  const struct resize_axis *ax;
+  const struct resize_axis *ay;
+  struct resize_scratch *scratch; // one per worker
+};
+
+// Compute output rows [begin, end) as one band.
+static void resizeTask(void *arg, long begin, long end) {
+  const struct resize_job *job = arg;
+  struct resize_scratch *s = &job->scratch[PoolWorkerId()];
+  pixmemAdd(resizeBand(job->img, job->out, job->ax, job->ay, (int)begin,
+                       (int)end, s->ring, s->rowid, s->acc));
+}
+
+/// Resize an image.
+/// Returns a version of img scaled to w x h pixels.
+/// With IMAGE_RESIZE_AREA, each output pixel is the (rounded) mean of the
+/// source area it covers, computed exactly: best for shrinking.
+/// With IMAGE_RESIZE_BILINEAR, each output pixel is interpolated from the
+/// 2x2 nearest source pixels: best for enlarging.
+/// Requires: w, h > 0, and img is not empty.
+/// Ensures: The original img is not modified.
+///
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageResize(Image img, int w, int h, ImageResizeMode mode) { ///
+  assert(img != NULL);
+  assert(w > 0 && h > 0);
+  assert(img->width > 0 && img->height > 0);
+  struct resize_axis ax, ay;
+  int haveax = 0, haveay = 0;
+  Image out = NULL;
+  const long grain = parGrain(w);
+  const int nthreads = PoolJobThreads(h, grain);
+  struct resize_scratch *scratch = NULL;
+  int nscratch = 0;
+
+  int success =
+      (haveax = resizeAxisInit(&ax, img->width, w, mode)) &&
+      (haveay = resizeAxisInit(&ay, img->height, h, mode)) &&
+      check((scratch = (struct resize_scratch *)calloc(
+                 (size_t)nthreads, sizeof(struct resize_scratch))) != NULL,
+            "Allocation failed");
+  for (; success && nscratch < nthreads; nscratch++) {
+    struct resize_scratch *s = &scratch[nscratch];
+    success =
+        check((s->ring = (uint32_t *)malloc((size_t)ay.maxcount * w *
+                                            sizeof(uint32_t))) != NULL,
+              "Allocation failed") &&
+        check((s->rowid = (int *)malloc((size_t)ay.maxcount * sizeof(int))) !=
+                  NULL,
+              "Allocation failed") &&
+        check((s->acc = (uint64_t *)malloc((size_t)w * sizeof(uint64_t))) !=
+                  NULL,
+              "Allocation failed");
+  }
+  success = success && (out = imageCreateRaw(w, h, img->maxval)) != NULL;
+
+  if (success) {
+    struct resize_job job = {img, out, &ax, &ay, scratch};
+    fillPixels("ImageResize", out->pixel, w, h, h, grain, resizeTask, &job);
+  }
+
+  // Cleanup
+  errsave = errno;
+  if (haveax)
+    resizeAxisFree(&ax);
+  if (haveay)
+    resizeAxisFree(&ay);
+  for (int i = 0; i < nscratch; i++) {
+    free(scratch[i].ring);
+    free(scratch[i].rowid);
+    free(scratch[i].acc);
+  }
+  free(scratch);
+  errno = errsave;
+  return out;
+}
+
+/// Operations on two images
+
+/// Paste an image into a larger image.
+/// Paste img2 into position (x, y) of img1.
+/// This modifies img1 in-place: no allocation involved.
+/// Requires: img2 must fit inside img1 at position (x, y).
+void ImagePaste(Image img1, int x, int y, Image img2) { ///
+  assert(img1 != NULL);
+  assert(img2 != NULL);
+  assert(ImageValidRect(img1, x, y, img2->width, img2->height));
+  // Written by us
+  const int w = img2->width;
+  for (int y_cord = 0; w > 0 && y_cord < img2->height; y_cord++) {
+    memcpy(&img1->pixel[G(img1, x, y + y_cord)],
+           &img2->pixel[G(img2, 0, y_cord)], (size_t)w);
+    PIXMEM_ADD(2 * (unsigned long)w); // one read and one write per pixel
+  }
+}
+
+// Level of a pixel of level v blended with level p, as in ImageBlend.
+// Adds 1 to (*saturated) if the result saturates at maxval.
+static inline uint8 blendLevel(uint8 v, uint8 p, double alpha, uint8 maxval,
+                               unsigned long *saturated) {
+  double new_pixel = (int)(v * (1 - alpha) + p * alpha + 0.5); // Arredondar
+  if (new_pixel > maxval) {
+    new_pixel = maxval;
+    (*saturated)++; // Saturar
+  }
+  if (new_pixel < 0)
+    new_pixel = 0; // Saturar
+  return new_pixel;
+}
+
+/// Blend an image into a larger image.
+/// Blend img2 into position (x, y) of img1.
+/// This modifies img1 in-place: no allocation involved.
+/// Requires: img2 must fit inside img1 at position (x, y).
 /// alpha usually is in [0.0, 1.0], but values outside that interval
 /// may provide interesting effects.  Over/underflows should saturate.
 void ImageBlend(Image img1, int x, int y, Image img2, double alpha) {
@@ -576,21 +1569,202 @@ void ImageBlend(Image img1, int x, int y, Image img2, double alpha) {
   assert(img2 != NULL);
   assert(ImageValidRect(img1, x, y, img2->width, img2->height));
   // Written by us
-  for (int x_cord = x; x_cord < x + img2->width; x_cord++) {
-    for (int y_cord = y; y_cord < y + img2->height; y_cord++) {
-      uint8 pixel1 = ImageGetPixel(img1, x_cord, y_cord);
-      uint8 pixel2 = ImageGetPixel(img2, x_cord - x, y_cord - y);
-      double new_pixel =
-          (int)(pixel1 * (1 - alpha) + pixel2 * alpha + 0.5); // Arredondar
-      if (new_pixel > img1->maxval) {
-        new_pixel = img1->maxval;
-        PIXMEM += 1; // Saturar
+  const int w = img2->width;
+  for (int y_cord = 0; w > 0 && y_cord < img2->height; y_cord++) {
+    uint8 *dst = &img1->pixel[G(img1, x, y + y_cord)];
+    const uint8 *src = &img2->pixel[G(img2, 0, y_cord)];
+    unsigned long saturated = 0;
+    for (int x_cord = 0; x_cord < w; x_cord++)
+      dst[x_cord] = blendLevel(dst[x_cord], src[x_cord], alpha, img1->maxval,
+                               &saturated);
+    // two reads and one write per pixel, plus one per saturated pixel
+    PIXMEM_ADD(3 * (unsigned long)w + saturated);
+  }
+}
+
+// ImageBlendMask splits the rows of img2 among threads.  The inner loop
+// only uses 16-bit integer arithmetic, so the compiler vectorizes it.
+// Division by 255 uses t/255 == (t + 1 + (t >> 8)) >> 8, which is exact
+// for 0 <= t <= 255*255 + 127.
+struct blend_mask_job {
+  Image img1;
+  int x, y;
+  Image img2;
+  Image mask;
+};
+
+static void blendMaskTask(void *arg, long begin, long end) {
+  const struct blend_mask_job *job = arg;
+  const int w = job->img2->width;
+  const uint8 maxval = job->img1->maxval;
+  for (long r = begin; r < end; r++) {
+    uint8 *dst = &job->img1->pixel[G(job->img1, job->x, job->y + (int)r)];
+    const uint8 *src = &job->img2->pixel[G(job->img2, 0, (int)r)];
+    const uint8 *alpha = &job->mask->pixel[G(job->mask, 0, (int)r)];
+    for (int i = 0; i < w; i++) {
+      uint16_t a = alpha[i];
+      uint16_t t = a * src[i] + (255 - a) * dst[i] + 127;
+      uint16_t v = (t + 1 + (t >> 8)) >> 8; // t / 255
+      dst[i] = v < maxval ? v : maxval;
+    }
+  }
+}
+
+/// Blend an image into a larger image, with an alpha mask.
+/// Blend img2 into position (x, y) of img1, with alpha mask->level/255
+/// at each pixel of img2: each level becomes
+///   (a*s + (255-a)*d + 127)/255 (rounded, saturated at img1's maxval),
+/// where d is the level in img1, s the level in img2 and a the level in mask.
+/// This modifies img1 in-place: no allocation involved.
+/// Requires: img2 must fit inside img1 at position (x, y), and mask must
+/// have the same size as img2.
+void ImageBlendMask(Image img1, int x, int y, Image img2, Image mask) { ///
+  assert(img1 != NULL);
+  assert(img2 != NULL);
+  assert(mask != NULL);
+  assert(ImageValidRect(img1, x, y, img2->width, img2->height));
+  assert(mask->width == img2->width && mask->height == img2->height);
+  const int w = img2->width;
+  const int h = img2->height;
+  if (w == 0)
+    return;
+  struct blend_mask_job job = {img1, x, y, img2, mask};
+  PoolParallelFor(h, parGrain(w), blendMaskTask, &job);
+  PIXMEM_ADD(4 * (unsigned long)w * h); // three reads and one write per pixel
+}
+
+// Compositing
+//
+// ImageBlendMany splits the rows of dst that some layer covers among
+// threads.  Each row is processed in segments of BLEND_SEG pixels: the
+// segment is copied to a buffer, every layer that overlaps it is blended
+// into the buffer in order, and the buffer is copied back.
+// To give exactly the results of ImageBlend, the levels are computed with
+// blendLevel.  For large layers, a table with blendLevel(v, p) for every
+// pair of levels is computed first, so the inner loop is a table lookup.
+
+#define BLEND_SEG 4096
+
+struct blend_layer {
+  Image img;
+  int x, y;            // position in dst
+  double alpha;
+  const uint8 *table;  // blendLevel(v, p) at [v * 256 + p], or NULL
+};
+
+struct blend_job {
+  Image dst;
+  int y0;  // first row (rows are y0 + begin .. y0 + end - 1)
+  int n;
+  const struct blend_layer *layer;
+};
+
+static void blendTask(void *arg, long begin, long end) {
+  const struct blend_job *job = arg;
+  Image dst = job->dst;
+  uint8 buf[BLEND_SEG];
+  unsigned long count = 0;
+  for (long r = begin; r < end; r++) {
+    const int y = job->y0 + (int)r;
+    for (int x0 = 0; x0 < dst->width; x0 += BLEND_SEG) {
+      const int x1 = x0 + BLEND_SEG < dst->width ? x0 + BLEND_SEG : dst->width;
+      // Part [lo, hi) of the segment covered by layers
+      int lo = x1, hi = x0;
+      for (int i = 0; i < job->n; i++) {
+        const struct blend_layer *l = &job->layer[i];
+        if (y < l->y || y >= l->y + l->img->height)
+          continue;
+        const int a = l->x > x0 ? l->x : x0;
+        const int b = l->x + l->img->width < x1 ? l->x + l->img->width : x1;
+        if (a < b) {
+          lo = a < lo ? a : lo;
+          hi = b > hi ? b : hi;
+        }
       }
-      if (new_pixel < 0)
-        new_pixel = 0; // Saturar
-      ImageSetPixel(img1, x_cord, y_cord, new_pixel);
+      if (lo >= hi)
+        continue;
+      uint8 *row = &dst->pixel[G(dst, 0, y)];
+      memcpy(&buf[lo - x0], &row[lo], (size_t)(hi - lo));
+      count += 2 * (unsigned long)(hi - lo); // one read and one write
+      for (int i = 0; i < job->n; i++) {
+        const struct blend_layer *l = &job->layer[i];
+        if (y < l->y || y >= l->y + l->img->height)
+          continue;
+        const int a = l->x > lo ? l->x : lo;
+        const int b = l->x + l->img->width < hi ? l->x + l->img->width : hi;
+        if (a >= b)
+          continue;
+        const uint8 *src = &l->img->pixel[G(l->img, a - l->x, y - l->y)];
+        uint8 *out = &buf[a - x0];
+        if (l->table != NULL) {
+          for (int x = 0; x < b - a; x++)
+            out[x] = l->table[out[x] * 256 + src[x]];
+        } else {
+          unsigned long saturated = 0;
+          for (int x = 0; x < b - a; x++)
+            out[x] = blendLevel(out[x], src[x], l->alpha, dst->maxval,
+                                &saturated);
+        }
+        count += (unsigned long)(b - a); // one read per layer pixel
+      }
+      memcpy(&row[lo], &buf[lo - x0], (size_t)(hi - lo));
+    }
+  }
+  pixmemAdd(count);
+}
+
+/// Blend several images into a larger image, in a single pass.
+/// Blends layers[i] into position (positions[2*i], positions[2*i+1]) of
+/// dst with alpha alphas[i], for i = 0..n-1, in that order.
+/// The result is exactly that of the n corresponding ImageBlend calls,
+/// but each row of dst is read and written only once.
+/// This modifies dst in-place.
+/// Requires: each layer must fit inside dst at its position.
+void ImageBlendMany(Image dst, Image layers[], const int positions[],
+                    const double alphas[], int n) { ///
+  assert(dst != NULL);
+  assert(n >= 0);
+  if (n == 0)
+    return;
+  struct blend_layer *layer = malloc((size_t)n * sizeof(*layer));
+  if (layer == NULL) { // fall back to blending each layer
+    for (int i = 0; i < n; i++)
+      ImageBlend(dst, positions[2 * i], positions[2 * i + 1], layers[i],
+                 alphas[i]);
+    return;
+  }
+  int ymin = dst->height, ymax = 0;
+  for (int i = 0; i < n; i++) {
+    Image img = layers[i];
+    assert(img != NULL);
+    assert(ImageValidRect(dst, positions[2 * i], positions[2 * i + 1],
+                          img->width, img->height));
+    layer[i] = (struct blend_layer){img, positions[2 * i],
+                                    positions[2 * i + 1], alphas[i], NULL};
+    if (img->width > 0 && img->height > 0) {
+      ymin = layer[i].y < ymin ? layer[i].y : ymin;
+      ymax = layer[i].y + img->height > ymax ? layer[i].y + img->height : ymax;
+    }
+    // Tables pay off for layers larger than the table
+    if ((long)img->width * img->height >= 256 * 256) {
+      uint8 *table = malloc(256 * 256);
+      if (table != NULL) { // else, blend without table
+        unsigned long saturated = 0;
+        for (int v = 0; v < 256; v++)
+          for (int p = 0; p < 256; p++)
+            table[v * 256 + p] = blendLevel((uint8)v, (uint8)p, alphas[i],
+                                            dst->maxval, &saturated);
+      }
+      layer[i].table = table;
     }
   }
+  if (ymin < ymax) {
+    struct blend_job job = {dst, ymin, n, layer};
+    PoolParallelFor(ymax - ymin, parGrain(dst->width), blendTask, &job);
+  }
+  for (int i = 0; i < n; i++)
+    free((void *)layer[i].table);
+  free(layer);
 }
 
 /* 1ª Abordagem - Sem memcmp
@@ -616,15 +1790,14 @@ int ImageMatchSubImage(Image img1, int x, int y, Image img2) {
 }
 */
 
-int ImageMatchSubImage(Image img1, int x, int y, Image img2) {
-  assert(img1 != NULL);
-  assert(img2 != NULL);
-  assert(ImageValidPos(img1, x, y));
-
+// Compare img2 to the subimage of img1 at (x, y), like ImageMatchSubImage,
+// but add the number of pixels compared to (*count) instead of PIXMEM.
+static int matchSub(Image img1, int x, int y, Image img2,
+                    unsigned long *count) {
   for (int y_cord = 0; y_cord < img2->height; y_cord++) {
     // Use memcmp to compare entire rows at once
     // Use G to get the index
-    PIXMEM+=img2->width;
+    *count += img2->width;
     if (memcmp(&img1->pixel[G(img1, x, y + y_cord)], &img2->pixel[G(img2, 0, y_cord)], img2->width) != 0) {
       return 0; // Rows are not equal
     }
@@ -632,6 +1805,66 @@ int ImageMatchSubImage(Image img1, int x, int y, Image img2) {
   return 1; // All rows are equal
 }
 
+int ImageMatchSubImage(Image img1, int x, int y, Image img2) {
+  assert(img1 != NULL);
+  assert(img2 != NULL);
+  assert(ImageValidPos(img1, x, y));
+  unsigned long count = 0;
+  int match = matchSub(img1, x, y, img2, &count);
+  PIXMEM_ADD(count);
+  return match;
+}
+
+// ImageLocateSubImage searches chunks of columns x in parallel.
+// Each chunk stops at its first match, or as soon as an earlier chunk has
+// found one.  The result is the first match of the earliest chunk, which is
+// the one the sequential scan (x, then y) would find.  PIXMEM counts only
+// the comparisons the sequential scan would do: those of the chunks up to
+// and including that one.
+
+// Per-chunk results of ImageLocateSubImage
+struct locate_chunk {
+  unsigned long count; // pixels compared
+  int found;
+  int x;
+  int y;
+};
+
+struct locate_job {
+  Image img1;
+  Image img2;
+  int ny; // positions in each column
+  long grain;
+  long best; // earliest chunk with a match so far (LONG_MAX if none)
+  struct locate_chunk *chunk;
+};
+
+static void locateTask(void *arg, long begin, long end) {
+  struct locate_job *job = arg;
+  long c = begin / job->grain;
+  struct locate_chunk *r = &job->chunk[c];
+  r->count = 0;
+  r->found = 0;
+  for (int x = (int)begin; x < end; x++) {
+    if (__atomic_load_n(&job->best, __ATOMIC_RELAXED) < c)
+      return; // an earlier chunk has a match
+    for (int y = 0; y < job->ny; y++) {
+      if (matchSub(job->img1, x, y, job->img2, &r->count)) {
+        r->found = 1;
+        r->x = x;
+        r->y = y;
+        long best = __atomic_load_n(&job->best, __ATOMIC_RELAXED);
+        while (c < best &&
+               !__atomic_compare_exchange_n(&job->best, &best, c, 0,
+                                            __ATOMIC_RELAXED,
+                                            __ATOMIC_RELAXED))
+          ;
+        return;
+      }
+    }
+  }
+}
+
 /// Locate a subimage inside another image.
 /// Searches for img2 inside img1.
 /// If a match is found, returns 1 and matching position is set in vars (*px,
@@ -642,18 +1875,459 @@ int ImageLocateSubImage(Image img1, int *px, int *py, Image img2) { ///
   // Written by us
   int x_space = img1->width-img2->width; //the space left between the two images in the x axis
   int y_space = img1->height-img2->height; //the space left between the two images in the y axis
-  for (int x = 0; x < x_space; x++) {
-    for (int y = 0; y < y_space; y++) {
-      if (ImageMatchSubImage(img1, x, y, img2)) {
-        *px = x;
-        *py = y;
-        return 1;
+  if (x_space < 0 || y_space < 0)
+    return 0;
+  // img2 may be at any x <= x_space and y <= y_space (both inclusive)
+  const int nx = x_space + 1;
+  const int ny = y_space + 1;
+
+  // Search chunks of columns in parallel
+  struct locate_chunk one;
+  struct locate_job job = {img1, img2, ny, parGrain(ny), LONG_MAX, &one};
+  long nchunks = (nx + job.grain - 1) / job.grain;
+  if (nchunks > 1 &&
+      (job.chunk = (struct locate_chunk *)malloc(
+           (size_t)nchunks * sizeof(struct locate_chunk))) == NULL) {
+    job.chunk = &one; // no memory: use a single chunk
+    job.grain = nx;
+    nchunks = 1;
+  }
+  PoolParallelFor(nx, job.grain, locateTask, &job);
+
+  long last = job.best < nchunks ? job.best : nchunks - 1;
+  for (long c = 0; c <= last; c++)
+    PIXMEM_ADD(job.chunk[c].count);
+  int found = job.best < nchunks;
+  if (found) {
+    *px = job.chunk[job.best].x;
+    *py = job.chunk[job.best].y;
+  }
+  if (job.chunk != &one)
+    free(job.chunk);
+  return found;
+}
+
+/// Indexed subimage search
+
+// A SubImageIndex hashes every kxk block of a haystack image, so that many
+// searches for different needles in the same haystack only need to verify
+// the few positions whose block hash matches the needle's top-left block.
+//
+// Block hashes are 2D polynomial (Rabin-Karp) hashes in 64-bit arithmetic:
+// k consecutive pixels of a row are hashed with base HASH_BX, and k
+// consecutive row hashes are combined with base HASH_BY.  Both hashes are
+// rolled, so building the index costs O(1) per position for any k.
+//
+// The (hash, position) pairs are sorted, and each distinct hash gets a slot
+// in an open-addressing table (linear probing) pointing to its run of
+// positions.  Runs are sorted by x, then y: the same order used by
+// ImageLocateSubImage, so the first verified candidate is the one it reports.
+//
+// Slots and positions are plain fixed-width arrays, so the index can be
+// saved to a file and mapped back into memory with mmap, without rebuilding.
+
+#define HASH_BX 0x100000001b3ull       // base for hashing along rows
+#define HASH_BY 0x9e3779b97f4a7c15ull  // base for combining row hashes
+#define HASH_MIX 0xff51afd7ed558ccdull // multiplier for slot selection
+
+#define INDEX_MAGIC "I8IX"
+#define INDEX_VERSION 1
+#define INDEX_MAX_BITS 32 // at most 2^32 slots (96 GiB)
+
+// Index file header (followed by the slot and position arrays)
+struct index_header {
+  char magic[4];
+  uint32_t version;
+  uint32_t k;
+  uint32_t width;
+  uint32_t height;
+  uint32_t bits;     // the table has (1 << bits) slots
+  uint64_t npos;     // number of indexed positions
+  uint64_t checksum; // checksum of the haystack pixels
+};
+
+// Hash table slot: the run of positions whose block has the given hash
+struct index_slot {
+  uint64_t hash;
+  uint64_t start; // index of first position of the run
+  uint64_t count; // length of the run (0 means empty slot)
+};
+
+// Indexed block position (top-left corner)
+struct index_pos {
+  uint32_t x;
+  uint32_t y;
+};
+
+// Internal structure of a SubImageIndex
+struct subimage_index {
+  Image img;  // indexed haystack (not owned by the index)
+  int k;      // block size
+  int bits;   // log2 of the number of slots
+  uint64_t npos;
+  struct index_slot *slot;
+  struct index_pos *pos;
+  void *map;      // file mapping the arrays point into, or NULL if built
+  size_t mapsize;
+};
+
+// Temporary (hash, position) pair used while building the index
+struct index_entry {
+  uint64_t hash;
+  uint32_t x;
+  uint32_t y;
+};
+
+// Order entries by hash, then x, then y.
+static int cmpIndexEntry(const void *a, const void *b) {
+  const struct index_entry *ea = a;
+  const struct index_entry *eb = b;
+  if (ea->hash != eb->hash)
+    return ea->hash < eb->hash ? -1 : 1;
+  if (ea->x != eb->x)
+    return ea->x < eb->x ? -1 : 1;
+  return (ea->y > eb->y) - (ea->y < eb->y);
+}
+
+// Compute a 64-bit checksum of all pixels in img.
+// Used to tell whether a saved index belongs to a given image.
+static uint64_t pixelChecksum(Image img) {
+  size_t size = (size_t)img->width * img->height;
+  uint64_t sum = size;
+  size_t i = 0;
+  for (; i + 8 <= size; i += 8) {
+    uint64_t word;
+    memcpy(&word, &img->pixel[i], 8);
+    sum = (sum ^ word) * HASH_BX;
+  }
+  for (; i < size; i++)
+    sum = (sum ^ img->pixel[i]) * HASH_BX;
+  PIXMEM_ADD((unsigned long)size);
+  return sum;
+}
+
+// Hash of the kxk block at (x, y) of img (same as the rolled hashes).
+static uint64_t blockHash(Image img, int x, int y, int k) {
+  uint64_t hash = 0;
+  for (int j = 0; j < k; j++) {
+    const uint8 *row = &img->pixel[G(img, x, y + j)];
+    uint64_t rh = 0;
+    for (int i = 0; i < k; i++)
+      rh = rh * HASH_BX + row[i];
+    hash = hash * HASH_BY + rh;
+  }
+  PIXMEM_ADD((unsigned long)(k * k));
+  return hash;
+}
+
+// Slot where the search for hash starts.
+static inline uint64_t indexSlotOf(uint64_t hash, int bits) {
+  return (hash * HASH_MIX) >> (64 - bits);
+}
+
+/// Build an index of all kxk blocks of img.
+/// Requires: k >= 1.
+/// The index keeps a reference to img, which must not be destroyed
+/// or modified while the index is in use.
+///
+/// On success, a new index is returned.
+/// (The caller is responsible for destroying the returned index!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+SubImageIndex ImageIndexCreate(Image img, int k) { ///
+  assert(img != NULL);
+  assert(k >= 1);
+  int w = img->width;
+  int h = img->height;
+  int nx = w - k + 1; // number of block positions in each row
+  int ny = h - k + 1; // number of block positions in each column
+  if (nx < 0 || ny < 0)
+    nx = ny = 0;
+  uint64_t npos = (uint64_t)nx * ny;
+
+  // Size the table for a load factor of at most 1/2
+  int bits = 1;
+  while (bits <= INDEX_MAX_BITS && ((uint64_t)1 << bits) < 2 * npos)
+    bits++;
+
+  SubImageIndex idx = NULL;
+  struct index_entry *entry = NULL;
+  uint64_t *ring = NULL; // row hashes of the last k rows
+  uint64_t *col = NULL;  // rolled block hashes for current row
+  int success =
+      check(bits <= INDEX_MAX_BITS, "Image too large") &&
+      check((idx = (SubImageIndex)calloc(1, sizeof(*idx))) != NULL,
+            "Allocation failed") &&
+      check((idx->slot = (struct index_slot *)calloc(
+                 (size_t)1 << bits, sizeof(struct index_slot))) != NULL,
+            "Allocation failed") &&
+      check((idx->pos = (struct index_pos *)malloc(
+                 (npos + 1) * sizeof(struct index_pos))) != NULL,
+            "Allocation failed") &&
+      check((entry = (struct index_entry *)malloc(
+                 (npos + 1) * sizeof(struct index_entry))) != NULL,
+            "Allocation failed") &&
+      check((ring = (uint64_t *)malloc(((size_t)k * nx + 1) *
+                                       sizeof(uint64_t))) != NULL,
+            "Allocation failed") &&
+      check((col = (uint64_t *)calloc((size_t)nx + 1, sizeof(uint64_t))) !=
+                NULL,
+            "Allocation failed");
+  if (!success) {
+    errsave = errno;
+    free(ring);
+    free(col);
+    free(entry);
+    ImageIndexDestroy(&idx);
+    errno = errsave;
+    return NULL;
+  }
+  idx->img = img;
+  idx->k = k;
+  idx->bits = bits;
+  idx->npos = npos;
+
+  if (npos > 0) {
+    // Powers used to remove the oldest pixel / row hash from a window
+    uint64_t bxk = 1, byk = 1;
+    for (int i = 0; i < k; i++) {
+      bxk *= HASH_BX;
+      byk *= HASH_BY;
+    }
+
+    // Roll row hashes along each row, and block hashes down each column
+    uint64_t n = 0;
+    for (int y = 0; y < h; y++) {
+      const uint8 *row = &img->pixel[G(img, 0, y)];
+      uint64_t *old = &ring[(size_t)(y % k) * nx]; // row hashes of y-k
+      uint64_t rh = 0;
+      for (int i = 0; i < k - 1; i++)
+        rh = rh * HASH_BX + row[i];
+      for (int x = 0; x < nx; x++) {
+        rh = rh * HASH_BX + row[x + k - 1];
+        if (x > 0)
+          rh -= row[x - 1] * bxk;
+        col[x] = col[x] * HASH_BY + rh - (y >= k ? old[x] * byk : 0);
+        old[x] = rh;
       }
+      PIXMEM_ADD((unsigned long)w);
+      if (y >= k - 1) {
+        for (int x = 0; x < nx; x++) {
+          entry[n].hash = col[x];
+          entry[n].x = (uint32_t)x;
+          entry[n].y = (uint32_t)(y - k + 1);
+          n++;
+        }
+      }
+    }
+    assert(n == npos);
+    qsort(entry, npos, sizeof(struct index_entry), cmpIndexEntry);
+
+    // One slot per distinct hash, pointing to its run of positions
+    uint64_t mask = ((uint64_t)1 << bits) - 1;
+    for (uint64_t i = 0; i < npos; i++) {
+      idx->pos[i].x = entry[i].x;
+      idx->pos[i].y = entry[i].y;
+      if (i > 0 && entry[i].hash == entry[i - 1].hash)
+        continue;
+      uint64_t s = indexSlotOf(entry[i].hash, bits);
+      while (idx->slot[s].count != 0)
+        s = (s + 1) & mask;
+      uint64_t j = i + 1;
+      while (j < npos && entry[j].hash == entry[i].hash)
+        j++;
+      idx->slot[s].hash = entry[i].hash;
+      idx->slot[s].start = i;
+      idx->slot[s].count = j - i;
+    }
+  }
+
+  free(ring);
+  free(col);
+  free(entry);
+  return idx;
+}
+
+/// Destroy the index pointed to by (*idxp).
+/// The indexed image is not destroyed.
+/// If (*idxp)==NULL, no operation is performed.
+/// Ensures: (*idxp)==NULL.
+void ImageIndexDestroy(SubImageIndex *idxp) { ///
+  assert(idxp != NULL);
+  SubImageIndex idx = *idxp;
+  if (idx != NULL) {
+    if (idx->map != NULL) {
+      munmap(idx->map, idx->mapsize);
+    } else {
+      free(idx->slot);
+      free(idx->pos);
+    }
+    free(idx);
+    *idxp = NULL;
+  }
+}
+
+/// Locate a subimage inside the indexed image.
+/// Like ImageLocateSubImage(indexed image, px, py, img2), but only the
+/// positions whose top-left block matches img2 are compared.
+/// If img2 is smaller than the block size, falls back to
+/// ImageLocateSubImage.
+int ImageIndexLocate(SubImageIndex idx, int *px, int *py, Image img2) { ///
+  assert(idx != NULL);
+  assert(img2 != NULL);
+  Image img1 = idx->img;
+  int k = idx->k;
+  if (img2->width < k || img2->height < k)
+    return ImageLocateSubImage(img1, px, py, img2);
+  if (idx->npos == 0)
+    return 0;
+
+  uint64_t hash = blockHash(img2, 0, 0, k);
+  uint64_t mask = ((uint64_t)1 << idx->bits) - 1;
+  uint64_t s = indexSlotOf(hash, idx->bits);
+  while (idx->slot[s].count != 0 && idx->slot[s].hash != hash)
+    s = (s + 1) & mask;
+
+  const struct index_slot *slot = &idx->slot[s];
+  for (uint64_t i = slot->start; i < slot->start + slot->count; i++) {
+    int x = (int)idx->pos[i].x;
+    int y = (int)idx->pos[i].y;
+    if (x + img2->width <= img1->width && y + img2->height <= img1->height &&
+        ImageMatchSubImage(img1, x, y, img2)) {
+      *px = x;
+      *py = y;
+      return 1;
     }
   }
   return 0;
 }
 
+/// Save index to a file, which may later be loaded with ImageIndexLoad.
+/// On success, returns nonzero.
+/// On failure, returns 0, errno/errCause are set appropriately, and
+/// a partial and invalid file may be left in the system.
+int ImageIndexSave(SubImageIndex idx, const char *filename) { ///
+  assert(idx != NULL);
+  struct index_header hdr;
+  memset(&hdr, 0, sizeof(hdr));
+  memcpy(hdr.magic, INDEX_MAGIC, 4);
+  hdr.version = INDEX_VERSION;
+  hdr.k = (uint32_t)idx->k;
+  hdr.width = (uint32_t)idx->img->width;
+  hdr.height = (uint32_t)idx->img->height;
+  hdr.bits = (uint32_t)idx->bits;
+  hdr.npos = idx->npos;
+  hdr.checksum = pixelChecksum(idx->img);
+  size_t nslots = (size_t)1 << idx->bits;
+  FILE *f = NULL;
+
+  int success =
+      check((f = fopen(filename, "wb")) != NULL, "Open failed") &&
+      check(fwrite(&hdr, sizeof(hdr), 1, f) == 1, "Writing header failed") &&
+      check(fwrite(idx->slot, sizeof(struct index_slot), nslots, f) == nslots,
+            "Writing slots failed") &&
+      check(fwrite(idx->pos, sizeof(struct index_pos), idx->npos, f) ==
+                idx->npos,
+            "Writing positions failed");
+
+  // Cleanup
+  if (f != NULL)
+    success = check(fclose(f) == 0, "Closing file failed") && success;
+  return success;
+}
+
+// Check the header and tables of an index file of size bytes, mapped at
+// hdr, for an image of width x height pixels.  Nothing in the file is
+// trusted: positions and runs must be inside the image and the position
+// array, and the table must have an empty slot (where searches for
+// missing hashes stop).  Returns 0 if the file is invalid.
+static int indexFileValid(const struct index_header *hdr, size_t size,
+                          int width, int height) {
+  if (hdr->bits < 1 || hdr->bits > INDEX_MAX_BITS || hdr->k < 1)
+    return 0;
+  const uint64_t k = hdr->k;
+  uint64_t npos = 0; // positions of kxk blocks in the image
+  if (k <= (uint64_t)width && k <= (uint64_t)height)
+    npos = ((uint64_t)width - k + 1) * ((uint64_t)height - k + 1);
+  const uint64_t nslots = (uint64_t)1 << hdr->bits;
+  // npos < nslots <= 2^32, so the sizes below cannot overflow
+  if (hdr->npos != npos || npos >= nslots ||
+      (uint64_t)size != sizeof(struct index_header) +
+                            nslots * sizeof(struct index_slot) +
+                            npos * sizeof(struct index_pos))
+    return 0;
+
+  const struct index_slot *slot = (const struct index_slot *)(hdr + 1);
+  const struct index_pos *pos = (const struct index_pos *)(slot + nslots);
+  uint64_t empty = 0;
+  for (uint64_t s = 0; s < nslots; s++) {
+    if (slot[s].count == 0)
+      empty++;
+    else if (slot[s].start > npos || slot[s].count > npos - slot[s].start)
+      return 0;
+  }
+  for (uint64_t i = 0; i < npos; i++) {
+    if (pos[i].x + k > (uint64_t)width || pos[i].y + k > (uint64_t)height)
+      return 0;
+  }
+  return empty > 0;
+}
+
+/// Load an index of img from a file written by ImageIndexSave.
+/// The file is mapped into memory, not read, but its tables are checked.
+/// Fails if the file was not built from an image with the same pixels.
+///
+/// On success, a new index is returned.
+/// (The caller is responsible for destroying the returned index!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+SubImageIndex ImageIndexLoad(const char *filename, Image img) { ///
+  assert(img != NULL);
+  int fd = -1;
+  struct stat st;
+  void *map = MAP_FAILED;
+  const struct index_header *hdr = NULL;
+  SubImageIndex idx = NULL;
+
+  int success =
+      check((fd = open(filename, O_RDONLY)) >= 0, "Open failed") &&
+      check(fstat(fd, &st) == 0, "Stat failed") &&
+      check((size_t)st.st_size >= sizeof(struct index_header),
+            "Invalid index file") &&
+      check((map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd,
+                        0)) != MAP_FAILED,
+            "Mapping file failed") &&
+      (hdr = (const struct index_header *)map) != NULL &&
+      check(memcmp(hdr->magic, INDEX_MAGIC, 4) == 0 &&
+                hdr->version == INDEX_VERSION,
+            "Invalid index file") &&
+      check(hdr->width == (uint32_t)img->width &&
+                hdr->height == (uint32_t)img->height &&
+                hdr->checksum == pixelChecksum(img),
+            "Index does not match image") &&
+      check(indexFileValid(hdr, (size_t)st.st_size, img->width, img->height),
+            "Invalid index file") &&
+      check((idx = (SubImageIndex)calloc(1, sizeof(*idx))) != NULL,
+            "Allocation failed");
+
+  if (success) {
+    idx->img = img;
+    idx->k = (int)hdr->k;
+    idx->bits = (int)hdr->bits;
+    idx->npos = hdr->npos;
+    idx->slot = (struct index_slot *)(hdr + 1);
+    idx->pos = (struct index_pos *)(idx->slot + ((size_t)1 << hdr->bits));
+    idx->map = map;
+    idx->mapsize = (size_t)st.st_size;
+  } else {
+    errsave = errno;
+    if (map != MAP_FAILED)
+      munmap(map, (size_t)st.st_size);
+    errno = errsave;
+  }
+  if (fd >= 0)
+    close(fd);
+  return idx;
+}
+
 /// Filtering
 
 /// Blur an image by a applying a (2dx+1)x(2dy+1) mean filter.
@@ -662,58 +2336,92 @@ int ImageLocateSubImage(Image img1, int *px, int *py, Image img2) { ///
 /// The image is changed in-place.
 
 
-void ImageBlur(Image img, int dx, int dy) {
-  assert(img != NULL);
-  assert(dx >= 0 && dy >= 0);
+// ImageBlur builds the summed table in two parallel phases: prefix sums
+// along each table row (rows in parallel), then accumulation down the
+// columns (chunks of columns in parallel, whole rows at a time).  The
+// filter pass then processes rows in parallel.  The integer results are the
+// same as building the table in a single scan.
+// The table covers a band of rows of the rectangle being blurred (the
+// whole image, for ImageBlur) plus dx columns and dy rows around it, which
+// are read from the image, clamped at its edges.  Large rectangles are
+// split in bands with tables of about BLUR_TABLE_BYTES, so the memory used
+// does not grow with the height.  Bands have at least dy rows, and the
+// table of each band is built before the previous band is filtered, so
+// all tables are built from the original pixels.
+// Entries are unsigned and may wrap around, but the sum of each window is
+// exact as long as it is less than 2^32.  Windows are limited to less than
+// 2^24 pixels (see blurAreaFits), so that the sum of a window of pixels up
+// to 255, plus half its area for rounding, is less than 2^32.
+#define BLUR_TABLE_BYTES ((size_t)64 << 20)
+#define BLUR_MIN_BAND 64
 
-  // Image dimensions
-  int w = img->width;
-  int h = img->height;
-  int x, y;
+// Check that the window of a (2dx+1)x(2dy+1) mean filter has less than
+// 2^24 pixels.
+static int blurAreaFits(int dx, int dy) {
+  return (2 * (int64_t)dx + 1) * (2 * (int64_t)dy + 1) < ((int64_t)1 << 24);
+}
 
-  // Dimensions of the summed table
-  const int sum_w = w + 2 * dx; // this is so there are enough pixels to the left and right
-  const int sum_h = h + 2 * dy; // this is so there are enough pixels to the left and above
-
-  // Allocate memory for the summed Table
-  int *sumTable = (int *)malloc(sum_h * sum_w * sizeof(int)); 
- 
-  // Calculate the area of the filter kernel
-  const int area = (2 * dx + 1) * (2 * dy + 1); // 2* because of the left and right side and +1 because of the center pixel
-
-  // Computing the summed Table
-  for (y = 0; y < h + 2 * dy; y++) {
-    for (x = 0; x < w + 2 * dx; x++) {
-      // Coordinates inside the original image
-      const int x_dentro = x < dx ? 0 : (x - dx >= w ? w - 1 : x - dx); // 2 comparisons 
-      const int y_dentro = y < dy ? 0 : (y - dy >= h ? h - 1 : y - dy); // 2 comparisons
-
-      // Pixel value at the calculated coordinates
-      int pixelVal = ImageGetPixel(img, x_dentro, y_dentro);
-    
-      // Adding the values from left and above,subrtract the overlapping corner
-      pixelVal += x > 0 ? sumTable[y * sum_w + (x - 1)] : 0; // 1 comparison
-      pixelVal += y > 0 ? sumTable[(y - 1) * sum_w + x] : 0; // 1 comparison
-      pixelVal -= x > 0 && y > 0 ? sumTable[(y - 1) * sum_w + (x - 1)] : 0; // 2 comparisons
-      
-      // Storing the cumulative sum in the summed Table
-      sumTable[y * sum_w + x] = pixelVal;
-    }
-  }
-
-  // Applying the box filter in each pixel
-  for (y = 0; y < h; y++) {
-    for (x = 0; x < w; x++) {
+struct blur_job {
+  Image img;
+  int x0, y0;       // top left corner of the band
+  int dx, dy;
+  int sum_w, sum_h; // dimensions of the summed table
+  uint32_t *sumTable;
+};
+
+// Prefix sums along rows [begin, end) of the summed table
+static void blurRowsTask(void *arg, long begin, long end) {
+  const struct blur_job *job = arg;
+  const int w = job->img->width;
+  const int h = job->img->height;
+  for (int y = (int)begin; y < end; y++) {
+    // Coordinates inside the original image
+    const int yi = job->y0 + y - job->dy;
+    const int y_dentro = yi < 0 ? 0 : (yi >= h ? h - 1 : yi);
+    const uint8 *row = &job->img->pixel[G(job->img, 0, y_dentro)];
+    uint32_t *t = &job->sumTable[(size_t)y * job->sum_w];
+    uint32_t acc = 0;
+    for (int x = 0; x < job->sum_w; x++) {
+      const int xi = job->x0 + x - job->dx;
+      const int x_dentro = xi < 0 ? 0 : (xi >= w ? w - 1 : xi);
+      acc += row[x_dentro];
+      t[x] = acc;
+    }
+  }
+}
+
+// Accumulate the row sums down columns [begin, end) of the summed table
+static void blurColumnsTask(void *arg, long begin, long end) {
+  const struct blur_job *job = arg;
+  for (int y = 1; y < job->sum_h; y++) {
+    const uint32_t *above = &job->sumTable[(size_t)(y - 1) * job->sum_w];
+    uint32_t *t = &job->sumTable[(size_t)y * job->sum_w];
+    for (long x = begin; x < end; x++)
+      t[x] += above[x];
+  }
+}
+
+// Apply the box filter to rows [begin, end) of the band
+static void blurFilterTask(void *arg, long begin, long end) {
+  const struct blur_job *job = arg;
+  const size_t sum_w = job->sum_w;
+  const uint32_t *sumTable = job->sumTable;
+  const int w = (int)sum_w - 2 * job->dx; // width of the rectangle
+  // Calculate the area of the filter kernel (less than 2^24, see blurAreaFits)
+  const int area = (2 * job->dx + 1) * (2 * job->dy + 1); // 2* because of the left and right side and +1 because of the center pixel
+  for (int y = (int)begin; y < end; y++) {
+    uint8 *row = &job->img->pixel[G(job->img, job->x0, job->y0 + y)];
+    for (int x = 0; x < w; x++) {
       // Defining the coordinates of the filter window
       int x1 = x;
       int y1 = y;
-      int x2 = x + 2 * dx;
-      int y2 = y + 2 * dy;
+      int x2 = x + 2 * job->dx;
+      int y2 = y + 2 * job->dy;
 
       // Doing the calculations in the summed table
 
       // Start in bottom right corner of the sum table
-      int sum = sumTable[y2 * sum_w + x2];
+      uint32_t sum = sumTable[y2 * sum_w + x2];
 
       // Remove the bottom left corner of the sum table
       sum -= x1 > 0 ? sumTable[y2 * sum_w + (x1 - 1)] : 0; // 1 comparison
@@ -725,17 +2433,2869 @@ void ImageBlur(Image img, int dx, int dy) {
       // this gives us the sum at (x, y) considering the
       // filter kernel size of (dx, dy).
       sum += x1 > 0 && y1 > 0 ? sumTable[(y1 - 1) * sum_w + (x1 - 1)] : 0; // 2 comparisons
-      
+
       // (area >> 1) is the same as (area / 2) but faster and avoiding floating point arithmetic
       // Setting the blurred pixel back into the original image
-      ImageSetPixel(img, x, y, (uint8)((sum + (area >> 1)) / area)); 
+      row[x] = (uint8)((sum + (area >> 1)) / area);
+    }
+  }
+}
+
+// Build the summed table of job, for a band of rows rows.
+static void blurTable(struct blur_job *job, int rows) {
+  job->sum_h = rows + 2 * job->dy;
+  InstrSpan span;
+  InstrSpanBegin(&span, "blur table");
+  PoolParallelFor(job->sum_h, parGrain(job->sum_w), blurRowsTask, job);
+  long colGrain = parGrain(job->sum_h);
+  PoolParallelFor(job->sum_w, colGrain > 64 ? colGrain : 64, blurColumnsTask, job);
+  PIXMEM_ADD((unsigned long)job->sum_w * job->sum_h); // one read per table entry
+  InstrSpanArg(&span, "width", job->sum_w);
+  InstrSpanArg(&span, "height", job->sum_h);
+  InstrSpanEnd(&span);
+}
+
+// Apply the box filter to the rows rows of the band of job.
+static void blurFilter(struct blur_job *job, int rows) {
+  const int w = job->sum_w - 2 * job->dx;
+  InstrSpan span;
+  InstrSpanBegin(&span, "blur filter");
+  PoolParallelFor(rows, parGrain(w), blurFilterTask, job);
+  PIXMEM_ADD((unsigned long)w * rows); // one write per pixel
+  InstrSpanArg(&span, "width", w);
+  InstrSpanArg(&span, "height", rows);
+  InstrSpanEnd(&span);
+}
+
+void ImageBlur(Image img, int dx, int dy) {
+  assert(img != NULL);
+  assert(blurAreaFits(dx, dy));
+  ImageBlurRect(img, 0, 0, img->width, img->height, dx, dy);
+}
+
+/// Blur only the pixels inside the rectangle with top left corner (x, y),
+/// width w and height h, as ImageBlur would: the mean filter also reads
+/// the pixels around the rectangle.
+/// Requires: the rectangle must be inside img.
+/// On success, returns nonzero.
+/// On failure, returns 0, errno/errCause are set appropriately,
+/// and the image is not modified.  Fails if (2dx+1)*(2dy+1) >= 2^24.
+int ImageBlurRect(Image img, int x, int y, int w, int h, int dx, int dy) { ///
+  assert(img != NULL);
+  assert(dx >= 0 && dy >= 0);
+  assert(ImageValidRect(img, x, y, w, h));
+  if (!check(blurAreaFits(dx, dy), "Blur window too large"))
+    return 0;
+  if (w == 0 || h == 0)
+    return 1;
+
+  // Dimensions of the summed tables
+  const int sum_w = w + 2 * dx; // this is so there are enough pixels to the left and right
+  long rows = (long)(BLUR_TABLE_BYTES / ((size_t)sum_w * sizeof(uint32_t))) - 2L * dy;
+  if (rows < BLUR_MIN_BAND)
+    rows = BLUR_MIN_BAND;
+  if (rows < dy)
+    rows = dy;
+  const int band = rows < h ? (int)rows : h; // rows per band
+  const int sum_h = band + 2 * dy; // this is so there are enough pixels to the left and above
+
+  // Allocate memory for the summed Tables (two if there are several bands)
+  const size_t tablesz = (size_t)sum_h * sum_w * sizeof(uint32_t);
+  struct blur_job job[2] = {{img, x, y, dx, dy, sum_w, sum_h, NULL},
+                            {img, x, y, dx, dy, sum_w, sum_h, NULL}};
+  if (!check((job[0].sumTable = (uint32_t *)bufAlloc(tablesz)) != NULL &&
+                 (band == h || (job[1].sumTable = (uint32_t *)bufAlloc(
+                                    tablesz)) != NULL),
+             "Allocation failed")) {
+    bufFree(job[0].sumTable);
+    return 0; // image not modified
+  }
+
+  blurTable(&job[0], band);
+  for (long y0 = 0, b = 0; y0 < h; y0 += band, b ^= 1) {
+    const long next = y0 + band; // first row of the next band
+    if (next < h) { // build its table before this band changes
+      job[b ^ 1].y0 = y + (int)next;
+      blurTable(&job[b ^ 1], h - next < band ? (int)(h - next) : band);
     }
+    blurFilter(&job[b], h - y0 < band ? (int)(h - y0) : band);
   }
 
   // Free allocated memory
-  free(sumTable);
+  bufFree(job[0].sumTable);
+  bufFree(job[1].sumTable);
+  return 1;
+}
+
+/// Separable convolution
+
+// ImageConvolveSeparable and the filters built on it share a tiled engine.
+// The image is split into tiles of CONV_TILE_W x CONV_TILE_H output pixels.
+// For each tile, the horizontal pass filters the tile rows plus ry halo rows
+// above and below into a small int32 buffer, and the vertical pass combines
+// those rows into the output tile.  All working data of a tile stays in
+// cache, and tiles are independent of each other, so they are processed
+// in parallel, each worker thread with its own scratch buffers.
+//
+// Both passes have the filter taps in the outer loop and pixels in the
+// inner loop, with no branches, so that the compiler can vectorize them.
+// Borders are resolved only when loading a padded source row.
+//
+// The result is written to a new pixel array, which replaces the old one,
+// so the operation is still in-place from the caller's point of view.
+
+#define CONV_TILE_W 256
+#define CONV_TILE_H 64
+
+// A separable kernel: kx (2rx+1 taps) applied along rows,
+// then ky (2ry+1 taps) applied along columns.
+struct sep_kernel {
+  const int *kx;
+  int rx;
+  const int *ky;
+  int ry;
+  ImageBorder border;
+};
+
+// Scratch buffers to convolve one tile (one set per worker thread)
+struct conv_scratch {
+  int32_t *pad;   // one source row, with rx pixels of border on each side
+  int32_t *hbuf;  // horizontal pass results: (CONV_TILE_H + 2ry) rows
+  int32_t *tile;  // convolution sums of the tile
+  int32_t *tile2; // convolution sums of the tile with a second kernel
+};
+
+// Map coordinate i into [0, n) according to border mode.
+// Returns -1 if the pixel is outside and should be read as 0.
+static inline int borderIndex(int i, int n, ImageBorder border) {
+  if (0 <= i && i < n)
+    return i;
+  switch (border) {
+  case IMAGE_BORDER_CLAMP:
+    return i < 0 ? 0 : n - 1;
+  case IMAGE_BORDER_MIRROR:
+    // Reflect about the edges (...cba|abc...cba|abc...), period 2n
+    i %= 2 * n;
+    if (i < 0)
+      i += 2 * n;
+    return i < n ? i : 2 * n - 1 - i;
+  default:
+    return -1;
+  }
 }
 
+// Allocate scratch buffers for kernels with radii up to rx, ry.
+// Returns 0 and sets errCause on failure.
+static int convScratchAlloc(struct conv_scratch *s, int rx, int ry) {
+  const size_t tilesize = CONV_TILE_W * CONV_TILE_H * sizeof(int32_t);
+  memset(s, 0, sizeof(*s));
+  return check((s->pad = (int32_t *)malloc((CONV_TILE_W + 2 * (size_t)rx) *
+                                          sizeof(int32_t))) != NULL,
+               "Allocation failed") &&
+         check((s->hbuf = (int32_t *)malloc((CONV_TILE_H + 2 * (size_t)ry) *
+                                           CONV_TILE_W * sizeof(int32_t))) !=
+                   NULL,
+               "Allocation failed") &&
+         check((s->tile = (int32_t *)malloc(tilesize)) != NULL,
+               "Allocation failed") &&
+         check((s->tile2 = (int32_t *)malloc(tilesize)) != NULL,
+               "Allocation failed");
+}
+
+static void convScratchFree(struct conv_scratch *s) {
+  free(s->pad);
+  free(s->hbuf);
+  free(s->tile);
+  free(s->tile2);
+}
+
+// Convolve the tile of img at (x0, y0) with size tw x th.
+// Stores the unnormalized sums in out (tw x th, row stride tw).
+// Returns the number of pixels read.
+static unsigned long convolveTile(Image img, const struct sep_kernel *k,
+                                  struct conv_scratch *s, int x0, int y0,
+                                  int tw, int th, int32_t *out) {
+  const int w = img->width;
+  const int h = img->height;
+  const int rx = k->rx;
+  const int ry = k->ry;
+  const int pw = tw + 2 * rx; // padded row width
+  unsigned long count = 0;
+
+  // Horizontal pass over the tile rows and the halo rows
+  for (int j = 0; j < th + 2 * ry; j++) {
+    int32_t *hrow = &s->hbuf[(size_t)j * tw];
+    int sy = borderIndex(y0 - ry + j, h, k->border);
+    if (sy < 0) {
+      memset(hrow, 0, (size_t)tw * sizeof(int32_t));
+      continue;
+    }
+    const uint8 *src = &img->pixel[G(img, 0, sy)];
+    int32_t *pad = s->pad;
+    for (int i = 0; i < pw; i++) {
+      int sx = x0 - rx + i;
+      if (0 <= sx && sx < w) {
+        pad[i] = src[sx];
+      } else {
+        sx = borderIndex(sx, w, k->border);
+        pad[i] = sx < 0 ? 0 : src[sx];
+      }
+    }
+    count += (unsigned long)pw;
+    for (int x = 0; x < tw; x++)
+      hrow[x] = 0;
+    for (int i = 0; i <= 2 * rx; i++) {
+      const int32_t c = k->kx[i];
+      const int32_t *p = &pad[i];
+      for (int x = 0; x < tw; x++)
+        hrow[x] += c * p[x];
+    }
+  }
+
+  // Vertical pass
+  for (int y = 0; y < th; y++) {
+    int32_t *orow = &out[(size_t)y * tw];
+    for (int x = 0; x < tw; x++)
+      orow[x] = 0;
+    for (int j = 0; j <= 2 * ry; j++) {
+      const int32_t c = k->ky[j];
+      const int32_t *hrow = &s->hbuf[(size_t)(y + j) * tw];
+      for (int x = 0; x < tw; x++)
+        orow[x] += c * hrow[x];
+    }
+  }
+  return count;
+}
+
+// How the convolution sums of a tile become output pixels
+enum conv_mode {
+  CONV_SHIFT,   // (sum + round) >> shift, saturated
+  CONV_SHARPEN, // unsharp mask, given Gaussian sums (scaled by 2^shift)
+  CONV_SOBEL,   // gradient magnitude, from the sums of two kernels
+};
+
+// Work shared by all tiles of a convolution
+struct conv_job {
+  Image img;
+  uint8 *dst;
+  const struct sep_kernel *k;
+  const struct sep_kernel *k2; // second kernel (CONV_SOBEL only)
+  enum conv_mode mode;
+  int shift;
+  int32_t amount; // in 8.8 fixed point (CONV_SHARPEN only)
+  int ntx;        // number of tiles in each row of tiles
+  struct conv_scratch *scratch; // one per worker
+};
+
+// Convolve tiles [begin, end), in raster order, into job->dst.
+static void convTask(void *arg, long begin, long end) {
+  const struct conv_job *job = arg;
+  struct conv_scratch *s = &job->scratch[PoolWorkerId()];
+  Image img = job->img;
+  const int w = img->width;
+  const int h = img->height;
+  const int32_t maxval = img->maxval;
+  const int shift = job->shift;
+  const int32_t round = shift > 0 ? 1 << (shift - 1) : 0;
+  unsigned long count = 0;
+
+  for (long t = begin; t < end; t++) {
+    const int x0 = (int)(t % job->ntx) * CONV_TILE_W;
+    const int y0 = (int)(t / job->ntx) * CONV_TILE_H;
+    const int tw = w - x0 < CONV_TILE_W ? w - x0 : CONV_TILE_W;
+    const int th = h - y0 < CONV_TILE_H ? h - y0 : CONV_TILE_H;
+    count += convolveTile(img, job->k, s, x0, y0, tw, th, s->tile);
+    if (job->mode == CONV_SOBEL)
+      count += convolveTile(img, job->k2, s, x0, y0, tw, th, s->tile2);
+
+    for (int y = 0; y < th; y++) {
+      const int32_t *trow = &s->tile[(size_t)y * tw];
+      uint8 *drow = &job->dst[(size_t)(y0 + y) * w + x0];
+      if (job->mode == CONV_SHIFT) {
+        for (int x = 0; x < tw; x++) {
+          int32_t v = (trow[x] + round) >> shift;
+          v = v < 0 ? 0 : v;
+          drow[x] = (uint8)(v > maxval ? maxval : v);
+        }
+      } else if (job->mode == CONV_SHARPEN) {
+        const uint8 *srow = &img->pixel[G(img, x0, y0 + y)];
+        for (int x = 0; x < tw; x++) {
+          int32_t g = (trow[x] + round) >> shift;
+          int32_t v = srow[x] + ((job->amount * (srow[x] - g) + 128) >> 8);
+          v = v < 0 ? 0 : v;
+          drow[x] = (uint8)(v > maxval ? maxval : v);
+        }
+        count += (unsigned long)tw;
+      } else {
+        const int32_t *trow2 = &s->tile2[(size_t)y * tw];
+        for (int x = 0; x < tw; x++) {
+          float m = sqrtf((float)(trow[x] * trow[x] + trow2[x] * trow2[x]));
+          drow[x] = m >= (float)maxval ? (uint8)maxval : (uint8)(m + 0.5f);
+        }
+      }
+    }
+    count += (unsigned long)(tw * th); // writes
+  }
+  pixmemAdd(count);
+}
+
+// Run the convolution described by job on its image.
+// The result replaces the pixel array of the image.
+// Returns 0 and sets errCause on failure (the image is not modified).
+static int convolve(struct conv_job *job) {
+  Image img = job->img;
+  const int w = img->width;
+  const int h = img->height;
+  int rx = job->k->rx;
+  int ry = job->k->ry;
+  if (job->k2 != NULL) {
+    rx = job->k2->rx > rx ? job->k2->rx : rx;
+    ry = job->k2->ry > ry ? job->k2->ry : ry;
+  }
+  job->ntx = (w + CONV_TILE_W - 1) / CONV_TILE_W;
+  const long ntiles = (long)job->ntx * ((h + CONV_TILE_H - 1) / CONV_TILE_H);
+  const long grain = parGrain(CONV_TILE_W * CONV_TILE_H);
+  const int nthreads = PoolJobThreads(ntiles, grain);
+  int nscratch = 0;
+  job->dst = NULL;
+
+  int success =
+      check((job->scratch = (struct conv_scratch *)calloc(
+                 (size_t)nthreads, sizeof(struct conv_scratch))) != NULL,
+            "Allocation failed") &&
+      check((job->dst = (uint8 *)bufAllocRaw((size_t)w * h)) != NULL,
+            "Allocation failed");
+  while (success && nscratch < nthreads)
+    success = convScratchAlloc(&job->scratch[nscratch++], rx, ry);
+
+  if (success) {
+    fillPixels("convolve", job->dst, w, h, ntiles, grain, convTask, job);
+    bufFree(img->pixel);
+    img->pixel = job->dst;
+  } else {
+    errsave = errno;
+    bufFree(job->dst);
+    errno = errsave;
+  }
+  for (int i = 0; i < nscratch; i++)
+    convScratchFree(&job->scratch[i]);
+  free(job->scratch);
+  return success;
+}
+
+// Sum of absolute values of the n taps of kernel c.
+static long kernelNorm(const int *c, int n) {
+  long sum = 0;
+  for (int i = 0; i < n; i++)
+    sum += c[i] < 0 ? -(long)c[i] : c[i];
+  return sum;
+}
+
+/// Convolve an image with a separable kernel, in fixed point.
+/// kx has 2rx+1 taps, applied along rows; ky has 2ry+1 taps, applied
+/// along columns.  Each pixel is replaced by the 2D weighted sum of its
+/// (2rx+1)x(2ry+1) neighborhood, divided by 2^shift (rounded),
+/// and saturated to [0, maxval].
+/// Pixels outside the image are obtained according to border.
+/// Requires: rx, ry >= 0, 0 <= shift < 31, and the sums must fit in 31 bits:
+///   sum(|kx|) * sum(|ky|) * maxval < 2^31.
+/// The image is changed in-place.
+/// On success, returns nonzero.
+/// On failure, returns 0, errno/errCause are set appropriately,
+/// and the image is not modified.
+int ImageConvolveSeparable(Image img, const int *kx, int rx, const int *ky,
+                           int ry, int shift, ImageBorder border) { ///
+  assert(img != NULL);
+  assert(kx != NULL && ky != NULL);
+  assert(rx >= 0 && ry >= 0);
+  assert(0 <= shift && shift < 31);
+  assert(kernelNorm(kx, 2 * rx + 1) * kernelNorm(ky, 2 * ry + 1) *
+             img->maxval < (1L << 31));
+  struct sep_kernel k = {kx, rx, ky, ry, border};
+  struct conv_job job = {img, NULL, &k, NULL, CONV_SHIFT, shift, 0, 0, NULL};
+  return convolve(&job);
+}
+
+// Fixed-point precision of each Gaussian kernel (taps add up to 2^GAUSS_BITS)
+#define GAUSS_BITS 10
+
+// Build a Gaussian kernel with standard deviation sigma into (*kp).
+// The kernel has 2r+1 taps, with r = ceil(3*sigma), adding up to 2^GAUSS_BITS.
+// Returns r, or -1 (and sets errCause) if allocation fails.
+static int gaussKernel(double sigma, int **kp) {
+  int r = (int)ceil(3.0 * sigma);
+  int *c = NULL;
+  if (!check((c = (int *)malloc((2 * (size_t)r + 1) * sizeof(int))) != NULL,
+             "Allocation failed"))
+    return -1;
+  double sum = 0.0;
+  for (int i = -r; i <= r; i++)
+    sum += exp(-(double)(i * i) / (2.0 * sigma * sigma));
+  int total = 0;
+  for (int i = -r; i <= r; i++) {
+    double g = exp(-(double)(i * i) / (2.0 * sigma * sigma)) / sum;
+    c[i + r] = (int)(g * (1 << GAUSS_BITS) + 0.5);
+    total += c[i + r];
+  }
+  c[r] += (1 << GAUSS_BITS) - total; // make the sum exact
+  *kp = c;
+  return r;
+}
+
+/// Gaussian blur with standard deviation sigma.
+/// Uses the exact (sampled) Gaussian kernel with radius ceil(3*sigma),
+/// and clamped borders, as ImageBlur.
+/// Requires: sigma > 0.
+/// The image is changed in-place.
+/// On success, returns nonzero.
+/// On failure, returns 0, errno/errCause are set appropriately,
+/// and the image is not modified.
+int ImageGaussian(Image img, double sigma) { ///
+  assert(img != NULL);
+  assert(sigma > 0.0);
+  int *c = NULL;
+  int r = gaussKernel(sigma, &c);
+  if (r < 0)
+    return 0;
+  int success = ImageConvolveSeparable(img, c, r, c, r, 2 * GAUSS_BITS,
+                                       IMAGE_BORDER_CLAMP);
+  errsave = errno;
+  free(c);
+  errno = errsave;
+  return success;
+}
+
+/// Fast approximate Gaussian blur with standard deviation sigma.
+/// Applies three mean filters (ImageBlur) with sizes chosen so that their
+/// combined variance approximates sigma^2.  The cost does not depend on sigma.
+/// Requires: sigma > 0.
+/// The image is changed in-place.
+/// On success, returns nonzero.
+/// On failure, returns 0, errno/errCause are set appropriately,
+/// and the image may have been blurred by some of the passes.
+int ImageGaussianFast(Image img, double sigma) { ///
+  assert(img != NULL);
+  assert(sigma > 0.0);
+  // Box sizes for n passes
+  // (see Peter Kovesi, "Fast almost-Gaussian filtering")
+  const int n = 3;
+  int wl = (int)floor(sqrt(12.0 * sigma * sigma / n + 1.0));
+  if (wl % 2 == 0)
+    wl--;
+  int m = (int)floor((12.0 * sigma * sigma - n * wl * wl - 4.0 * n * wl -
+                      3.0 * n) / (-4.0 * wl - 4.0) + 0.5);
+  for (int i = 0; i < n; i++) {
+    int r = (i < m ? wl : wl + 2) / 2;
+    if (!ImageBlurRect(img, 0, 0, img->width, img->height, r, r))
+      return 0;
+  }
+  return 1;
+}
+
+/// Sharpen an image with an unsharp mask.
+/// Each pixel p becomes p + amount*(p - g), where g is the pixel in the
+/// Gaussian blur of the image with standard deviation sigma.
+/// Results are saturated to [0, maxval].
+/// Requires: sigma > 0, amount >= 0.
+/// The image is changed in-place.
+/// On success, returns nonzero.
+/// On failure, returns 0, errno/errCause are set appropriately,
+/// and the image is not modified.
+int ImageSharpen(Image img, double sigma, double amount) { ///
+  assert(img != NULL);
+  assert(sigma > 0.0);
+  assert(amount >= 0.0);
+  int *c = NULL;
+  int r = gaussKernel(sigma, &c);
+  if (r < 0)
+    return 0;
+  struct sep_kernel k = {c, r, c, r, IMAGE_BORDER_CLAMP};
+  const int32_t a = (int32_t)(amount * 256 + 0.5); // amount in 8.8 fixed point
+  struct conv_job job = {img, NULL, &k, NULL, CONV_SHARPEN, 2 * GAUSS_BITS,
+                         a, 0, NULL};
+  int success = convolve(&job);
+  errsave = errno;
+  free(c);
+  errno = errsave;
+  return success;
+}
+
+/// Replace an image by its Sobel gradient magnitude.
+/// Each pixel becomes sqrt(gx^2 + gy^2), saturated to maxval, where gx and
+/// gy are the responses to the 3x3 Sobel operators, with clamped borders.
+/// The image is changed in-place.
+/// On success, returns nonzero.
+/// On failure, returns 0, errno/errCause are set appropriately,
+/// and the image is not modified.
+int ImageSobel(Image img) { ///
+  assert(img != NULL);
+  static const int diff[3] = {-1, 0, 1};
+  static const int smooth[3] = {1, 2, 1};
+  struct sep_kernel kx = {diff, 1, smooth, 1, IMAGE_BORDER_CLAMP};
+  struct sep_kernel ky = {smooth, 1, diff, 1, IMAGE_BORDER_CLAMP};
+  struct conv_job job = {img, NULL, &kx, &ky, CONV_SOBEL, 0, 0, 0, NULL};
+  return convolve(&job);
+}
+
+/// Median filter
+
+// ImageMedian uses the constant-time algorithm of Perreault and Hebert
+// ("Median Filtering in Constant Time", IEEE TIP 2007).
+// Each column keeps a histogram of the 2dy+1 pixels in the current window
+// rows; moving down one row updates it with one removal and one addition.
+// The window histogram is the sum of 2dx+1 column histograms; moving right
+// one pixel adds one column histogram and subtracts another.
+// Histograms have two levels: 16 coarse bins (high nibble of the level) and
+// 256 fine bins.  The coarse window histogram is updated at every pixel, but
+// the fine window histogram of a coarse bin is only brought up to date when
+// the median falls in that bin.  So the cost per pixel does not depend on
+// dx or dy.
+//
+// Pixels outside the image take the value of the nearest edge pixel, as in
+// ImageBlur.  Columns outside the image reuse the histograms of the edge
+// columns.
+//
+// Bands of rows are filtered in parallel, each by a worker thread with its
+// own column histograms.
+
+// Clamp i to [0, n-1].
+static inline int clampIndex(int i, int n) {
+  return i < 0 ? 0 : (i >= n ? n - 1 : i);
+}
+
+// Add d (+1 or -1) for each pixel of row sy of img to the column histograms.
+static void medianColumnsAdd(Image img, int sy, int d, uint16_t *fine,
+                             uint16_t *coarse) {
+  const uint8 *row = &img->pixel[G(img, 0, sy)];
+  for (int x = 0; x < img->width; x++) {
+    fine[(size_t)x * 256 + row[x]] += d;
+    coarse[(size_t)x * 16 + (row[x] >> 4)] += d;
+  }
+}
+
+// Median filter rows [y0, y1) of img into dst.
+// fine (w x 256) and coarse (w x 16) are scratch column histograms.
+// Returns the number of pixels accessed.
+static unsigned long medianBand(Image img, uint8 *dst, int dx, int dy, int y0,
+                                int y1, uint16_t *fine, uint16_t *coarse) {
+  const int w = img->width;
+  const int h = img->height;
+  const uint32_t rank = (uint32_t)((2 * dx + 1) * (2 * dy + 1)) / 2;
+  uint32_t kc[16];  // coarse window histogram
+  uint32_t kf[256]; // fine window histogram
+  int luc[16];      // last column for which each fine bin group is valid
+  unsigned long count = 0;
+
+  // Column histograms for the window rows of y0
+  memset(fine, 0, (size_t)w * 256 * sizeof(uint16_t));
+  memset(coarse, 0, (size_t)w * 16 * sizeof(uint16_t));
+  for (int j = y0 - dy; j <= y0 + dy; j++)
+    medianColumnsAdd(img, clampIndex(j, h), 1, fine, coarse);
+  count += (unsigned long)(2 * dy + 1) * w;
+
+  for (int y = y0; y < y1; y++) {
+    if (y > y0) {
+      // Slide column histograms down one row
+      int out = clampIndex(y - dy - 1, h);
+      int in = clampIndex(y + dy, h);
+      if (out != in) {
+        medianColumnsAdd(img, out, -1, fine, coarse);
+        medianColumnsAdd(img, in, 1, fine, coarse);
+        count += 2 * (unsigned long)w;
+      }
+    }
+
+    memset(kc, 0, sizeof(kc));
+    memset(kf, 0, sizeof(kf));
+    for (int b = 0; b < 16; b++)
+      luc[b] = -2 * dx - 2; // so that all groups are stale
+    for (int c = -dx; c <= dx; c++) {
+      const uint16_t *cc = &coarse[(size_t)clampIndex(c, w) * 16];
+      for (int b = 0; b < 16; b++)
+        kc[b] += cc[b];
+    }
+
+    for (int x = 0; x < w; x++) {
+      if (x > 0) {
+        // Slide coarse window histogram right one column
+        const uint16_t *cin = &coarse[(size_t)clampIndex(x + dx, w) * 16];
+        const uint16_t *cout = &coarse[(size_t)clampIndex(x - dx - 1, w) * 16];
+        for (int b = 0; b < 16; b++)
+          kc[b] += cin[b] - cout[b];
+      }
+
+      // Find coarse bin containing the median
+      uint32_t sum = 0;
+      int b = 0;
+      while (sum + kc[b] <= rank)
+        sum += kc[b++];
+
+      // Bring fine bins of group b up to date
+      uint32_t *f = &kf[b * 16];
+      if (luc[b] <= x - (2 * dx + 1)) {
+        memset(f, 0, 16 * sizeof(uint32_t));
+        for (int c = x - dx; c <= x + dx; c++) {
+          const uint16_t *fc = &fine[(size_t)clampIndex(c, w) * 256 + b * 16];
+          for (int i = 0; i < 16; i++)
+            f[i] += fc[i];
+        }
+      } else {
+        for (int c = luc[b] + 1; c <= x; c++) {
+          const uint16_t *fin = &fine[(size_t)clampIndex(c + dx, w) * 256 + b * 16];
+          const uint16_t *fout =
+              &fine[(size_t)clampIndex(c - dx - 1, w) * 256 + b * 16];
+          for (int i = 0; i < 16; i++)
+            f[i] += fin[i] - fout[i];
+        }
+      }
+      luc[b] = x;
+
+      // Find median within group b
+      int i = 0;
+      while (sum + f[i] <= rank)
+        sum += f[i++];
+      dst[(size_t)y * w + x] = (uint8)(b * 16 + i);
+    }
+    count += (unsigned long)w;
+  }
+  return count;
+}
+
+// Work shared by the bands of a median filter
+struct median_job {
+  Image img;
+  uint8 *dst;
+  int dx, dy;
+  uint16_t **fine;   // column histograms, one set per worker
+  uint16_t **coarse;
+};
+
+// Median filter rows [begin, end) as one band.
+static void medianTask(void *arg, long begin, long end) {
+  const struct median_job *job = arg;
+  const int t = PoolWorkerId();
+  pixmemAdd(medianBand(job->img, job->dst, job->dx, job->dy, (int)begin,
+                       (int)end, job->fine[t], job->coarse[t]));
+}
+
+/// Apply a (2dx+1)x(2dy+1) median filter.
+/// Each pixel is substituted by the median of the pixels in the rectangle
+/// [x-dx, x+dx]x[y-dy, y+dy].  Pixels outside the image take the value of
+/// the nearest edge pixel, as in ImageBlur.
+/// The cost per pixel does not depend on dx and dy.
+/// Requires: dx, dy >= 0.
+/// The image is changed in-place.
+/// On success, returns nonzero.
+/// On failure, returns 0, errno/errCause are set appropriately,
+/// and the image is not modified.
+int ImageMedian(Image img, int dx, int dy) { ///
+  assert(img != NULL);
+  assert(dx >= 0 && dy >= 0);
+  assert(2 * dy + 1 <= UINT16_MAX);
+  const int w = img->width;
+  const int h = img->height;
+  // Each band starts by building its column histograms from 2dy+1 rows,
+  // so bands are made a few times taller than that.
+  long grain = parGrain(w);
+  if (grain < 4 * (2L * dy + 1))
+    grain = 4 * (2L * dy + 1);
+  const int nthreads = PoolJobThreads(h, grain);
+  struct median_job job = {img, NULL, dx, dy, NULL, NULL};
+  int nscratch = 0;
+
+  int success =
+      check((job.fine = (uint16_t **)calloc((size_t)nthreads,
+                                            sizeof(uint16_t *))) != NULL,
+            "Allocation failed") &&
+      check((job.coarse = (uint16_t **)calloc((size_t)nthreads,
+                                              sizeof(uint16_t *))) != NULL,
+            "Allocation failed") &&
+      check((job.dst = (uint8 *)bufAllocRaw((size_t)w * h)) != NULL,
+            "Allocation failed");
+  for (; success && nscratch < nthreads; nscratch++)
+    success =
+        check((job.fine[nscratch] = (uint16_t *)malloc(
+                   ((size_t)w * 256 + 1) * sizeof(uint16_t))) != NULL,
+              "Allocation failed") &&
+        check((job.coarse[nscratch] = (uint16_t *)malloc(
+                   ((size_t)w * 16 + 1) * sizeof(uint16_t))) != NULL,
+              "Allocation failed");
+
+  if (success) {
+    if (w > 0 && h > 0)
+      fillPixels("ImageMedian", job.dst, w, h, h, grain, medianTask, &job);
+    bufFree(img->pixel);
+    img->pixel = job.dst;
+  } else {
+    errsave = errno;
+    bufFree(job.dst);
+    errno = errsave;
+  }
+  for (int i = 0; i < nscratch; i++) {
+    free(job.fine[i]);
+    free(job.coarse[i]);
+  }
+  free(job.fine);
+  free(job.coarse);
+  return success;
+}
+/// Morphology
+
+// Erosion (minimum) and dilation (maximum) over a (2dx+1)x(2dy+1) rectangle
+// are separable: a 1D pass along rows with window 2dx+1, then a 1D pass
+// along columns with window 2dy+1.  Each 1D pass uses the van Herk /
+// Gil-Werman algorithm: the padded line is split into blocks of k = 2r+1
+// pixels, and running extrema are computed forwards (g) and backwards (h)
+// within each block.  Any window of k pixels spans at most two blocks, so
+// its extremum is op(h[i], g[i+k-1]): 3 operations per pixel, whatever r.
+//
+// The row pass works along each row.  The column pass computes g and h one
+// whole row at a time, so its inner loops run along x and are vectorized.
+// It works on strips of MORPH_STRIP_W columns to keep buffers small.
+// Rows (in the row pass) and strips (in the column pass) are independent,
+// so they are processed in parallel.
+//
+// Pixels outside the image take the value of the nearest edge pixel, as in
+// ImageBlur, which for extrema is the same as ignoring them.
+
+#define MORPH_STRIP_W 256
+
+static inline uint8 morphOp(uint8 a, uint8 b, int isMax) {
+  if (isMax)
+    return a > b ? a : b;
+  return a < b ? a : b;
+}
+
+// Work shared by the rows or strips of a morphology pass
+struct morph_job {
+  Image img;
+  int r;            // window radius
+  int isMax;        // dilation (nonzero) or erosion (0)
+  uint8 *scratch;   // scratch buffers, one per worker
+  size_t scratchsz; // size of the scratch buffers of each worker
+};
+
+// Row pass: replace rows [begin, end) of img by their running extremum
+// over 2r+1 pixels.
+// Uses 3 scratch buffers (pad, g and h) of w+2r pixels.
+static void morphRows(void *arg, long begin, long end) {
+  const struct morph_job *job = arg;
+  Image img = job->img;
+  const int r = job->r;
+  const int isMax = job->isMax;
+  const int w = img->width;
+  const int n = w + 2 * r;
+  const int k = 2 * r + 1;
+  uint8 *pad = &job->scratch[(size_t)PoolWorkerId() * job->scratchsz];
+  uint8 *g = pad + n;
+  uint8 *h = g + n;
+  for (int y = (int)begin; y < end; y++) {
+    uint8 *row = &img->pixel[G(img, 0, y)];
+    for (int i = 0; i < n; i++)
+      pad[i] = row[clampIndex(i - r, w)];
+    for (int i = 0; i < n; i++)
+      g[i] = i % k == 0 ? pad[i] : morphOp(g[i - 1], pad[i], isMax);
+    h[n - 1] = pad[n - 1];
+    for (int i = n - 2; i >= 0; i--)
+      h[i] = (i + 1) % k == 0 ? pad[i] : morphOp(h[i + 1], pad[i], isMax);
+    for (int x = 0; x < w; x++)
+      row[x] = morphOp(h[x], g[x + k - 1], isMax);
+  }
+}
+
+// Column pass: replace the columns of strips [begin, end) of img by their
+// running extremum over 2r+1 pixels.
+// Uses 2 scratch buffers (g and h) of (height+2r) x MORPH_STRIP_W pixels.
+static void morphColumns(void *arg, long begin, long end) {
+  const struct morph_job *job = arg;
+  Image img = job->img;
+  const int r = job->r;
+  const int isMax = job->isMax;
+  const int w = img->width;
+  const int n = img->height + 2 * r;
+  const int k = 2 * r + 1;
+  uint8 *g = &job->scratch[(size_t)PoolWorkerId() * job->scratchsz];
+  uint8 *h = g + (size_t)n * MORPH_STRIP_W;
+  for (long t = begin; t < end; t++) {
+    const int x0 = (int)t * MORPH_STRIP_W;
+    const int sw = w - x0 < MORPH_STRIP_W ? w - x0 : MORPH_STRIP_W;
+    for (int j = 0; j < n; j++) {
+      const uint8 *src = &img->pixel[G(img, x0, clampIndex(j - r, img->height))];
+      uint8 *gj = &g[(size_t)j * sw];
+      if (j % k == 0) {
+        memcpy(gj, src, (size_t)sw);
+      } else {
+        const uint8 *gp = gj - sw;
+        for (int x = 0; x < sw; x++)
+          gj[x] = morphOp(gp[x], src[x], isMax);
+      }
+    }
+    for (int j = n - 1; j >= 0; j--) {
+      const uint8 *src = &img->pixel[G(img, x0, clampIndex(j - r, img->height))];
+      uint8 *hj = &h[(size_t)j * sw];
+      if (j == n - 1 || (j + 1) % k == 0) {
+        memcpy(hj, src, (size_t)sw);
+      } else {
+        const uint8 *hn = hj + sw;
+        for (int x = 0; x < sw; x++)
+          hj[x] = morphOp(hn[x], src[x], isMax);
+      }
+    }
+    for (int y = 0; y < img->height; y++) {
+      uint8 *dst = &img->pixel[G(img, x0, y)];
+      const uint8 *hy = &h[(size_t)y * sw];
+      const uint8 *gy = &g[(size_t)(y + k - 1) * sw];
+      for (int x = 0; x < sw; x++)
+        dst[x] = morphOp(hy[x], gy[x], isMax);
+    }
+  }
+}
+
+// Erode (isMax == 0) or dilate (isMax != 0) img in-place.
+static int morph(Image img, int dx, int dy, int isMax) {
+  const int w = img->width;
+  const int h = img->height;
+  const long rowgrain = parGrain(w);
+  const long nstrips = (w + MORPH_STRIP_W - 1) / MORPH_STRIP_W;
+  const long stripgrain = parGrain((long)MORPH_STRIP_W * h);
+  const size_t rowsz = 3 * ((size_t)w + 2 * (size_t)dx);
+  const size_t stripsz = 2 * ((size_t)h + 2 * (size_t)dy) * MORPH_STRIP_W;
+  int nthreads = dx > 0 ? PoolJobThreads(h, rowgrain) : 1;
+  if (dy > 0 && PoolJobThreads(nstrips, stripgrain) > nthreads)
+    nthreads = PoolJobThreads(nstrips, stripgrain);
+  struct morph_job job = {img, 0, isMax, NULL,
+                          (rowsz > stripsz ? rowsz : stripsz) + 1};
+  if (!check((job.scratch = (uint8 *)malloc((size_t)nthreads *
+                                            job.scratchsz)) != NULL,
+             "Allocation failed"))
+    return 0;
+  InstrSpan span;
+  if (dx > 0) {
+    InstrSpanBegin(&span, isMax ? "dilate rows" : "erode rows");
+    job.r = dx;
+    PoolParallelFor(h, rowgrain, morphRows, &job);
+    PIXMEM_ADD(2 * (unsigned long)w * h); // count pixel memory accesses
+    InstrSpanArg(&span, "radius", dx);
+    InstrSpanEnd(&span);
+  }
+  if (dy > 0) {
+    InstrSpanBegin(&span, isMax ? "dilate columns" : "erode columns");
+    job.r = dy;
+    PoolParallelFor(nstrips, stripgrain, morphColumns, &job);
+    PIXMEM_ADD(2 * (unsigned long)w * h); // count pixel memory accesses
+    InstrSpanArg(&span, "radius", dy);
+    InstrSpanEnd(&span);
+  }
+  free(job.scratch);
+  return 1;
+}
+
+/// Erode an image with a (2dx+1)x(2dy+1) rectangle.
+/// Each pixel is substituted by the minimum of the pixels in the rectangle
+/// [x-dx, x+dx]x[y-dy, y+dy] (pixels outside the image are ignored).
+/// The cost per pixel does not depend on dx and dy.
+/// Requires: dx, dy >= 0.
+/// The image is changed in-place.
+/// On success, returns nonzero.
+/// On failure, returns 0, errno/errCause are set appropriately,
+/// and the image is not modified.
+int ImageErode(Image img, int dx, int dy) { ///
+  assert(img != NULL);
+  assert(dx >= 0 && dy >= 0);
+  return morph(img, dx, dy, 0);
+}
+
+/// Dilate an image with a (2dx+1)x(2dy+1) rectangle.
+/// Each pixel is substituted by the maximum of the pixels in the rectangle
+/// [x-dx, x+dx]x[y-dy, y+dy] (pixels outside the image are ignored).
+/// Otherwise, like ImageErode.
+int ImageDilate(Image img, int dx, int dy) { ///
+  assert(img != NULL);
+  assert(dx >= 0 && dy >= 0);
+  return morph(img, dx, dy, 1);
+}
+
+/// Morphological opening: erode, then dilate, with the same rectangle.
+/// Removes bright details smaller than the rectangle.
+/// Otherwise, like ImageErode (but on failure the image may be eroded).
+int ImageOpen(Image img, int dx, int dy) { ///
+  assert(img != NULL);
+  assert(dx >= 0 && dy >= 0);
+  return morph(img, dx, dy, 0) && morph(img, dx, dy, 1);
+}
+
+/// Morphological closing: dilate, then erode, with the same rectangle.
+/// Fills dark details smaller than the rectangle.
+/// Otherwise, like ImageErode (but on failure the image may be dilated).
+int ImageClose(Image img, int dx, int dy) { ///
+  assert(img != NULL);
+  assert(dx >= 0 && dy >= 0);
+  return morph(img, dx, dy, 1) && morph(img, dx, dy, 0);
+}
+
+/// Connected components
+
+// Labeling
+//
+// ImageLabelComponents uses union-find on pixel indices: parent[i] is the
+// index of another pixel of the same component, or i itself for the root.
+// Trees are always linked to the smaller root, so parent[i] <= i, and each
+// root is the first pixel of its component.  Background pixels have parent
+// LABEL_NONE.
+//
+// 1. Bands of rows are labeled in parallel, each one on its own.
+// 2. Components that cross the seams between bands are merged (serially).
+// 3. In parallel, each pixel is linked directly to its root, and the roots
+//    of each band are counted.
+// 4. In parallel, roots are numbered, in order, from the counts of the
+//    previous bands.
+// 5. In parallel, each pixel gets the number of its root.
+// Finally, the statistics are computed in a single serial pass.
+// In steps 3 to 5, parents in other bands may be read while another thread
+// updates them, so parents are accessed atomically.  The results do not
+// depend on the number of threads.
+
+#define LABEL_NONE UINT32_MAX
+#define LABEL_BAND 64
+
+struct label_job {
+  Image img;
+  long band;         // rows per band
+  uint32_t *parent;
+  uint32_t *label;
+  uint32_t *count;   // roots of each band, then the number before each band
+};
+
+static inline uint32_t parentOf(const uint32_t *parent, uint32_t i) {
+  return __atomic_load_n(&parent[i], __ATOMIC_RELAXED);
+}
+
+// Root of pixel i.  Halves paths (only used while a band is being labeled
+// by a single thread, or serially).
+static uint32_t labelFind(uint32_t *parent, uint32_t i) {
+  while (parent[i] != i) {
+    parent[i] = parent[parent[i]];
+    i = parent[i];
+  }
+  return i;
+}
+
+static void labelUnion(uint32_t *parent, uint32_t i, uint32_t j) {
+  i = labelFind(parent, i);
+  j = labelFind(parent, j);
+  if (i < j)
+    parent[j] = i;
+  else if (j < i)
+    parent[i] = j;
+}
+
+// Union pixel i = (x, y) with its foreground neighbours in row y-1.
+// The left neighbour is in the same component as the upper left one
+// whenever both are set, so it is only needed if that one is not.
+static void labelUp(const uint8 *pixel, uint32_t *parent, int w, int x,
+                    uint32_t i) {
+  const uint32_t up = i - (uint32_t)w;
+  if (pixel[up]) { // connected to up-left and up-right too
+    labelUnion(parent, i, up);
+    return;
+  }
+  if (x > 0 && pixel[up - 1] && !pixel[i - 1])
+    labelUnion(parent, i, up - 1);
+  if (x + 1 < w && pixel[up + 1])
+    labelUnion(parent, i, up + 1);
+}
+
+// Step 1: label bands [begin, end) on their own.
+static void labelBandTask(void *arg, long begin, long end) {
+  const struct label_job *job = arg;
+  Image img = job->img;
+  const int w = img->width;
+  uint32_t *parent = job->parent;
+  for (long b = begin; b < end; b++) {
+    const int y0 = (int)(b * job->band);
+    const int y1 = y0 + job->band < img->height ? y0 + (int)job->band
+                                                : img->height;
+    for (int y = y0; y < y1; y++) {
+      for (int x = 0; x < w; x++) {
+        const uint32_t i = (uint32_t)G(img, x, y);
+        if (img->pixel[i] == 0) {
+          parent[i] = LABEL_NONE;
+          continue;
+        }
+        parent[i] = i;
+        if (x > 0 && img->pixel[i - 1])
+          labelUnion(parent, i, i - 1);
+        if (y > y0)
+          labelUp(img->pixel, parent, w, x, i);
+      }
+    }
+  }
+}
+
+// Step 3: link pixels of bands [begin, end) to their roots, and count roots.
+static void labelRootTask(void *arg, long begin, long end) {
+  const struct label_job *job = arg;
+  const long size = (long)job->img->width * job->img->height;
+  uint32_t *parent = job->parent;
+  for (long b = begin; b < end; b++) {
+    const long i0 = b * job->band * job->img->width;
+    const long i1 = i0 + job->band * job->img->width < size
+                        ? i0 + job->band * job->img->width
+                        : size;
+    uint32_t roots = 0;
+    for (long i = i0; i < i1; i++) {
+      uint32_t p = parent[i];
+      if (p == LABEL_NONE)
+        continue;
+      if (p == (uint32_t)i) {
+        roots++;
+        continue;
+      }
+      uint32_t r = p;
+      while ((p = parentOf(parent, r)) != r)
+        r = p;
+      __atomic_store_n(&parent[i], r, __ATOMIC_RELAXED);
+    }
+    job->count[b] = roots;
+  }
+}
+
+// Step 4: number the roots of bands [begin, end).
+static void labelNumberTask(void *arg, long begin, long end) {
+  const struct label_job *job = arg;
+  const long size = (long)job->img->width * job->img->height;
+  for (long b = begin; b < end; b++) {
+    const long i0 = b * job->band * job->img->width;
+    const long i1 = i0 + job->band * job->img->width < size
+                        ? i0 + job->band * job->img->width
+                        : size;
+    uint32_t next = job->count[b] + 1;
+    for (long i = i0; i < i1; i++)
+      if (job->parent[i] == (uint32_t)i)
+        job->label[i] = next++;
+  }
+}
+
+// Step 5: label the pixels of bands [begin, end).
+static void labelPixelTask(void *arg, long begin, long end) {
+  const struct label_job *job = arg;
+  const long size = (long)job->img->width * job->img->height;
+  for (long b = begin; b < end; b++) {
+    const long i0 = b * job->band * job->img->width;
+    const long i1 = i0 + job->band * job->img->width < size
+                        ? i0 + job->band * job->img->width
+                        : size;
+    for (long i = i0; i < i1; i++) {
+      const uint32_t p = job->parent[i];
+      if (p == LABEL_NONE)
+        job->label[i] = 0;
+      else if (p != (uint32_t)i)
+        job->label[i] = job->label[p]; // roots were numbered in step 4
+    }
+  }
+}
+
+/// Label the connected components of the nonzero pixels of img.
+/// Pixels are connected to their 8 neighbours.
+/// Components are numbered 1, 2, ... in the order of their first pixel
+/// (left to right, top to bottom).
+/// On success, returns nonzero and sets:
+///   (*plabels) to a new array of width*height labels (in row order), with
+///   the number of the component of each pixel, or 0 for zero pixels;
+///   (*pcomps) to a new array with the statistics of each component (the
+///   component numbered k is (*pcomps)[k-1]);
+///   (*pcount) to the number of components.
+/// (The caller is responsible for freeing both arrays with free!)
+/// On failure, returns 0 and errno/errCause are set appropriately.
+int ImageLabelComponents(Image img, uint32_t **plabels,
+                         ImageComponent **pcomps, long *pcount) { ///
+  assert(img != NULL);
+  assert(plabels != NULL && pcomps != NULL && pcount != NULL);
+  const int w = img->width;
+  const int h = img->height;
+  const size_t size = (size_t)w * h;
+
+  // Bands of at least LABEL_BAND rows, so that seams are few
+  struct label_job job = {img, parGrain(w), NULL, NULL, NULL};
+  if (job.band < LABEL_BAND)
+    job.band = LABEL_BAND;
+  const long nbands = (h + job.band - 1) / job.band;
+  int success =
+      check(size < LABEL_NONE, "Image too large") && // labels are uint32_t
+      check((job.label = (uint32_t *)malloc(size * sizeof(uint32_t) + 1)) !=
+                NULL, "Allocation failed") &&
+      check((job.parent = (uint32_t *)bufAlloc(size * sizeof(uint32_t))) !=
+                NULL, "Allocation failed") &&
+      check((job.count = (uint32_t *)malloc((size_t)(nbands + 1) *
+                                            sizeof(uint32_t))) != NULL,
+            "Allocation failed");
+  ImageComponent *comps = NULL;
+  long count = 0;
+  if (success) {
+    // 1. Bands
+    PoolParallelFor(nbands, 1, labelBandTask, &job);
+    PIXMEM_ADD((unsigned long)size); // count pixel memory accesses
+    // 2. Seams
+    for (long b = 1; b < nbands; b++) {
+      const int y = (int)(b * job.band);
+      for (int x = 0; x < w; x++) {
+        const uint32_t i = (uint32_t)G(img, x, y);
+        if (img->pixel[i])
+          labelUp(img->pixel, job.parent, w, x, i);
+      }
+      PIXMEM_ADD((unsigned long)w);
+    }
+    // 3-5. Roots, numbers and labels
+    PoolParallelFor(nbands, 1, labelRootTask, &job);
+    for (long b = 0; b < nbands; b++) { // counts -> numbers before each band
+      const uint32_t roots = job.count[b];
+      job.count[b] = (uint32_t)count;
+      count += roots;
+    }
+    PoolParallelFor(nbands, 1, labelNumberTask, &job);
+    PoolParallelFor(nbands, 1, labelPixelTask, &job);
+
+    success = check((comps = (ImageComponent *)calloc(
+                         count > 0 ? (size_t)count : 1,
+                         sizeof(ImageComponent))) != NULL,
+                    "Allocation failed");
+  }
+  if (success) {
+    // Statistics (bounding boxes are kept as x0, y0, x1, y1 until the end)
+    for (long k = 0; k < count; k++) {
+      comps[k].x = w;
+      comps[k].y = h;
+    }
+    for (int y = 0; y < h; y++) {
+      const uint32_t *row = &job.label[(size_t)y * w];
+      for (int x = 0; x < w; x++) {
+        if (row[x] == 0)
+          continue;
+        ImageComponent *c = &comps[row[x] - 1];
+        c->area++;
+        c->cx += x;
+        c->cy += y;
+        c->x = x < c->x ? x : c->x;
+        c->w = x > c->w ? x : c->w;
+        c->y = y < c->y ? y : c->y;
+        c->h = y > c->h ? y : c->h;
+      }
+    }
+    for (long k = 0; k < count; k++) {
+      ImageComponent *c = &comps[k];
+      c->w = c->w - c->x + 1;
+      c->h = c->h - c->y + 1;
+      c->cx /= (double)c->area;
+      c->cy /= (double)c->area;
+    }
+    *plabels = job.label;
+    *pcomps = comps;
+    *pcount = count;
+    job.label = NULL;
+  }
+  errsave = errno;
+  free(job.label);
+  bufFree(job.parent);
+  free(job.count);
+  errno = errsave;
+  return success;
+}
+
+/// Binary images
+
+// A BitImage stores one bit per pixel, 1 for black and 0 for white, as in
+// PBM files.  Each row takes stride 64-bit words, with the leftmost pixel
+// in the most significant bit of the first word; so a row written as
+// big-endian bytes is a PBM row.  Bits past the width are always 0, so
+// whole words can be compared and counted.
+// For binary images, PIXMEM counts accesses to words, not pixels.
+
+struct bitimage {
+  int width;
+  int height;
+  int stride;     // words per row
+  uint64_t *word; // rows of stride words
+};
+
+// Mask of the first (most significant) n bits of a word, for 0 < n <= 64.
+static inline uint64_t bitMask(int n) {
+  return n >= 64 ? ~(uint64_t)0 : ~(~(uint64_t)0 >> n);
+}
+
+// Mask of the valid bits in word j of a row of width w.
+static inline uint64_t bitWordMask(int w, int j) {
+  return bitMask(w - 64 * j);
+}
+
+// Row y of img.
+static inline uint64_t *bitRow(BitImage img, int y) {
+  return &img->word[(size_t)y * img->stride];
+}
+
+// The 64 bits that start at bit off of a row of n words.
+// Bits past the end of the row are 0.
+static inline uint64_t bitWindow(const uint64_t *row, int n, long off) {
+  const long i = off >> 6;
+  const int s = (int)(off & 63);
+  const uint64_t hi = i < n ? row[i] : 0;
+  if (s == 0)
+    return hi;
+  const uint64_t lo = i + 1 < n ? row[i + 1] : 0;
+  return (hi << s) | (lo >> (64 - s));
+}
+
+// Store the first n bits of v (0 < n <= 64) at bits [off, off+n) of row.
+static inline void bitStore(uint64_t *row, long off, uint64_t v, int n) {
+  const long i = off >> 6;
+  const int s = (int)(off & 63);
+  const uint64_t m = bitMask(n);
+  v &= m;
+  row[i] = (row[i] & ~(m >> s)) | (v >> s);
+  if (s + n > 64)
+    row[i + 1] = (row[i + 1] & ~(m << (64 - s))) | (v << (64 - s));
+}
+
+/// Create a new white binary image.
+BitImage BitImageCreate(int width, int height) { ///
+  assert(width >= 0);
+  assert(height >= 0);
+  BitImage img = NULL;
+  const int stride = (width + 63) / 64;
+  int success =
+      check((img = (BitImage)malloc(sizeof(struct bitimage))) != NULL,
+            "Allocation failed") &&
+      check((img->word = (uint64_t *)bufAlloc((size_t)stride * height *
+                                              sizeof(uint64_t))) != NULL,
+            "Allocation failed");
+  if (img != NULL) {
+    img->width = width;
+    img->height = height;
+    img->stride = stride;
+  }
+  if (!success) {
+    errsave = errno;
+    BitImageDestroy(&img);
+    errno = errsave;
+  }
+  return img;
+}
+
+/// Destroy the binary image pointed to by (*imgp).
+/// Ensures: (*imgp)==NULL.  Does nothing if (*imgp) is NULL.
+void BitImageDestroy(BitImage *imgp) { ///
+  assert(imgp != NULL);
+  if (*imgp != NULL) {
+    bufFree((*imgp)->word);
+    free(*imgp);
+    *imgp = NULL;
+  }
+}
+
+/// Get binary image width
+int BitImageWidth(BitImage img) { ///
+  assert(img != NULL);
+  return img->width;
+}
+
+/// Get binary image height
+int BitImageHeight(BitImage img) { ///
+  assert(img != NULL);
+  return img->height;
+}
+
+/// Get the pixel at position (x,y): 1 (black) or 0 (white).
+int BitImageGetPixel(BitImage img, int x, int y) { ///
+  assert(img != NULL);
+  assert(0 <= x && x < img->width && 0 <= y && y < img->height);
+  PIXMEM_ADD(1); // count one word access (read)
+  return (int)(bitRow(img, y)[x >> 6] >> (63 - (x & 63))) & 1;
+}
+
+/// Set the pixel at position (x,y) to bit (nonzero for black).
+void BitImageSetPixel(BitImage img, int x, int y, int bit) { ///
+  assert(img != NULL);
+  assert(0 <= x && x < img->width && 0 <= y && y < img->height);
+  PIXMEM_ADD(1); // count one word access (store)
+  uint64_t *w = &bitRow(img, y)[x >> 6];
+  const uint64_t m = (uint64_t)1 << (63 - (x & 63));
+  *w = bit ? *w | m : *w & ~m;
+}
+
+// Conversions split the rows among threads.
+struct bit_convert_job {
+  Image img;
+  BitImage bits;
+  uint8 level; // threshold, or maxval
+};
+
+static void bitFromImageTask(void *arg, long begin, long end) {
+  const struct bit_convert_job *job = arg;
+  const int w = job->img->width;
+  for (long y = begin; y < end; y++) {
+    const uint8 *src = &job->img->pixel[G(job->img, 0, (int)y)];
+    uint64_t *dst = bitRow(job->bits, (int)y);
+    for (int j = 0; j < job->bits->stride; j++) {
+      const int n = w - 64 * j < 64 ? w - 64 * j : 64;
+      uint64_t v = 0;
+      for (int b = 0; b < n; b++)
+        v |= (uint64_t)(src[64 * j + b] < job->level) << (63 - b);
+      dst[j] = v;
+    }
+  }
+}
+
+/// Convert an image to a binary image, with threshold thr.
+/// Pixels with level<thr become black (1), like in ImageThreshold.
+BitImage BitImageFromImage(Image img, uint8 thr) { ///
+  assert(img != NULL);
+  BitImage bits = BitImageCreate(img->width, img->height);
+  if (bits == NULL)
+    return NULL;
+  struct bit_convert_job job = {img, bits, thr};
+  PoolParallelFor(img->height, parGrain(img->width), bitFromImageTask, &job);
+  PIXMEM_ADD((unsigned long)img->width * img->height); // pixels read
+  PIXMEM_ADD((unsigned long)bits->stride * bits->height); // words written
+  return bits;
+}
+
+static void bitToImageTask(void *arg, long begin, long end) {
+  const struct bit_convert_job *job = arg;
+  const int w = job->img->width;
+  for (long y = begin; y < end; y++) {
+    const uint64_t *src = bitRow(job->bits, (int)y);
+    uint8 *dst = &job->img->pixel[G(job->img, 0, (int)y)];
+    for (int x = 0; x < w; x++)
+      dst[x] = (src[x >> 6] >> (63 - (x & 63))) & 1 ? 0 : job->level;
+  }
+}
+
+/// Convert a binary image to an image with the given maxval.
+/// Black pixels become 0, and white pixels become maxval.
+Image BitImageToImage(BitImage img, uint8 maxval) { ///
+  assert(img != NULL);
+  Image out = imageCreateRaw(img->width, img->height, maxval);
+  if (out == NULL || img->width == 0)
+    return out;
+  struct bit_convert_job job = {out, img, maxval};
+  fillPixels("BitImageToImage", out->pixel, img->width, img->height,
+             img->height, parGrain(img->width), bitToImageTask, &job);
+  PIXMEM_ADD((unsigned long)img->stride * img->height); // words read
+  PIXMEM_ADD((unsigned long)img->width * img->height); // pixels written
+  return out;
+}
+
+/// img1 = img1 AND img2 (black where both are black)
+void BitImageAnd(BitImage img1, BitImage img2) { ///
+  assert(img1 != NULL && img2 != NULL);
+  assert(img1->width == img2->width && img1->height == img2->height);
+  const size_t n = (size_t)img1->stride * img1->height;
+  for (size_t i = 0; i < n; i++)
+    img1->word[i] &= img2->word[i];
+  PIXMEM_ADD(3 * (unsigned long)n);
+}
+
+/// img1 = img1 OR img2 (black where either is black)
+void BitImageOr(BitImage img1, BitImage img2) { ///
+  assert(img1 != NULL && img2 != NULL);
+  assert(img1->width == img2->width && img1->height == img2->height);
+  const size_t n = (size_t)img1->stride * img1->height;
+  for (size_t i = 0; i < n; i++)
+    img1->word[i] |= img2->word[i];
+  PIXMEM_ADD(3 * (unsigned long)n);
+}
+
+/// img1 = img1 XOR img2 (black where they differ)
+void BitImageXor(BitImage img1, BitImage img2) { ///
+  assert(img1 != NULL && img2 != NULL);
+  assert(img1->width == img2->width && img1->height == img2->height);
+  const size_t n = (size_t)img1->stride * img1->height;
+  for (size_t i = 0; i < n; i++)
+    img1->word[i] ^= img2->word[i];
+  PIXMEM_ADD(3 * (unsigned long)n);
+}
+
+/// img = NOT img (swap black and white)
+void BitImageNot(BitImage img) { ///
+  assert(img != NULL);
+  if (img->stride == 0)
+    return;
+  const uint64_t last = bitWordMask(img->width, img->stride - 1);
+  for (int y = 0; y < img->height; y++) {
+    uint64_t *row = bitRow(img, y);
+    for (int j = 0; j < img->stride; j++)
+      row[j] = ~row[j];
+    row[img->stride - 1] &= last; // keep bits past the width at 0
+  }
+  PIXMEM_ADD(2 * (unsigned long)img->stride * img->height);
+}
+
+/// Count the black pixels of img.
+long BitImageCount(BitImage img) { ///
+  assert(img != NULL);
+  const size_t n = (size_t)img->stride * img->height;
+  long count = 0;
+  for (size_t i = 0; i < n; i++)
+    count += __builtin_popcountll(img->word[i]);
+  PIXMEM_ADD((unsigned long)n);
+  return count;
+}
+
+/// Load a raw PBM (P4) file.
+BitImage BitImageLoad(const char *filename) { ///
+  int w, h;
+  char c;
+  FILE *f = NULL;
+  BitImage img = NULL;
+  uint8 *bytes = NULL;
+
+  int success =
+      check((f = fopen(filename, "rb")) != NULL, "Open failed") &&
+      // Parse PBM header
+      check(fscanf(f, "P%c ", &c) == 1 && c == '4', "Invalid file format") &&
+      skipComments(f) >= 0 &&
+      check(fscanf(f, "%d ", &w) == 1 && w >= 0, "Invalid width") &&
+      skipComments(f) >= 0 &&
+      check(fscanf(f, "%d", &h) == 1 && h >= 0, "Invalid height") &&
+      check(fscanf(f, "%c", &c) == 1 && isspace(c), "Whitespace expected") &&
+      // Allocate image, and a buffer for a row of the file
+      (img = BitImageCreate(w, h)) != NULL &&
+      check((bytes = (uint8 *)malloc((size_t)img->stride * 8 + 1)) != NULL,
+            "Allocation failed");
+  // Read rows
+  const size_t rowbytes = ((size_t)w + 7) / 8;
+  for (int y = 0; success && y < h; y++) {
+    success = check(fread(bytes, 1, rowbytes, f) == rowbytes, "Reading pixels");
+    memset(bytes + rowbytes, 0, (size_t)img->stride * 8 - rowbytes);
+    uint64_t *row = bitRow(img, y);
+    for (int j = 0; success && j < img->stride; j++) {
+      uint64_t v = 0;
+      for (int b = 0; b < 8; b++)
+        v = v << 8 | bytes[8 * j + b];
+      row[j] = v & bitWordMask(w, j); // ignore padding bits
+    }
+  }
+  if (img != NULL)
+    PIXMEM_ADD((unsigned long)img->stride * h); // count word accesses
+
+  // Cleanup
+  errsave = errno;
+  free(bytes);
+  if (!success)
+    BitImageDestroy(&img);
+  if (f != NULL)
+    fclose(f);
+  errno = errsave;
+  return img;
+}
+
+/// Save binary image to a raw PBM (P4) file.
+/// On success, returns nonzero.
+/// On failure, returns 0, errno/errCause are set appropriately, and
+/// a partial and invalid file may be left in the system.
+int BitImageSave(BitImage img, const char *filename) { ///
+  assert(img != NULL);
+  const int w = img->width;
+  const int h = img->height;
+  const size_t rowbytes = ((size_t)w + 7) / 8;
+  FILE *f = NULL;
+  uint8 *bytes = NULL;
+
+  int success =
+      check((f = fopen(filename, "wb")) != NULL, "Open failed") &&
+      check(fprintf(f, "P4\n%d %d\n", w, h) > 0, "Writing header failed") &&
+      check((bytes = (uint8 *)malloc((size_t)img->stride * 8 + 1)) != NULL,
+            "Allocation failed");
+  for (int y = 0; success && y < h; y++) {
+    const uint64_t *row = bitRow(img, y);
+    for (int j = 0; j < img->stride; j++)
+      for (int b = 0; b < 8; b++)
+        bytes[8 * j + b] = (uint8)(row[j] >> (56 - 8 * b));
+    success = check(fwrite(bytes, 1, rowbytes, f) == rowbytes,
+                    "Writing pixels failed");
+  }
+  PIXMEM_ADD((unsigned long)img->stride * h); // count word accesses
+
+  // Cleanup
+  errsave = errno;
+  free(bytes);
+  if (f != NULL && fclose(f) != 0 && success)
+    success = check(0, "Writing pixels failed");
+  else
+    errno = errsave;
+  return success;
+}
+
+/// Paste binary image img2 into position (x, y) of img1.
+/// This modifies img1 in-place: no allocation involved.
+/// Requires: img2 must fit inside img1 at position (x, y).
+void BitImagePaste(BitImage img1, int x, int y, BitImage img2) { ///
+  assert(img1 != NULL && img2 != NULL);
+  assert(0 <= x && x + img2->width <= img1->width);
+  assert(0 <= y && y + img2->height <= img1->height);
+  const int w = img2->width;
+  for (int r = 0; r < img2->height; r++) {
+    uint64_t *dst = bitRow(img1, y + r);
+    const uint64_t *src = bitRow(img2, r);
+    for (int j = 0; j < img2->stride; j++)
+      bitStore(dst, x + 64L * j, src[j], w - 64 * j < 64 ? w - 64 * j : 64);
+  }
+  PIXMEM_ADD(3 * (unsigned long)img2->stride * img2->height);
+}
+
+/// Crop the rectangle with top left corner (x, y), width w and height h
+/// from img, into a new binary image.
+/// Requires: the rectangle must be inside img.
+BitImage BitImageCrop(BitImage img, int x, int y, int w, int h) { ///
+  assert(img != NULL);
+  assert(0 <= x && w >= 0 && x + w <= img->width);
+  assert(0 <= y && h >= 0 && y + h <= img->height);
+  BitImage out = BitImageCreate(w, h);
+  if (out == NULL)
+    return NULL;
+  for (int r = 0; r < h; r++) {
+    const uint64_t *src = bitRow(img, y + r);
+    uint64_t *dst = bitRow(out, r);
+    for (int j = 0; j < out->stride; j++)
+      dst[j] = bitWindow(src, img->stride, x + 64L * j) & bitWordMask(w, j);
+  }
+  PIXMEM_ADD(3 * (unsigned long)out->stride * h);
+  return out;
+}
+
+// Compare img2 to the subimage of img1 at (x, y), a word at a time.
+// Adds the number of words compared to (*count).
+static int bitMatchSub(BitImage img1, int x, int y, BitImage img2,
+                       unsigned long *count) {
+  const int w = img2->width;
+  for (int r = 0; r < img2->height; r++) {
+    const uint64_t *row1 = bitRow(img1, y + r);
+    const uint64_t *row2 = bitRow(img2, r);
+    for (int j = 0; j < img2->stride; j++) {
+      (*count)++;
+      if ((bitWindow(row1, img1->stride, x + 64L * j) & bitWordMask(w, j)) !=
+          row2[j])
+        return 0;
+    }
+  }
+  return 1;
+}
+
+/// Locate binary image img2 inside img1.
+/// If a match is found, returns 1 and its position is set in (*px, *py).
+/// If no match is found, returns 0 and (*px, *py) are left untouched.
+int BitImageLocateSubImage(BitImage img1, int *px, int *py, BitImage img2) { ///
+  assert(img1 != NULL && img2 != NULL);
+  assert(px != NULL && py != NULL);
+  unsigned long count = 0;
+  int found = 0;
+  // Same search order as ImageLocateSubImage: column by column
+  for (int x = 0; !found && x + img2->width <= img1->width; x++) {
+    for (int y = 0; !found && y + img2->height <= img1->height; y++) {
+      if (bitMatchSub(img1, x, y, img2, &count)) {
+        *px = x;
+        *py = y;
+        found = 1;
+      }
+    }
+  }
+  PIXMEM_ADD(2 * count); // a word of each image per comparison
+  return found;
+}
+
+/// Run-length encoded images
+
+// An RleImage stores each row as runs of pixels with the same level.
+// Run i covers the columns up to end[i] (exclusive) with level[i]; the runs
+// of row y are [row[y], row[y+1]), and the last one ends at the width.
+// Adjacent runs of a row always have different levels, so the encoding of
+// an image is unique.
+// For RLE images, PIXMEM counts accesses to runs, not pixels.
+
+struct rleimage {
+  int width;
+  int height;
+  int maxval;
+  long *row;    // height+1 offsets of the runs of each row
+  int *end;     // end column of each run
+  uint8 *level; // level of each run
+};
+
+// Allocate an RLE image with its row offsets, but no runs.
+// On failure, returns NULL and errno/errCause are set.
+static RleImage rleAlloc(int width, int height, uint8 maxval) {
+  RleImage img = NULL;
+  int success =
+      check((img = (RleImage)calloc(1, sizeof(struct rleimage))) != NULL,
+            "Allocation failed") &&
+      check((img->row = (long *)malloc(((size_t)height + 1) *
+                                       sizeof(long))) != NULL,
+            "Allocation failed");
+  if (img != NULL) {
+    img->width = width;
+    img->height = height;
+    img->maxval = maxval;
+  }
+  if (!success) {
+    errsave = errno;
+    RleImageDestroy(&img);
+    errno = errsave;
+  }
+  return img;
+}
+
+// (Re)allocate the run arrays of img for n runs.
+// On failure, returns 0, errno/errCause are set, and img is unchanged.
+static int rleReserve(RleImage img, long n) {
+  int *end = (int *)realloc(img->end, (size_t)n * sizeof(int) + 1);
+  if (end != NULL)
+    img->end = end;
+  uint8 *level = end == NULL ? NULL : (uint8 *)realloc(img->level, (size_t)n + 1);
+  if (level != NULL)
+    img->level = level;
+  return check(level != NULL, "Allocation failed");
+}
+
+// Index of the run of row y that contains column x.
+static long rleFind(RleImage img, int y, int x) {
+  long lo = img->row[y];
+  long hi = img->row[y + 1] - 1;
+  while (lo < hi) {
+    long mid = lo + (hi - lo) / 2;
+    if (img->end[mid] > x)
+      hi = mid;
+    else
+      lo = mid + 1;
+  }
+  return lo;
+}
+
+// Append a run to the row that starts at run first, of which (*n) runs are
+// already built, merging it with the last one if they have the same level.
+static inline void rleEmit(RleImage img, long first, long *n, int end,
+                           uint8 level) {
+  if (*n > first && img->level[*n - 1] == level) {
+    img->end[*n - 1] = end;
+  } else {
+    img->end[*n] = end;
+    img->level[*n] = level;
+    (*n)++;
+  }
+}
+
+/// Create a new black RLE image.
+RleImage RleImageCreate(int width, int height, uint8 maxval) { ///
+  assert(width >= 0);
+  assert(height >= 0);
+  assert(0 < maxval && maxval <= PixMax);
+  RleImage img = rleAlloc(width, height, maxval);
+  const long n = width > 0 ? height : 0; // one run per row
+  if (img != NULL && !rleReserve(img, n)) {
+    errsave = errno;
+    RleImageDestroy(&img);
+    errno = errsave;
+  }
+  if (img == NULL)
+    return NULL;
+  for (int y = 0; y <= height; y++)
+    img->row[y] = width > 0 ? y : 0;
+  for (long i = 0; i < n; i++) {
+    img->end[i] = width;
+    img->level[i] = 0;
+  }
+  return img;
+}
+
+/// Destroy the RLE image pointed to by (*imgp).
+/// Ensures: (*imgp)==NULL.  Does nothing if (*imgp) is NULL.
+void RleImageDestroy(RleImage *imgp) { ///
+  assert(imgp != NULL);
+  if (*imgp != NULL) {
+    free((*imgp)->row);
+    free((*imgp)->end);
+    free((*imgp)->level);
+    free(*imgp);
+    *imgp = NULL;
+  }
+}
+
+/// Get RLE image width
+int RleImageWidth(RleImage img) { ///
+  assert(img != NULL);
+  return img->width;
+}
+
+/// Get RLE image height
+int RleImageHeight(RleImage img) { ///
+  assert(img != NULL);
+  return img->height;
+}
+
+/// Get RLE image maxval
+int RleImageMaxval(RleImage img) { ///
+  assert(img != NULL);
+  return img->maxval;
+}
+
+/// Number of runs in img.
+long RleImageRuns(RleImage img) { ///
+  assert(img != NULL);
+  return img->row[img->height];
+}
+
+/// Bytes of memory used by img.
+size_t RleImageBytes(RleImage img) { ///
+  assert(img != NULL);
+  return sizeof(struct rleimage) + ((size_t)img->height + 1) * sizeof(long) +
+         (size_t)img->row[img->height] * (sizeof(int) + 1);
+}
+
+/// Get the pixel level at position (x,y).
+uint8 RleImageGetPixel(RleImage img, int x, int y) { ///
+  assert(img != NULL);
+  assert(0 <= x && x < img->width && 0 <= y && y < img->height);
+  PIXMEM_ADD(1); // count one run access (read)
+  return img->level[rleFind(img, y, x)];
+}
+
+// Conversions split the rows among threads.
+struct rle_convert_job {
+  Image img;
+  RleImage rle;
+};
+
+// Count the runs of each row, into rle->row[y+1].
+static void rleCountTask(void *arg, long begin, long end) {
+  const struct rle_convert_job *job = arg;
+  const int w = job->img->width;
+  for (long y = begin; y < end; y++) {
+    const uint8 *p = &job->img->pixel[G(job->img, 0, (int)y)];
+    long n = 1;
+    for (int x = 1; x < w; x++)
+      n += p[x] != p[x - 1];
+    job->rle->row[y + 1] = n;
+  }
+}
+
+static void rleEncodeTask(void *arg, long begin, long end) {
+  const struct rle_convert_job *job = arg;
+  RleImage rle = job->rle;
+  const int w = job->img->width;
+  for (long y = begin; y < end; y++) {
+    const uint8 *p = &job->img->pixel[G(job->img, 0, (int)y)];
+    long i = rle->row[y];
+    for (int x = 1; x < w; x++) {
+      if (p[x] != p[x - 1]) {
+        rle->end[i] = x;
+        rle->level[i++] = p[x - 1];
+      }
+    }
+    rle->end[i] = w;
+    rle->level[i] = p[w - 1];
+  }
+}
+
+/// Encode an image.
+RleImage RleImageFromImage(Image img) { ///
+  assert(img != NULL);
+  const int w = img->width;
+  const int h = img->height;
+  RleImage rle = rleAlloc(w, h, img->maxval);
+  if (rle == NULL)
+    return NULL;
+  struct rle_convert_job job = {img, rle};
+  rle->row[0] = 0;
+  if (w == 0) {
+    for (int y = 1; y <= h; y++)
+      rle->row[y] = 0;
+  } else {
+    PoolParallelFor(h, parGrain(w), rleCountTask, &job);
+  }
+  for (int y = 0; y < h; y++) // runs per row -> offsets
+    rle->row[y + 1] += rle->row[y];
+  if (!rleReserve(rle, rle->row[h])) {
+    errsave = errno;
+    RleImageDestroy(&rle);
+    errno = errsave;
+    return NULL;
+  }
+  if (w > 0)
+    PoolParallelFor(h, parGrain(w), rleEncodeTask, &job);
+  PIXMEM_ADD(2 * (unsigned long)w * h);         // pixels read, twice
+  PIXMEM_ADD((unsigned long)rle->row[h]);       // runs written
+  return rle;
+}
+
+static void rleDecodeTask(void *arg, long begin, long end) {
+  const struct rle_convert_job *job = arg;
+  const RleImage rle = job->rle;
+  for (long y = begin; y < end; y++) {
+    uint8 *p = &job->img->pixel[G(job->img, 0, (int)y)];
+    int x = 0;
+    for (long i = rle->row[y]; i < rle->row[y + 1]; i++) {
+      memset(p + x, rle->level[i], (size_t)(rle->end[i] - x));
+      x = rle->end[i];
+    }
+  }
+}
+
+/// Decode an RLE image.
+Image RleImageToImage(RleImage img) { ///
+  assert(img != NULL);
+  Image out = imageCreateRaw(img->width, img->height, (uint8)img->maxval);
+  if (out == NULL || img->width == 0)
+    return out;
+  struct rle_convert_job job = {out, img};
+  fillPixels("RleImageToImage", out->pixel, img->width, img->height,
+             img->height, parGrain(img->width), rleDecodeTask, &job);
+  PIXMEM_ADD((unsigned long)img->row[img->height]);         // runs read
+  PIXMEM_ADD((unsigned long)img->width * img->height);      // pixels written
+  return out;
+}
+
+/// Get the minimum and maximum pixel levels, as in ImageStats.
+void RleImageStats(RleImage img, uint8 *min, uint8 *max) { ///
+  assert(img != NULL);
+  const long n = img->row[img->height];
+  if (n == 0) {
+    *min = *max = 0;
+    return;
+  }
+  uint8 mn = img->level[0];
+  uint8 mx = mn;
+  for (long i = 1; i < n; i++) {
+    if (img->level[i] < mn)
+      mn = img->level[i];
+    if (img->level[i] > mx)
+      mx = img->level[i];
+  }
+  *min = mn;
+  *max = mx;
+  PIXMEM_ADD((unsigned long)n);
+}
+
+/// Transform the RLE image to its negative, as in ImageNegative.
+void RleImageNegative(RleImage img) { ///
+  assert(img != NULL);
+  const long n = img->row[img->height];
+  for (long i = 0; i < n; i++)
+    img->level[i] = (uint8)(img->maxval - img->level[i]);
+  PIXMEM_ADD((unsigned long)n);
+}
+
+/// Apply threshold to the RLE image, as in ImageThreshold.
+void RleImageThreshold(RleImage img, uint8 thr) { ///
+  assert(img != NULL);
+  // Runs that become equal are merged, so rows shrink in place.
+  long n = 0;
+  long begin = img->row[0];
+  for (int y = 0; y < img->height; y++) {
+    const long end = img->row[y + 1];
+    img->row[y] = n;
+    for (long i = begin; i < end; i++)
+      rleEmit(img, img->row[y], &n, img->end[i],
+              img->level[i] < thr ? 0 : (uint8)img->maxval);
+    begin = end;
+  }
+  PIXMEM_ADD((unsigned long)begin + n); // runs read and written
+  img->row[img->height] = n;
+}
+
+/// Crop the rectangle with top left corner (x, y), width w and height h
+/// from img, into a new RLE image.
+/// Requires: the rectangle must be inside img.
+RleImage RleImageCrop(RleImage img, int x, int y, int w, int h) { ///
+  assert(img != NULL);
+  assert(0 <= x && w >= 0 && x + w <= img->width);
+  assert(0 <= y && h >= 0 && y + h <= img->height);
+  RleImage out = rleAlloc(w, h, (uint8)img->maxval);
+  if (out == NULL)
+    return NULL;
+  // Find the runs of each row that overlap the rectangle
+  out->row[0] = 0;
+  for (int r = 0; r < h; r++)
+    out->row[r + 1] = out->row[r] + (w > 0 ? rleFind(img, y + r, x + w - 1) -
+                                                 rleFind(img, y + r, x) + 1
+                                           : 0);
+  if (!rleReserve(out, out->row[h])) {
+    errsave = errno;
+    RleImageDestroy(&out);
+    errno = errsave;
+    return NULL;
+  }
+  for (int r = 0; r < h && w > 0; r++) {
+    long j = out->row[r];
+    for (long i = rleFind(img, y + r, x); j < out->row[r + 1]; i++, j++) {
+      const int end = img->end[i] < x + w ? img->end[i] : x + w;
+      out->end[j] = end - x;
+      out->level[j] = img->level[i];
+    }
+  }
+  PIXMEM_ADD(2 * (unsigned long)out->row[h]); // runs read and written
+  return out;
+}
+
+/// Paste RLE image img2 into position (x, y) of img1.
+/// This modifies img1 in-place, but may need to reallocate its runs.
+/// Requires: img2 must fit inside img1 at position (x, y).
+/// On success, returns nonzero.
+/// On failure, returns 0, errno/errCause are set appropriately, and
+/// img1 is left unchanged.
+int RleImagePaste(RleImage img1, int x, int y, RleImage img2) { ///
+  assert(img1 != NULL && img2 != NULL);
+  assert(0 <= x && x + img2->width <= img1->width);
+  assert(0 <= y && y + img2->height <= img1->height);
+  const int w = img2->width;
+  const int h = img2->height;
+  if (w == 0 || h == 0)
+    return 1;
+  // Each pasted row may split one run of img1 in two, so the result has at
+  // most one more run per row than both images together.
+  struct rleimage out = *img1;
+  out.end = NULL;
+  out.level = NULL;
+  const long n1 = img1->row[img1->height];
+  if (!rleReserve(&out, n1 + img2->row[h] + h)) {
+    free(out.end);
+    return 0;
+  }
+  // Rows above img2 keep their runs
+  const long top = img1->row[y];
+  memcpy(out.end, img1->end, (size_t)top * sizeof(int));
+  memcpy(out.level, img1->level, (size_t)top);
+  long n = top;
+  long begin = top;
+  for (int r = y; r < y + h; r++) {
+    const long end = img1->row[r + 1];
+    const long first = n;
+    img1->row[r] = n;
+    long i = begin;
+    for (; i < end && img1->end[i] <= x; i++) // left of img2
+      rleEmit(&out, first, &n, img1->end[i], img1->level[i]);
+    if ((n > first ? out.end[n - 1] : 0) < x) // run i starts before x
+      rleEmit(&out, first, &n, x, img1->level[i]);
+    for (long j = img2->row[r - y]; j < img2->row[r - y + 1]; j++)
+      rleEmit(&out, first, &n, x + img2->end[j], img2->level[j]);
+    for (; i < end && img1->end[i] <= x + w; i++) // under img2
+      ;
+    for (; i < end; i++) // right of img2
+      rleEmit(&out, first, &n, img1->end[i], img1->level[i]);
+    begin = end;
+  }
+  // Runs read and written in the rows of img2 (other rows are block copies)
+  PIXMEM_ADD((unsigned long)(begin - top) + img2->row[h] + (n - top));
+  // Rows below img2 keep their runs, which move by n-begin
+  memcpy(out.end + n, img1->end + begin, (size_t)(n1 - begin) * sizeof(int));
+  memcpy(out.level + n, img1->level + begin, (size_t)(n1 - begin));
+  for (int r = y + h; r <= img1->height; r++)
+    img1->row[r] += n - begin;
+  free(img1->end);
+  free(img1->level);
+  img1->end = out.end;
+  img1->level = out.level;
+  // Shrink the arrays (keeps the larger ones if this fails)
+  rleReserve(img1, img1->row[img1->height]);
+  return 1;
+}
+
+/// Tiled images
+
+// A TiledImage stores its pixels in TILE_SIZE x TILE_SIZE tiles, in rows of
+// tiles.  Each tile is a contiguous block in row order, so a tile is one
+// 4 KB page and each of its rows is one cache line.  Partial tiles at the
+// right and bottom edges are stored whole, and their extra pixels are
+// kept at 0.
+
+#define TILE_SHIFT 6
+#define TILE_SIZE (1 << TILE_SHIFT)
+#define TILE_PIXELS (TILE_SIZE * TILE_SIZE)
+
+struct tiledimage {
+  int width;
+  int height;
+  int maxval;
+  int tilesX;   // tiles per row of tiles
+  int tilesY;   // rows of tiles
+  uint8 *pixel; // tilesX*tilesY tiles
+};
+
+// Transform (x, y) coords into the index of the pixel in the tiles of img.
+// The rest of its row of the tile follows it.
+static inline size_t tileIndex(TiledImage img, int x, int y) {
+  const size_t tile = (size_t)(y >> TILE_SHIFT) * img->tilesX + (x >> TILE_SHIFT);
+  return tile * TILE_PIXELS + ((size_t)(y & (TILE_SIZE - 1)) << TILE_SHIFT) +
+         (x & (TILE_SIZE - 1));
+}
+
+// Copy n pixels of row y of img, from column x, to buf.
+static void tiledReadRow(TiledImage img, int x, int y, int n, uint8 *buf) {
+  while (n > 0) {
+    int len = TILE_SIZE - (x & (TILE_SIZE - 1)); // up to the end of the tile
+    if (len > n)
+      len = n;
+    memcpy(buf, &img->pixel[tileIndex(img, x, y)], (size_t)len);
+    buf += len;
+    x += len;
+    n -= len;
+  }
+}
+
+// Copy n pixels from buf to row y of img, from column x.
+static void tiledWriteRow(TiledImage img, int x, int y, int n, const uint8 *buf) {
+  while (n > 0) {
+    int len = TILE_SIZE - (x & (TILE_SIZE - 1)); // up to the end of the tile
+    if (len > n)
+      len = n;
+    memcpy(&img->pixel[tileIndex(img, x, y)], buf, (size_t)len);
+    buf += len;
+    x += len;
+    n -= len;
+  }
+}
+
+/// Create a new black tiled image.
+TiledImage TiledImageCreate(int width, int height, uint8 maxval) { ///
+  assert(width >= 0);
+  assert(height >= 0);
+  assert(0 < maxval && maxval <= PixMax);
+  const int tilesX = (int)(((long)width + TILE_SIZE - 1) >> TILE_SHIFT);
+  const int tilesY = (int)(((long)height + TILE_SIZE - 1) >> TILE_SHIFT);
+  TiledImage img = NULL;
+  int success =
+      check(pixelsFit(tilesX, tilesY, TILE_PIXELS), "Image too large") &&
+      check((img = (TiledImage)calloc(1, sizeof(struct tiledimage))) != NULL,
+            "Allocation failed") &&
+      check((img->pixel = (uint8 *)bufAlloc((size_t)tilesX * tilesY *
+                                            TILE_PIXELS)) != NULL,
+            "Allocation failed");
+  if (img != NULL) {
+    img->width = width;
+    img->height = height;
+    img->maxval = maxval;
+    img->tilesX = tilesX;
+    img->tilesY = tilesY;
+  }
+  if (!success) {
+    errsave = errno;
+    TiledImageDestroy(&img);
+    errno = errsave;
+  }
+  return img;
+}
+
+/// Destroy the tiled image pointed to by (*imgp).
+/// Ensures: (*imgp)==NULL.  Does nothing if (*imgp) is NULL.
+void TiledImageDestroy(TiledImage *imgp) { ///
+  assert(imgp != NULL);
+  if (*imgp != NULL) {
+    bufFree((*imgp)->pixel);
+    free(*imgp);
+    *imgp = NULL;
+  }
+}
+
+/// Get tiled image width
+int TiledImageWidth(TiledImage img) { ///
+  assert(img != NULL);
+  return img->width;
+}
+
+/// Get tiled image height
+int TiledImageHeight(TiledImage img) { ///
+  assert(img != NULL);
+  return img->height;
+}
+
+/// Get tiled image maxval
+int TiledImageMaxval(TiledImage img) { ///
+  assert(img != NULL);
+  return img->maxval;
+}
+
+/// Get the pixel level at position (x,y).
+uint8 TiledImageGetPixel(TiledImage img, int x, int y) { ///
+  assert(img != NULL);
+  assert(0 <= x && x < img->width && 0 <= y && y < img->height);
+  PIXMEM_ADD(1); // count one pixel access (read)
+  return img->pixel[tileIndex(img, x, y)];
+}
+
+/// Set the pixel at position (x,y) to level.
+void TiledImageSetPixel(TiledImage img, int x, int y, uint8 level) { ///
+  assert(img != NULL);
+  assert(0 <= x && x < img->width && 0 <= y && y < img->height);
+  PIXMEM_ADD(1); // count one pixel access (store)
+  img->pixel[tileIndex(img, x, y)] = level;
+}
+
+// Conversions split the rows of tiles among threads.
+struct tiled_convert_job {
+  Image img;
+  TiledImage tiled;
+};
+
+// Copy the rows of rows of tiles [begin, end) from job->img to job->tiled.
+static void tiledFromTask(void *arg, long begin, long end) {
+  const struct tiled_convert_job *job = arg;
+  const int w = job->img->width;
+  const int h = job->img->height;
+  for (long y = begin * TILE_SIZE; y < end * TILE_SIZE && y < h; y++)
+    tiledWriteRow(job->tiled, 0, (int)y, w, &job->img->pixel[(size_t)y * w]);
+}
+
+// Copy the rows of rows of tiles [begin, end) from job->tiled to job->img.
+static void tiledToTask(void *arg, long begin, long end) {
+  const struct tiled_convert_job *job = arg;
+  const int w = job->img->width;
+  const int h = job->img->height;
+  for (long y = begin * TILE_SIZE; y < end * TILE_SIZE && y < h; y++)
+    tiledReadRow(job->tiled, 0, (int)y, w, &job->img->pixel[(size_t)y * w]);
+}
+
+/// Convert an image to a tiled image.
+TiledImage TiledImageFromImage(Image img) { ///
+  assert(img != NULL);
+  TiledImage tiled = TiledImageCreate(img->width, img->height, img->maxval);
+  if (tiled == NULL)
+    return NULL;
+  struct tiled_convert_job job = {img, tiled};
+  PoolParallelFor(tiled->tilesY, parGrain((long)TILE_SIZE * img->width),
+                  tiledFromTask, &job);
+  PIXMEM_ADD(2 * (unsigned long)img->width * img->height); // count pixel memory accesses
+  return tiled;
+}
+
+/// Convert a tiled image to an image.
+Image TiledImageToImage(TiledImage img) { ///
+  assert(img != NULL);
+  Image out = imageCreateRaw(img->width, img->height, img->maxval);
+  if (out == NULL)
+    return NULL;
+  struct tiled_convert_job job = {out, img};
+  fillPixels("TiledImageToImage", out->pixel, img->width, img->height,
+             img->tilesY, parGrain((long)TILE_SIZE * img->width), tiledToTask,
+             &job);
+  PIXMEM_ADD(2 * (unsigned long)img->width * img->height); // count pixel memory accesses
+  return out;
+}
+
+/// Load a raw PGM file into a tiled image, as in ImageLoad.
+TiledImage TiledImageLoad(const char *filename) { ///
+  int w = 0, h = 0;
+  int maxval;
+  FILE *f = NULL;
+  TiledImage img = NULL;
+  uint8 *band = NULL;
+
+  int success =
+      check((f = fopen(filename, "rb")) != NULL, "Open failed") &&
+      readHeaderPGM(f, &w, &h, &maxval) &&
+      // Allocate image, and a buffer for a row of tiles of the file
+      (img = TiledImageCreate(w, h, (uint8)maxval)) != NULL &&
+      check((band = (uint8 *)malloc((size_t)w * TILE_SIZE + 1)) != NULL,
+            "Allocation failed");
+  // Read rows of tiles
+  for (int y0 = 0; success && y0 < h; y0 += TILE_SIZE) {
+    const int rows = h - y0 < TILE_SIZE ? h - y0 : TILE_SIZE;
+    const size_t n = (size_t)w * rows;
+    success = check(fread(band, 1, n, f) == n, "Reading pixels");
+    for (int y = 0; success && y < rows; y++)
+      tiledWriteRow(img, 0, y0 + y, w, &band[(size_t)y * w]);
+  }
+  if (img != NULL)
+    PIXMEM_ADD((unsigned long)w * h); // count pixel memory accesses
+
+  // Cleanup
+  errsave = errno;
+  free(band);
+  if (!success)
+    TiledImageDestroy(&img);
+  if (f != NULL)
+    fclose(f);
+  errno = errsave;
+  return img;
+}
+
+/// Save tiled image to a PGM file, as in ImageSave.
+/// On success, returns nonzero.
+/// On failure, returns 0, errno/errCause are set appropriately, and
+/// a partial and invalid file may be left in the system.
+int TiledImageSave(TiledImage img, const char *filename) { ///
+  assert(img != NULL);
+  const int w = img->width;
+  const int h = img->height;
+  FILE *f = NULL;
+  uint8 *band = NULL;
+
+  int success =
+      check((f = fopen(filename, "wb")) != NULL, "Open failed") &&
+      check(fprintf(f, "P5\n%d %d\n%u\n", w, h, (unsigned)img->maxval) > 0,
+            "Writing header failed") &&
+      check((band = (uint8 *)malloc((size_t)w * TILE_SIZE + 1)) != NULL,
+            "Allocation failed");
+  for (int y0 = 0; success && y0 < h; y0 += TILE_SIZE) {
+    const int rows = h - y0 < TILE_SIZE ? h - y0 : TILE_SIZE;
+    const size_t n = (size_t)w * rows;
+    for (int y = 0; y < rows; y++)
+      tiledReadRow(img, 0, y0 + y, w, &band[(size_t)y * w]);
+    success = check(fwrite(band, 1, n, f) == n, "Writing pixels failed");
+  }
+  PIXMEM_ADD((unsigned long)w * h); // count pixel memory accesses
+
+  // Cleanup
+  errsave = errno;
+  free(band);
+  if (f != NULL && fclose(f) != 0 && success)
+    success = check(0, "Writing pixels failed");
+  else
+    errno = errsave;
+  return success;
+}
+
+// Rotations and crops fill the tiles of the result in parallel.
+struct tiled_copy_job {
+  TiledImage img;
+  TiledImage out;
+  int x, y; // crop origin
+};
+
+// Rotate into tiles [begin, end) of job->out (in row order of tiles).
+// Each row of a tile of the result is a column of a single tile of img.
+static void tiledRotateTask(void *arg, long begin, long end) {
+  const struct tiled_copy_job *job = arg;
+  const TiledImage img = job->img;
+  const TiledImage out = job->out;
+  for (long t = begin; t < end; t++) {
+    const int x0 = (int)(t % out->tilesX) * TILE_SIZE;
+    const int y0 = (int)(t / out->tilesX) * TILE_SIZE;
+    const int cols = out->width - x0 < TILE_SIZE ? out->width - x0 : TILE_SIZE;
+    const int rows = out->height - y0 < TILE_SIZE ? out->height - y0 : TILE_SIZE;
+    uint8 *d = &out->pixel[tileIndex(out, x0, y0)];
+    for (int r = 0; r < rows; r++) {
+      // Row y0+r of out is column w-1-(y0+r) of img, read down from row x0
+      const uint8 *s = &img->pixel[tileIndex(img, img->width - 1 - (y0 + r), x0)];
+      for (int c = 0; c < cols; c++)
+        d[r * TILE_SIZE + c] = s[c * TILE_SIZE];
+    }
+  }
+}
+
+/// Rotate a tiled image 90 degrees anti-clockwise, as in ImageRotate.
+TiledImage TiledImageRotate(TiledImage img) { ///
+  assert(img != NULL);
+  TiledImage out = TiledImageCreate(img->height, img->width, img->maxval);
+  if (out == NULL)
+    return NULL;
+  struct tiled_copy_job job = {img, out, 0, 0};
+  PoolParallelFor((long)out->tilesX * out->tilesY, parGrain(TILE_PIXELS),
+                  tiledRotateTask, &job);
+  PIXMEM_ADD(2 * (unsigned long)img->width * img->height); // count pixel memory accesses
+  return out;
+}
+
+// Crop into tiles [begin, end) of job->out (in row order of tiles).
+// Each row of a tile of the result comes from at most two tiles of img.
+static void tiledCropTask(void *arg, long begin, long end) {
+  const struct tiled_copy_job *job = arg;
+  const TiledImage out = job->out;
+  for (long t = begin; t < end; t++) {
+    const int x0 = (int)(t % out->tilesX) * TILE_SIZE;
+    const int y0 = (int)(t / out->tilesX) * TILE_SIZE;
+    const int cols = out->width - x0 < TILE_SIZE ? out->width - x0 : TILE_SIZE;
+    const int rows = out->height - y0 < TILE_SIZE ? out->height - y0 : TILE_SIZE;
+    uint8 *d = &out->pixel[tileIndex(out, x0, y0)];
+    if (((job->x | job->y) & (TILE_SIZE - 1)) == 0 && rows == TILE_SIZE &&
+        cols == TILE_SIZE) { // aligned whole tile
+      memcpy(d, &job->img->pixel[tileIndex(job->img, job->x + x0, job->y + y0)],
+             TILE_PIXELS);
+      continue;
+    }
+    for (int r = 0; r < rows; r++)
+      tiledReadRow(job->img, job->x + x0, job->y + y0 + r, cols,
+                   &d[r * TILE_SIZE]);
+  }
+}
+
+/// Crop the rectangle with top left corner (x, y), width w and height h
+/// from img, into a new tiled image.
+/// Requires: the rectangle must be inside img.
+TiledImage TiledImageCrop(TiledImage img, int x, int y, int w, int h) { ///
+  assert(img != NULL);
+  assert(0 <= x && 0 <= w && x <= img->width - w);
+  assert(0 <= y && 0 <= h && y <= img->height - h);
+  TiledImage out = TiledImageCreate(w, h, img->maxval);
+  if (out == NULL)
+    return NULL;
+  struct tiled_copy_job job = {img, out, x, y};
+  PoolParallelFor((long)out->tilesX * out->tilesY, parGrain(TILE_PIXELS),
+                  tiledCropTask, &job);
+  PIXMEM_ADD(2 * (unsigned long)w * h); // count pixel memory accesses
+  return out;
+}
+
+// TiledImageBlur slides the window down strips of TILE_SIZE columns.  It
+// keeps the sums of the columns of the window (and of dx columns on each
+// side of the strip), adding the row that enters the window and
+// subtracting the row that leaves it; each output row is then a sliding
+// sum along those column sums.  All rows read are contiguous within their
+// tiles.  Strips are split in bands of TILE_BAND rows, which run in
+// parallel and write to a new array of tiles.  Edges are clamped and
+// results rounded as in ImageBlur, so the results are the same.
+
+#define TILE_BAND (8 * TILE_SIZE)
+
+struct tiled_blur_job {
+  TiledImage img;
+  uint8 *pixel;     // tiles of the result
+  int dx, dy;
+  int nbands;       // bands per strip
+  uint8 *scratch;   // scratch buffers, one per worker
+  size_t scratchsz; // size of the scratch buffers of each worker
+};
+
+// Copy n pixels of row y of img from column x to buf, clamping the row
+// and the columns to the image.  Requires: x < width and x + n > 0.
+static void tiledReadClamped(TiledImage img, int x, int y, int n, uint8 *buf) {
+  const int w = img->width;
+  const int a = x < 0 ? 0 : x;
+  const int b = x + n < w ? x + n : w;
+  y = clampIndex(y, img->height);
+  memset(buf, img->pixel[tileIndex(img, 0, y)], (size_t)(a - x));
+  tiledReadRow(img, a, y, b - a, buf + (a - x));
+  memset(buf + (b - x), img->pixel[tileIndex(img, w - 1, y)], (size_t)(x + n - b));
+}
+
+// Blur bands [begin, end), numbered by strip and then by band.
+// Uses the column sums (n uint32_t) and 2 rows of n pixels of scratch, with
+// n = TILE_SIZE + 2dx.  As in ImageBlur, the sums are exact, as the window
+// has less than 2^24 pixels.
+static void tiledBlurTask(void *arg, long begin, long end) {
+  const struct tiled_blur_job *job = arg;
+  const TiledImage img = job->img;
+  const int dx = job->dx;
+  const int dy = job->dy;
+  const int n = TILE_SIZE + 2 * dx;
+  const int area = (2 * dx + 1) * (2 * dy + 1);
+  uint32_t *colsum = (uint32_t *)&job->scratch[(size_t)PoolWorkerId() * job->scratchsz];
+  uint8 *enter = (uint8 *)(colsum + n);
+  uint8 *leave = enter + n;
+  unsigned long count = 0;
+  for (long t = begin; t < end; t++) {
+    const int x0 = (int)(t / job->nbands) * TILE_SIZE;
+    const int y0 = (int)(t % job->nbands) * TILE_BAND;
+    const int y1 = img->height - y0 < TILE_BAND ? img->height : y0 + TILE_BAND;
+    const int sw = img->width - x0 < TILE_SIZE ? img->width - x0 : TILE_SIZE;
+    // Column sums of the window of row y0
+    memset(colsum, 0, (size_t)n * sizeof(uint32_t));
+    for (int j = y0 - dy; j <= y0 + dy; j++) {
+      tiledReadClamped(img, x0 - dx, j, n, enter);
+      for (int i = 0; i < n; i++)
+        colsum[i] += enter[i];
+    }
+    count += (unsigned long)(2 * dy + 1) * n;
+    for (int y = y0; y < y1; y++) {
+      uint8 *dst = &job->pixel[tileIndex(img, x0, y)];
+      uint32_t sum = 0;
+      for (int i = 0; i < 2 * dx; i++)
+        sum += colsum[i];
+      for (int x = 0; x < sw; x++) {
+        sum += colsum[x + 2 * dx];
+        dst[x] = (uint8)((sum + (area >> 1)) / (uint32_t)area);
+        sum -= colsum[x];
+      }
+      if (y + 1 < y1) { // move the window down one row
+        tiledReadClamped(img, x0 - dx, y - dy, n, leave);
+        tiledReadClamped(img, x0 - dx, y + dy + 1, n, enter);
+        for (int i = 0; i < n; i++)
+          colsum[i] += enter[i] - leave[i];
+        count += 2 * (unsigned long)n;
+      }
+    }
+    count += (unsigned long)sw * (y1 - y0);
+  }
+  pixmemAdd(count);
+}
+
+/// Blur a tiled image with a (2dx+1)x(2dy+1) mean filter, with the same
+/// results as ImageBlur.
+/// Requires: dx, dy >= 0.
+/// The image is changed in-place.
+/// On success, returns nonzero.
+/// On failure, returns 0, errno/errCause are set appropriately,
+/// and the image is not modified.  Fails if (2dx+1)*(2dy+1) >= 2^24.
+int TiledImageBlur(TiledImage img, int dx, int dy) { ///
+  assert(img != NULL);
+  assert(dx >= 0 && dy >= 0);
+  if (!check(blurAreaFits(dx, dy), "Blur window too large"))
+    return 0;
+  if (img->width == 0 || img->height == 0)
+    return 1;
+  const int nbands = (img->height + TILE_BAND - 1) / TILE_BAND;
+  const long nitems = (long)img->tilesX * nbands;
+  const long grain = parGrain((long)TILE_SIZE * TILE_BAND);
+  const int nthreads = PoolJobThreads(nitems, grain);
+  struct tiled_blur_job job = {img, NULL, dx, dy, nbands, NULL,
+                               (TILE_SIZE + 2 * (size_t)dx) * (sizeof(uint32_t) + 2)};
+  int success =
+      check((job.pixel = (uint8 *)bufAlloc((size_t)img->tilesX * img->tilesY *
+                                           TILE_PIXELS)) != NULL,
+            "Allocation failed") &&
+      check((job.scratch = (uint8 *)malloc((size_t)nthreads * job.scratchsz)) !=
+                NULL,
+            "Allocation failed");
+  if (success) {
+    InstrSpan span;
+    InstrSpanBegin(&span, "tiled blur");
+    PoolParallelFor(nitems, grain, tiledBlurTask, &job);
+    InstrSpanArg(&span, "bands", nitems);
+    InstrSpanEnd(&span);
+    bufFree(img->pixel); // the result replaces the pixels
+    img->pixel = job.pixel;
+    job.pixel = NULL;
+  }
+  bufFree(job.pixel);
+  free(job.scratch);
+  return success;
+}
+
+/// Image comparison
+
+// Bytes compared by each memcmp in ImageEqual, between early-out checks.
+#define EQUAL_BLOCK 65536
+
+/// Check whether two images are equal: same size, maxval and pixels.
+/// Stops at the first block of pixels that differs.
+int ImageEqual(Image img1, Image img2) { ///
+  assert(img1 != NULL && img2 != NULL);
+  if (img1->width != img2->width || img1->height != img2->height ||
+      img1->maxval != img2->maxval)
+    return 0;
+  const size_t size = (size_t)img1->width * img1->height;
+  size_t done = 0;
+  int equal = 1;
+  while (equal && done < size) {
+    size_t n = size - done < EQUAL_BLOCK ? size - done : EQUAL_BLOCK;
+    equal = memcmp(img1->pixel + done, img2->pixel + done, n) == 0;
+    done += n;
+  }
+  PIXMEM_ADD(2 * (unsigned long)done); // pixels of both images read
+  return equal;
+}
+
+// Differences are computed by chunks of rows in parallel.
+struct diff_chunk {
+  long count;     // differing pixels
+  int x0, y0;     // bounding box of differing pixels
+  int x1, y1;     // (exclusive end; x1==0 if there are none)
+};
+
+struct diff_job {
+  Image img1;
+  Image img2;
+  Image out;
+  long grain;
+  struct diff_chunk *chunk;
+};
+
+static void diffTask(void *arg, long begin, long end) {
+  const struct diff_job *job = arg;
+  struct diff_chunk *c = &job->chunk[begin / job->grain];
+  const int w = job->out->width;
+  c->count = 0;
+  c->x0 = w;
+  c->y0 = (int)begin;
+  c->x1 = c->y1 = 0;
+  for (long y = begin; y < end; y++) {
+    const uint8 *p1 = &job->img1->pixel[G(job->img1, 0, (int)y)];
+    const uint8 *p2 = &job->img2->pixel[G(job->img2, 0, (int)y)];
+    uint8 *d = &job->out->pixel[G(job->out, 0, (int)y)];
+    int n = 0;
+    for (int x = 0; x < w; x++) {
+      d[x] = p1[x] > p2[x] ? p1[x] - p2[x] : p2[x] - p1[x];
+      n += d[x] != 0;
+    }
+    if (n == 0)
+      continue;
+    int x0 = 0;
+    while (d[x0] == 0)
+      x0++;
+    int x1 = w;
+    while (d[x1 - 1] == 0)
+      x1--;
+    if (c->count == 0)
+      c->y0 = (int)y;
+    c->count += n;
+    c->x0 = x0 < c->x0 ? x0 : c->x0;
+    c->x1 = x1 > c->x1 ? x1 : c->x1;
+    c->y1 = (int)y + 1;
+  }
+  pixmemAdd(3 * (unsigned long)w * (end - begin)); // read 2, write 1
+}
+
+/// Create an image with the absolute difference of img1 and img2 at each
+/// pixel, with the larger of their maxvals.
+/// Sets (*pcount) to the number of differing pixels, and (*px, *py, *pw,
+/// *ph) to their bounding box (all 0 if there are none).
+/// Requires: img1 and img2 must have the same size.
+/// On failure, returns NULL and errno/errCause are set appropriately.
+Image ImageDiff(Image img1, Image img2, long *pcount,
+                int *px, int *py, int *pw, int *ph) { ///
+  assert(img1 != NULL && img2 != NULL);
+  assert(img1->width == img2->width && img1->height == img2->height);
+  assert(pcount != NULL && px != NULL && py != NULL && pw != NULL &&
+         ph != NULL);
+  const int w = img1->width;
+  const int h = img1->height;
+  Image out = imageCreateRaw(w, h, img1->maxval > img2->maxval ? img1->maxval
+                                                                : img2->maxval);
+  if (out == NULL)
+    return NULL;
+
+  struct diff_chunk one;
+  struct diff_job job = {img1, img2, out, parGrain(w), &one};
+  long nchunks = (h + job.grain - 1) / job.grain;
+  if (nchunks > 1 &&
+      (job.chunk = (struct diff_chunk *)malloc(
+           (size_t)nchunks * sizeof(struct diff_chunk))) == NULL) {
+    job.chunk = &one; // no memory: use a single chunk
+    job.grain = h;
+    nchunks = 1;
+  }
+  if (w > 0)
+    fillPixels("ImageDiff", out->pixel, w, h, h, job.grain, diffTask, &job);
+  else
+    nchunks = 0;
+
+  long count = 0;
+  int x0 = w, y0 = h, x1 = 0, y1 = 0;
+  for (long i = 0; i < nchunks; i++) {
+    const struct diff_chunk *c = &job.chunk[i];
+    if (c->count == 0)
+      continue;
+    count += c->count;
+    x0 = c->x0 < x0 ? c->x0 : x0;
+    y0 = c->y0 < y0 ? c->y0 : y0;
+    x1 = c->x1 > x1 ? c->x1 : x1;
+    y1 = c->y1 > y1 ? c->y1 : y1;
+  }
+  if (job.chunk != &one)
+    free(job.chunk);
+  *pcount = count;
+  *px = count > 0 ? x0 : 0;
+  *py = count > 0 ? y0 : 0;
+  *pw = count > 0 ? x1 - x0 : 0;
+  *ph = count > 0 ? y1 - y0 : 0;
+  return out;
+}
+
+// SSIM windows are SSIM_WIN pixels square (or the whole image, if smaller),
+// spaced SSIM_STEP pixels apart.  For each row of windows, the sums over
+// their rows are accumulated per column (a loop the compiler vectorizes),
+// SSIM_SEG columns at a time, and then added up for each window.
+// Each row of windows also adds up the squared errors of the pixel rows
+// from its top to the next row of windows, so one pass computes both.
+#define SSIM_WIN 8
+#define SSIM_STEP 4
+#define SSIM_SEG 512
+
+struct quality_chunk {
+  uint64_t sse; // sum of squared errors
+  double ssim;  // sum of window SSIMs
+};
+
+struct quality_job {
+  Image img1;
+  Image img2;
+  int ww, wh;   // window size
+  long ny;      // rows of windows
+  int ssim;     // compute SSIM
+  double c1, c2;
+  long grain;
+  struct quality_chunk *chunk;
+};
+
+static void qualityTask(void *arg, long begin, long end) {
+  const struct quality_job *job = arg;
+  struct quality_chunk *c = &job->chunk[begin / job->grain];
+  const Image img1 = job->img1;
+  const Image img2 = job->img2;
+  const int w = img1->width;
+  const int ww = job->ww;
+  const double n = (double)ww * job->wh;
+  uint32_t s1[SSIM_SEG + SSIM_WIN], s2[SSIM_SEG + SSIM_WIN];
+  uint32_t s11[SSIM_SEG + SSIM_WIN], s22[SSIM_SEG + SSIM_WIN];
+  uint32_t s12[SSIM_SEG + SSIM_WIN];
+  unsigned long count = 0;
+  c->sse = 0;
+  c->ssim = 0.0;
+  for (long j = begin; j < end; j++) {
+    const int top = (int)j * SSIM_STEP;
+    // Squared errors of the rows down to the next row of windows
+    const int bottom = j + 1 < job->ny ? top + SSIM_STEP : img1->height;
+    for (int y = top; y < bottom; y++) {
+      const uint8 *p1 = &img1->pixel[G(img1, 0, y)];
+      const uint8 *p2 = &img2->pixel[G(img2, 0, y)];
+      uint64_t sse = 0;
+      for (int x = 0; x < w; x++) {
+        const int d = p1[x] - p2[x];
+        sse += (uint32_t)(d * d);
+      }
+      c->sse += sse;
+    }
+    count += 2 * (unsigned long)w * (bottom - top);
+    if (!job->ssim)
+      continue;
+    // SSIM of the windows of this row, by segments of columns
+    for (int x0 = 0; x0 + ww <= w; x0 += SSIM_SEG) {
+      const int ncols = (x0 + SSIM_SEG - SSIM_STEP + ww < w
+                             ? x0 + SSIM_SEG - SSIM_STEP + ww
+                             : w) - x0;
+      memset(s1, 0, sizeof(s1));
+      memset(s2, 0, sizeof(s2));
+      memset(s11, 0, sizeof(s11));
+      memset(s22, 0, sizeof(s22));
+      memset(s12, 0, sizeof(s12));
+      for (int y = top; y < top + job->wh; y++) {
+        const uint8 *p1 = &img1->pixel[G(img1, x0, y)];
+        const uint8 *p2 = &img2->pixel[G(img2, x0, y)];
+        for (int x = 0; x < ncols; x++) {
+          const uint32_t a = p1[x], b = p2[x];
+          s1[x] += a;
+          s2[x] += b;
+          s11[x] += a * a;
+          s22[x] += b * b;
+          s12[x] += a * b;
+        }
+      }
+      count += 2 * (unsigned long)ncols * job->wh;
+      for (int x = 0; x < SSIM_SEG && x0 + x + ww <= w; x += SSIM_STEP) {
+        uint64_t t1 = 0, t2 = 0, t11 = 0, t22 = 0, t12 = 0;
+        for (int k = x; k < x + ww; k++) {
+          t1 += s1[k];
+          t2 += s2[k];
+          t11 += s11[k];
+          t22 += s22[k];
+          t12 += s12[k];
+        }
+        const double mu1 = t1 / n, mu2 = t2 / n;
+        const double var1 = t11 / n - mu1 * mu1;
+        const double var2 = t22 / n - mu2 * mu2;
+        const double cov = t12 / n - mu1 * mu2;
+        c->ssim += (2.0 * mu1 * mu2 + job->c1) * (2.0 * cov + job->c2) /
+                   ((mu1 * mu1 + mu2 * mu2 + job->c1) *
+                    (var1 + var2 + job->c2));
+      }
+    }
+  }
+  pixmemAdd(count);
+}
+
+/// Compute the quality of img2 relative to the reference img1, in a
+/// single pass: sets (*psnr) to the peak signal-to-noise ratio, in dB
+/// (INFINITY if the images are equal), and (*ssim) to the mean structural
+/// similarity index of 8x8 windows, spaced 4 pixels apart.  The peak is
+/// the maxval of img1.  Either pointer may be NULL, to skip that metric.
+/// Requires: img1 and img2 must have the same size.
+void ImageQuality(Image img1, Image img2, double *psnr, double *ssim) { ///
+  assert(img1 != NULL && img2 != NULL);
+  assert(img1->width == img2->width && img1->height == img2->height);
+  const int w = img1->width;
+  const int h = img1->height;
+  if (w == 0 || h == 0) { // empty images are equal
+    if (psnr != NULL)
+      *psnr = INFINITY;
+    if (ssim != NULL)
+      *ssim = 1.0;
+    return;
+  }
+  const double peak = img1->maxval;
+  struct quality_chunk one;
+  struct quality_job job;
+  job.img1 = img1;
+  job.img2 = img2;
+  job.ww = w < SSIM_WIN ? w : SSIM_WIN;
+  job.wh = h < SSIM_WIN ? h : SSIM_WIN;
+  job.ny = (h - job.wh) / SSIM_STEP + 1;
+  job.ssim = ssim != NULL;
+  job.c1 = (0.01 * peak) * (0.01 * peak);
+  job.c2 = (0.03 * peak) * (0.03 * peak);
+  // The grain only depends on the size, so sums are the same for any
+  // number of threads.
+  job.grain = parGrain((long)w * SSIM_STEP);
+  job.chunk = &one;
+  long nchunks = (job.ny + job.grain - 1) / job.grain;
+  if (nchunks > 1 &&
+      (job.chunk = (struct quality_chunk *)malloc(
+           (size_t)nchunks * sizeof(struct quality_chunk))) == NULL) {
+    job.chunk = &one; // no memory: use a single chunk
+    job.grain = job.ny;
+    nchunks = 1;
+  }
+  PoolParallelFor(job.ny, job.grain, qualityTask, &job);
+
+  uint64_t sse = 0;
+  double sum = 0.0;
+  for (long i = 0; i < nchunks; i++) {
+    sse += job.chunk[i].sse;
+    sum += job.chunk[i].ssim;
+  }
+  if (job.chunk != &one)
+    free(job.chunk);
+  if (psnr != NULL)
+    *psnr = sse == 0 ? INFINITY
+                     : 10.0 * log10(peak * peak * w * h / (double)sse);
+  if (ssim != NULL)
+    *ssim = sum / ((double)job.ny * ((w - job.ww) / SSIM_STEP + 1));
+}
+
+/// Peak signal-to-noise ratio of img2 relative to img1 (see ImageQuality).
+double ImagePSNR(Image img1, Image img2) { ///
+  double psnr;
+  ImageQuality(img1, img2, &psnr, NULL);
+  return psnr;
+}
+
+/// Mean structural similarity of img2 and img1 (see ImageQuality).
+double ImageSSIM(Image img1, Image img2) { ///
+  double ssim;
+  ImageQuality(img1, img2, NULL, &ssim);
+  return ssim;
+}
+
+// ImageHash computes XXH64 (of the xxHash family): four independent lanes
+// of multiply-rotate rounds over 32-byte stripes, which run at several bytes
+// per cycle.  The pixels are hashed in blocks of HASH_BLOCK bytes in
+// parallel, and the block hashes are combined in order with the hash of the
+// size and maxval, so the result does not depend on the number of threads.
+// Words are read in host byte order (as XXH64 on little-endian machines).
+#define XXH_P1 0x9E3779B185EBCA87ull
+#define XXH_P2 0xC2B2AE3D27D4EB4Full
+#define XXH_P3 0x165667B19E3779F9ull
+#define XXH_P4 0x85EBCA77C2B2AE63ull
+#define XXH_P5 0x27D4EB2F165667C5ull
+#define HASH_BLOCK (1L << 20)
+
+static inline uint64_t rotl64(uint64_t x, int r) {
+  return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t read64(const uint8 *p) {
+  uint64_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+static inline uint64_t xxhRound(uint64_t acc, uint64_t input) {
+  acc += input * XXH_P2;
+  return rotl64(acc, 31) * XXH_P1;
+}
+
+static inline uint64_t xxhMerge(uint64_t acc, uint64_t v) {
+  acc ^= xxhRound(0, v);
+  return acc * XXH_P1 + XXH_P4;
+}
+
+// Add 8 bytes to the final XXH64 state h.
+static inline uint64_t xxhTail64(uint64_t h, uint64_t v) {
+  h ^= xxhRound(0, v);
+  return rotl64(h, 27) * XXH_P1 + XXH_P4;
+}
+
+static inline uint64_t xxhAvalanche(uint64_t h) {
+  h ^= h >> 33;
+  h *= XXH_P2;
+  h ^= h >> 29;
+  h *= XXH_P3;
+  return h ^ (h >> 32);
+}
+
+// XXH64 of the len bytes at p, with seed.
+static uint64_t xxh64(const uint8 *p, size_t len, uint64_t seed) {
+  const uint8 *const end = p + len;
+  uint64_t h;
+  if (len >= 32) {
+    uint64_t v1 = seed + XXH_P1 + XXH_P2;
+    uint64_t v2 = seed + XXH_P2;
+    uint64_t v3 = seed;
+    uint64_t v4 = seed - XXH_P1;
+    do {
+      v1 = xxhRound(v1, read64(p));
+      v2 = xxhRound(v2, read64(p + 8));
+      v3 = xxhRound(v3, read64(p + 16));
+      v4 = xxhRound(v4, read64(p + 24));
+      p += 32;
+    } while (end - p >= 32);
+    h = rotl64(v1, 1) + rotl64(v2, 7) + rotl64(v3, 12) + rotl64(v4, 18);
+    h = xxhMerge(h, v1);
+    h = xxhMerge(h, v2);
+    h = xxhMerge(h, v3);
+    h = xxhMerge(h, v4);
+  } else {
+    h = seed + XXH_P5;
+  }
+  h += len;
+  for (; end - p >= 8; p += 8)
+    h = xxhTail64(h, read64(p));
+  if (end - p >= 4) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    h ^= v * XXH_P1;
+    h = rotl64(h, 23) * XXH_P2 + XXH_P3;
+    p += 4;
+  }
+  for (; p < end; p++) {
+    h ^= *p * XXH_P5;
+    h = rotl64(h, 11) * XXH_P1;
+  }
+  return xxhAvalanche(h);
+}
+
+// Hash of block b of the size pixels of img.
+static uint64_t pixelBlockHash(Image img, size_t size, long b) {
+  const size_t off = (size_t)b * HASH_BLOCK;
+  const size_t len = size - off < HASH_BLOCK ? size - off : HASH_BLOCK;
+  return xxh64(img->pixel + off, len, (uint64_t)b);
+}
+
+struct hash_job {
+  Image img;
+  size_t size;     // pixels
+  uint64_t *block; // hash of each block
+};
+
+static void hashTask(void *arg, long begin, long end) {
+  const struct hash_job *job = arg;
+  for (long b = begin; b < end; b++)
+    job->block[b] = pixelBlockHash(job->img, job->size, b);
+  const size_t last = (size_t)end * HASH_BLOCK;
+  pixmemAdd((unsigned long)((last < job->size ? last : job->size) -
+                            (size_t)begin * HASH_BLOCK));
+}
+
+/// 64-bit content hash of the size, maxval and pixels of img.
+/// Equal images have equal hashes, and different images almost surely
+/// have different hashes.  Blocks of pixels are hashed in parallel.
+uint64_t ImageHash(Image img) { ///
+  assert(img != NULL);
+  const size_t size = (size_t)img->width * img->height;
+  const uint64_t head[3] = {(uint64_t)img->width, (uint64_t)img->height,
+                            (uint64_t)img->maxval};
+  uint64_t h = xxh64((const uint8 *)head, sizeof(head), 0);
+  const long nblocks = (long)((size + HASH_BLOCK - 1) / HASH_BLOCK);
+  struct hash_job job = {img, size, NULL};
+  if (nblocks > 1 &&
+      (job.block = (uint64_t *)malloc((size_t)nblocks * sizeof(uint64_t))) !=
+          NULL) {
+    PoolParallelFor(nblocks, 1, hashTask, &job);
+    for (long b = 0; b < nblocks; b++)
+      h = xxhTail64(h, job.block[b]);
+    free(job.block);
+  } else { // a single block, or no memory: hash in this thread
+    for (long b = 0; b < nblocks; b++)
+      h = xxhTail64(h, pixelBlockHash(img, size, b));
+    PIXMEM_ADD((unsigned long)size);
+  }
+  return xxhAvalanche(h);
+}
 
 
 // 3ª Abordagem - Sem Clamping
@@ -13,6 +13,7 @@
 #define IMAGE8BIT_H
 
 #include <inttypes.h>
+#include <stddef.h>
 
 // Type for pixel levels
 typedef uint8_t uint8;
@@ -23,6 +24,62 @@ extern const uint8 PixMax;
 // Type Image is a pointer to image objects
 typedef struct image *Image;
 
+// Border handling modes for filters:
+//   IMAGE_BORDER_CLAMP:  pixels outside take the value of the nearest edge
+//                        pixel (as in ImageBlur);
+//   IMAGE_BORDER_MIRROR: the image is reflected at its edges (...cba|abc...);
+//   IMAGE_BORDER_ZERO:   pixels outside are black (0).
+typedef enum {
+  IMAGE_BORDER_CLAMP,
+  IMAGE_BORDER_MIRROR,
+  IMAGE_BORDER_ZERO,
+} ImageBorder;
+
+// Resampling modes for ImageResize:
+//   IMAGE_RESIZE_AREA:     mean of the source area covered by each pixel;
+//   IMAGE_RESIZE_BILINEAR: bilinear interpolation of the nearest pixels.
+typedef enum {
+  IMAGE_RESIZE_AREA,
+  IMAGE_RESIZE_BILINEAR,
+} ImageResizeMode;
+
+// Interpolation modes for resampling:
+//   IMAGE_INTERP_NEAREST:  take the nearest pixel;
+//   IMAGE_INTERP_BILINEAR: interpolate the 2x2 nearest pixels.
+typedef enum {
+  IMAGE_INTERP_NEAREST,
+  IMAGE_INTERP_BILINEAR,
+} ImageInterp;
+
+// Allocation modes for large buffers (see ImageSetAlloc):
+//   IMAGE_ALLOC_MALLOC:        ordinary calloc (the default);
+//   IMAGE_ALLOC_HUGE:          mmap, with transparent huge pages requested;
+//   IMAGE_ALLOC_HUGE_POPULATE: as IMAGE_ALLOC_HUGE, and pre-fault the pages.
+typedef enum {
+  IMAGE_ALLOC_MALLOC,
+  IMAGE_ALLOC_HUGE,
+  IMAGE_ALLOC_HUGE_POPULATE,
+} ImageAllocMode;
+
+// Type SubImageIndex is a pointer to subimage search index objects
+typedef struct subimage_index *SubImageIndex;
+
+// Type BitImage is a pointer to binary (1 bit per pixel) image objects
+typedef struct bitimage *BitImage;
+
+// Type RleImage is a pointer to run-length encoded image objects
+typedef struct rleimage *RleImage;
+
+// Type TiledImage is a pointer to image objects stored in square tiles
+typedef struct tiledimage *TiledImage;
+
+// A connected component of an image (see ImageLabelComponents)
+typedef struct {
+  long area;       // number of pixels
+  int x, y, w, h;  // bounding box (top left corner, width and height)
+  double cx, cy;   // centroid (mean x and y of its pixels)
+} ImageComponent;
+
 /// Error handling functions
 
 /// Error cause.
@@ -36,9 +93,29 @@ typedef struct image *Image;
 char* ImageErrMsg() ;
 
 /// Init Image library.  (Call once!)
-/// Currently, simply calibrate instrumentation and set names of counters.
+/// Set names of instrumentation counters, and set up the thread pool
+/// (see ImageSetThreads).  Instrumentation is calibrated only when needed
+/// (see InstrGetCTU).
+/// The counters are only named (and counted) in builds with IMAGE_INSTR.
 void ImageInit(void) ;
 
+/// Set the number of threads used by image operations.
+/// If nthreads <= 0, use the value of environment variable IMAGE_THREADS,
+/// or else the number of online CPUs (this is the default).
+void ImageSetThreads(int nthreads) ;
+
+/// Get the number of threads used by image operations.
+int ImageThreads(void) ;
+
+/// Set how pixel arrays and other large buffers are allocated.
+/// Buffers of at least threshold bytes are allocated according to mode;
+/// smaller ones always use calloc.
+/// Huge pages reduce TLB misses and page faults on large images.
+/// In builds with IMAGE_INSTR, the "hugemem" instrumentation counter
+/// reports how many bytes of the buffers in use are backed by huge pages,
+/// when the counters are printed.
+void ImageSetAlloc(ImageAllocMode mode, size_t threshold) ;
+
 /// Image management functions
 
 /// Create a new black image.
@@ -135,6 +212,14 @@ void ImageThreshold(Image img, uint8 thr) ;
 /// darken the image if factor<1.0.
 void ImageBrighten(Image img, double factor) ;
 
+/// Rectangle variants.
+/// These apply the transformation above only to the pixels inside the
+/// rectangle with top left corner (x, y), width w and height h.
+/// Requires: the rectangle must be inside img.
+void ImageNegativeRect(Image img, int x, int y, int w, int h) ;
+void ImageThresholdRect(Image img, int x, int y, int w, int h, uint8 thr) ;
+void ImageBrightenRect(Image img, int x, int y, int w, int h, double factor) ;
+
 /// Geometric transformations
 
 /// These functions apply geometric transformations to an image,
@@ -155,6 +240,22 @@ void ImageBrighten(Image img, double factor) ;
 /// On failure, returns NULL and errno/errCause are set accordingly.
 Image ImageRotate(Image img) ;
 
+/// Rotate an image by an arbitrary angle.
+/// Returns a version of img rotated by the given angle, in degrees,
+/// anti-clockwise (negative angles rotate clockwise).
+/// The result is just large enough to contain the whole rotated image;
+/// its pixels not covered by img are set to fill.
+/// Pixels are sampled with nearest-neighbor or bilinear interpolation.
+/// Multiples of 90 degrees are exact and as fast as ImageRotate.
+/// Requires: fill <= maxval of img.
+/// Ensures: The original img is not modified.
+///
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageRotateAngle(Image img, double degrees, ImageInterp interp,
+                       uint8 fill) ;
+
 /// Mirror an image = flip left-right.
 /// Returns a mirrored version of the image.
 /// Ensures: The original img is not modified.
@@ -164,6 +265,15 @@ Image ImageRotate(Image img) ;
 /// On failure, returns NULL and errno/errCause are set accordingly.
 Image ImageMirror(Image img) ;
 
+/// Copy an image.
+/// Returns a new image with the same size, maxval and pixels as img.
+/// Ensures: The original img is not modified.
+///
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageCopy(Image img) ;
+
 /// Crop a rectangular subimage from img.
 /// The rectangle is specified by the top left corner coords (x, y) and
 /// width w and height h.
@@ -178,6 +288,20 @@ Image ImageMirror(Image img) ;
 /// On failure, returns NULL and errno/errCause are set accordingly.
 Image ImageCrop(Image img, int x, int y, int w, int h) ;
 
+/// Resize an image.
+/// Returns a version of img scaled to w x h pixels.
+/// With IMAGE_RESIZE_AREA, each output pixel is the (rounded) mean of the
+/// source area it covers, computed exactly: best for shrinking.
+/// With IMAGE_RESIZE_BILINEAR, each output pixel is interpolated from the
+/// 2x2 nearest source pixels: best for enlarging.
+/// Requires: w, h > 0, and img is not empty.
+/// Ensures: The original img is not modified.
+///
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageResize(Image img, int w, int h, ImageResizeMode mode) ;
+
 /// Operations on two images
 
 /// Paste an image into a larger image.
@@ -194,6 +318,26 @@ void ImagePaste(Image img1, int x, int y, Image img2) ;
 /// may provide interesting effects.  Over/underflows should saturate.
 void ImageBlend(Image img1, int x, int y, Image img2, double alpha) ;
 
+/// Blend several images into a larger image, in a single pass.
+/// Blends layers[i] into position (positions[2*i], positions[2*i+1]) of
+/// dst with alpha alphas[i], for i = 0..n-1, in that order.
+/// The result is exactly that of the n corresponding ImageBlend calls,
+/// but each row of dst is read and written only once.
+/// This modifies dst in-place.
+/// Requires: each layer must fit inside dst at its position.
+void ImageBlendMany(Image dst, Image layers[], const int positions[],
+                    const double alphas[], int n) ;
+
+/// Blend an image into a larger image, with an alpha mask.
+/// Blend img2 into position (x, y) of img1, with alpha mask->level/255
+/// at each pixel of img2: each level becomes
+///   (a*s + (255-a)*d + 127)/255 (rounded, saturated at img1's maxval),
+/// where d is the level in img1, s the level in img2 and a the level in mask.
+/// This modifies img1 in-place: no allocation involved.
+/// Requires: img2 must fit inside img1 at position (x, y), and mask must
+/// have the same size as img2.
+void ImageBlendMask(Image img1, int x, int y, Image img2, Image mask) ;
+
 /// Compare an image to a subimage of a larger image.
 /// Returns 1 (true) if img2 matches subimage of img1 at pos (x, y).
 /// Returns 0, otherwise.
@@ -205,12 +349,412 @@ int ImageMatchSubImage(Image img1, int x, int y, Image img2) ;
 /// If no match is found, returns 0 and (*px, *py) are left untouched.
 int ImageLocateSubImage(Image img1, int* px, int* py, Image img2) ;
 
+/// Indexed subimage search
+
+/// These functions speed up many searches in the same (large) image.
+/// An index hashes every kxk block of the image once; then each search only
+/// compares the positions whose block matches the top-left block of img2.
+
+/// Build an index of all kxk blocks of img.
+/// Requires: k >= 1.
+/// The index keeps a reference to img, which must not be destroyed
+/// or modified while the index is in use.
+///
+/// On success, a new index is returned.
+/// (The caller is responsible for destroying the returned index!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+SubImageIndex ImageIndexCreate(Image img, int k) ;
+
+/// Destroy the index pointed to by (*idxp).
+/// The indexed image is not destroyed.
+/// If (*idxp)==NULL, no operation is performed.
+/// Ensures: (*idxp)==NULL.
+void ImageIndexDestroy(SubImageIndex* idxp) ;
+
+/// Locate a subimage inside the indexed image.
+/// Like ImageLocateSubImage(indexed image, px, py, img2), but only the
+/// positions whose top-left block matches img2 are compared.
+/// If img2 is smaller than the block size, falls back to
+/// ImageLocateSubImage.
+int ImageIndexLocate(SubImageIndex idx, int* px, int* py, Image img2) ;
+
+/// Save index to a file, which may later be loaded with ImageIndexLoad.
+/// On success, returns nonzero.
+/// On failure, returns 0, errno/errCause are set appropriately, and
+/// a partial and invalid file may be left in the system.
+int ImageIndexSave(SubImageIndex idx, const char* filename) ;
+
+/// Load an index of img from a file written by ImageIndexSave.
+/// The file is mapped into memory, not read.
+/// Fails if the file was not built from an image with the same pixels.
+///
+/// On success, a new index is returned.
+/// (The caller is responsible for destroying the returned index!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+SubImageIndex ImageIndexLoad(const char* filename, Image img) ;
+
 /// Filtering
 
 /// Blur an image by a applying a (2dx+1)x(2dy+1) mean filter.
 /// Each pixel is substituted by the mean of the pixels in the rectangle
 /// [x-dx, x+dx]x[y-dy, y+dy].
+/// Requires: (2dx+1)*(2dy+1) < 2^24.
 /// The image is changed in-place.
 void ImageBlur(Image img, int dx, int dy) ;
 
+/// Blur only the pixels inside the rectangle with top left corner (x, y),
+/// width w and height h, as ImageBlur would: the mean filter also reads
+/// the pixels around the rectangle.
+/// Requires: the rectangle must be inside img.
+/// On success, returns nonzero.
+/// On failure, returns 0, errno/errCause are set appropriately,
+/// and the image is not modified.  Fails if (2dx+1)*(2dy+1) >= 2^24.
+int ImageBlurRect(Image img, int x, int y, int w, int h, int dx, int dy) ;
+
+/// Convolve an image with a separable kernel, in fixed point.
+/// kx has 2rx+1 taps, applied along rows; ky has 2ry+1 taps, applied
+/// along columns.  Each pixel is replaced by the 2D weighted sum of its
+/// (2rx+1)x(2ry+1) neighborhood, divided by 2^shift (rounded),
+/// and saturated to [0, maxval].
+/// Pixels outside the image are obtained according to border.
+/// Requires: rx, ry >= 0, 0 <= shift < 31, and the sums must fit in 31 bits:
+///   sum(|kx|) * sum(|ky|) * maxval < 2^31.
+/// The image is changed in-place.
+/// On success, returns nonzero.
+/// On failure, returns 0, errno/errCause are set appropriately,
+/// and the image is not modified.
+int ImageConvolveSeparable(Image img, const int* kx, int rx, const int* ky,
+                           int ry, int shift, ImageBorder border) ;
+
+/// Gaussian blur with standard deviation sigma.
+/// Uses the exact (sampled) Gaussian kernel with radius ceil(3*sigma),
+/// and clamped borders, as ImageBlur.
+/// Requires: sigma > 0.
+/// The image is changed in-place.
+/// On success, returns nonzero.
+/// On failure, returns 0, errno/errCause are set appropriately,
+/// and the image is not modified.
+int ImageGaussian(Image img, double sigma) ;
+
+/// Fast approximate Gaussian blur with standard deviation sigma.
+/// Applies three mean filters (ImageBlur) with sizes chosen so that their
+/// combined variance approximates sigma^2.  The cost does not depend on sigma.
+/// Requires: sigma > 0.
+/// The image is changed in-place.
+/// On success, returns nonzero.
+/// On failure, returns 0, errno/errCause are set appropriately,
+/// and the image may have been blurred by some of the passes.
+int ImageGaussianFast(Image img, double sigma) ;
+
+/// Sharpen an image with an unsharp mask.
+/// Each pixel p becomes p + amount*(p - g), where g is the pixel in the
+/// Gaussian blur of the image with standard deviation sigma.
+/// Results are saturated to [0, maxval].
+/// Requires: sigma > 0, amount >= 0.
+/// The image is changed in-place.
+/// On success, returns nonzero.
+/// On failure, returns 0, errno/errCause are set appropriately,
+/// and the image is not modified.
+int ImageSharpen(Image img, double sigma, double amount) ;
+
+/// Replace an image by its Sobel gradient magnitude.
+/// Each pixel becomes sqrt(gx^2 + gy^2), saturated to maxval, where gx and
+/// gy are the responses to the 3x3 Sobel operators, with clamped borders.
+/// The image is changed in-place.
+/// On success, returns nonzero.
+/// On failure, returns 0, errno/errCause are set appropriately,
+/// and the image is not modified.
+int ImageSobel(Image img) ;
+
+/// Apply a (2dx+1)x(2dy+1) median filter.
+/// Each pixel is substituted by the median of the pixels in the rectangle
+/// [x-dx, x+dx]x[y-dy, y+dy].  Pixels outside the image take the value of
+/// the nearest edge pixel, as in ImageBlur.
+/// The cost per pixel does not depend on dx and dy.
+/// Requires: dx, dy >= 0.
+/// The image is changed in-place.
+/// On success, returns nonzero.
+/// On failure, returns 0, errno/errCause are set appropriately,
+/// and the image is not modified.
+int ImageMedian(Image img, int dx, int dy) ;
+
+/// Morphology
+
+/// Erode an image with a (2dx+1)x(2dy+1) rectangle.
+/// Each pixel is substituted by the minimum of the pixels in the rectangle
+/// [x-dx, x+dx]x[y-dy, y+dy] (pixels outside the image are ignored).
+/// The cost per pixel does not depend on dx and dy.
+/// Requires: dx, dy >= 0.
+/// The image is changed in-place.
+/// On success, returns nonzero.
+/// On failure, returns 0, errno/errCause are set appropriately,
+/// and the image is not modified.
+int ImageErode(Image img, int dx, int dy) ;
+
+/// Dilate an image with a (2dx+1)x(2dy+1) rectangle.
+/// Each pixel is substituted by the maximum of the pixels in the rectangle
+/// [x-dx, x+dx]x[y-dy, y+dy] (pixels outside the image are ignored).
+/// Otherwise, like ImageErode.
+int ImageDilate(Image img, int dx, int dy) ;
+
+/// Morphological opening: erode, then dilate, with the same rectangle.
+/// Removes bright details smaller than the rectangle.
+/// Otherwise, like ImageErode (but on failure the image may be eroded).
+int ImageOpen(Image img, int dx, int dy) ;
+
+/// Morphological closing: dilate, then erode, with the same rectangle.
+/// Fills dark details smaller than the rectangle.
+/// Otherwise, like ImageErode (but on failure the image may be dilated).
+int ImageClose(Image img, int dx, int dy) ;
+
+/// Connected components
+
+/// Label the connected components of the nonzero pixels of img.
+/// Pixels are connected to their 8 neighbours.
+/// Components are numbered 1, 2, ... in the order of their first pixel
+/// (left to right, top to bottom).
+/// On success, returns nonzero and sets:
+///   (*plabels) to a new array of width*height labels (in row order), with
+///   the number of the component of each pixel, or 0 for zero pixels;
+///   (*pcomps) to a new array with the statistics of each component (the
+///   component numbered k is (*pcomps)[k-1]);
+///   (*pcount) to the number of components.
+/// (The caller is responsible for freeing both arrays with free!)
+/// On failure, returns 0 and errno/errCause are set appropriately.
+int ImageLabelComponents(Image img, uint32_t **plabels,
+                         ImageComponent **pcomps, long *pcount) ;
+
+/// Binary images
+
+/// These images store 1 bit per pixel: 1 for black, 0 for white, as in
+/// PBM files.  Paste, crop and locate work on 64 pixels at a time.
+/// Functions that return a new image, or load one, treat success and
+/// failure as in ImageCreate.
+
+/// Create a new white binary image.
+BitImage BitImageCreate(int width, int height) ;
+
+/// Destroy the binary image pointed to by (*imgp).
+/// Ensures: (*imgp)==NULL.  Does nothing if (*imgp) is NULL.
+void BitImageDestroy(BitImage *imgp) ;
+
+/// Get binary image width
+int BitImageWidth(BitImage img) ;
+
+/// Get binary image height
+int BitImageHeight(BitImage img) ;
+
+/// Get the pixel at position (x,y): 1 (black) or 0 (white).
+int BitImageGetPixel(BitImage img, int x, int y) ;
+
+/// Set the pixel at position (x,y) to bit (nonzero for black).
+void BitImageSetPixel(BitImage img, int x, int y, int bit) ;
+
+/// Convert an image to a binary image, with threshold thr.
+/// Pixels with level<thr become black (1), like in ImageThreshold.
+BitImage BitImageFromImage(Image img, uint8 thr) ;
+
+/// Convert a binary image to an image with the given maxval.
+/// Black pixels become 0, and white pixels become maxval.
+Image BitImageToImage(BitImage img, uint8 maxval) ;
+
+/// Bitwise operations.
+/// These modify img1 in-place: no allocation involved.
+/// Requires: img1 and img2 must have the same size.
+
+/// img1 = img1 AND img2 (black where both are black)
+void BitImageAnd(BitImage img1, BitImage img2) ;
+
+/// img1 = img1 OR img2 (black where either is black)
+void BitImageOr(BitImage img1, BitImage img2) ;
+
+/// img1 = img1 XOR img2 (black where they differ)
+void BitImageXor(BitImage img1, BitImage img2) ;
+
+/// img = NOT img (swap black and white)
+void BitImageNot(BitImage img) ;
+
+/// Count the black pixels of img.
+long BitImageCount(BitImage img) ;
+
+/// Load a raw PBM (P4) file.
+BitImage BitImageLoad(const char *filename) ;
+
+/// Save binary image to a raw PBM (P4) file.
+/// On success, returns nonzero.
+/// On failure, returns 0, errno/errCause are set appropriately, and
+/// a partial and invalid file may be left in the system.
+int BitImageSave(BitImage img, const char *filename) ;
+
+/// Paste binary image img2 into position (x, y) of img1.
+/// This modifies img1 in-place: no allocation involved.
+/// Requires: img2 must fit inside img1 at position (x, y).
+void BitImagePaste(BitImage img1, int x, int y, BitImage img2) ;
+
+/// Crop the rectangle with top left corner (x, y), width w and height h
+/// from img, into a new binary image.
+/// Requires: the rectangle must be inside img.
+BitImage BitImageCrop(BitImage img, int x, int y, int w, int h) ;
+
+/// Locate binary image img2 inside img1.
+/// If a match is found, returns 1 and its position is set in (*px, *py).
+/// If no match is found, returns 0 and (*px, *py) are left untouched.
+int BitImageLocateSubImage(BitImage img1, int *px, int *py, BitImage img2) ;
+
+/// Run-length encoded images
+
+/// These images store each row as runs of pixels with the same level, so
+/// images with long constant runs (masks, thresholded pages, blank
+/// canvases) take little memory.  Negative, threshold, paste, crop and
+/// stats work on runs: their cost depends on the number of runs, not of
+/// pixels.  Functions that return a new image treat success and failure
+/// as in ImageCreate.
+
+/// Create a new black RLE image.
+RleImage RleImageCreate(int width, int height, uint8 maxval) ;
+
+/// Destroy the RLE image pointed to by (*imgp).
+/// Ensures: (*imgp)==NULL.  Does nothing if (*imgp) is NULL.
+void RleImageDestroy(RleImage *imgp) ;
+
+/// Get RLE image width
+int RleImageWidth(RleImage img) ;
+
+/// Get RLE image height
+int RleImageHeight(RleImage img) ;
+
+/// Get RLE image maxval
+int RleImageMaxval(RleImage img) ;
+
+/// Number of runs in img.
+long RleImageRuns(RleImage img) ;
+
+/// Bytes of memory used by img.
+size_t RleImageBytes(RleImage img) ;
+
+/// Get the pixel level at position (x,y).
+uint8 RleImageGetPixel(RleImage img, int x, int y) ;
+
+/// Encode an image.
+RleImage RleImageFromImage(Image img) ;
+
+/// Decode an RLE image.
+Image RleImageToImage(RleImage img) ;
+
+/// Get the minimum and maximum pixel levels, as in ImageStats.
+void RleImageStats(RleImage img, uint8 *min, uint8 *max) ;
+
+/// Transform the RLE image to its negative, as in ImageNegative.
+void RleImageNegative(RleImage img) ;
+
+/// Apply threshold to the RLE image, as in ImageThreshold.
+void RleImageThreshold(RleImage img, uint8 thr) ;
+
+/// Crop the rectangle with top left corner (x, y), width w and height h
+/// from img, into a new RLE image.
+/// Requires: the rectangle must be inside img.
+RleImage RleImageCrop(RleImage img, int x, int y, int w, int h) ;
+
+/// Paste RLE image img2 into position (x, y) of img1.
+/// This modifies img1 in-place, but may need to reallocate its runs.
+/// Requires: img2 must fit inside img1 at position (x, y).
+/// On success, returns nonzero.
+/// On failure, returns 0, errno/errCause are set appropriately, and
+/// img1 is left unchanged.
+int RleImagePaste(RleImage img1, int x, int y, RleImage img2) ;
+
+/// Tiled images
+
+/// These images store pixels in 64x64 tiles, each one a contiguous block
+/// of 4 KB, so pixels that are close vertically are also close in memory.
+/// Rotate, crop and blur work tile by tile.  Access along rows is a little
+/// slower than in an Image, and partial tiles at the right and bottom
+/// edges waste memory.  Functions that return a new image, or load one,
+/// treat success and failure as in ImageCreate.
+
+/// Create a new black tiled image.
+TiledImage TiledImageCreate(int width, int height, uint8 maxval) ;
+
+/// Destroy the tiled image pointed to by (*imgp).
+/// Ensures: (*imgp)==NULL.  Does nothing if (*imgp) is NULL.
+void TiledImageDestroy(TiledImage *imgp) ;
+
+/// Get tiled image width
+int TiledImageWidth(TiledImage img) ;
+
+/// Get tiled image height
+int TiledImageHeight(TiledImage img) ;
+
+/// Get tiled image maxval
+int TiledImageMaxval(TiledImage img) ;
+
+/// Get the pixel level at position (x,y).
+uint8 TiledImageGetPixel(TiledImage img, int x, int y) ;
+
+/// Set the pixel at position (x,y) to level.
+void TiledImageSetPixel(TiledImage img, int x, int y, uint8 level) ;
+
+/// Convert an image to a tiled image.
+TiledImage TiledImageFromImage(Image img) ;
+
+/// Convert a tiled image to an image.
+Image TiledImageToImage(TiledImage img) ;
+
+/// Load a raw PGM file into a tiled image, as in ImageLoad.
+TiledImage TiledImageLoad(const char *filename) ;
+
+/// Save tiled image to a PGM file, as in ImageSave.
+int TiledImageSave(TiledImage img, const char *filename) ;
+
+/// Rotate a tiled image 90 degrees anti-clockwise, as in ImageRotate.
+TiledImage TiledImageRotate(TiledImage img) ;
+
+/// Crop the rectangle with top left corner (x, y), width w and height h
+/// from img, into a new tiled image.
+/// Requires: the rectangle must be inside img.
+TiledImage TiledImageCrop(TiledImage img, int x, int y, int w, int h) ;
+
+/// Blur a tiled image with a (2dx+1)x(2dy+1) mean filter, with the same
+/// results as ImageBlur.
+/// Requires: dx, dy >= 0.
+/// The image is changed in-place.
+/// On success, returns nonzero.
+/// On failure, returns 0, errno/errCause are set appropriately,
+/// and the image is not modified.  Fails if (2dx+1)*(2dy+1) >= 2^24.
+int TiledImageBlur(TiledImage img, int dx, int dy) ;
+
+/// Image comparison
+
+/// Check whether two images are equal: same size, maxval and pixels.
+/// Stops at the first block of pixels that differs.
+int ImageEqual(Image img1, Image img2) ;
+
+/// Create an image with the absolute difference of img1 and img2 at each
+/// pixel, with the larger of their maxvals.
+/// Sets (*pcount) to the number of differing pixels, and (*px, *py, *pw,
+/// *ph) to their bounding box (all 0 if there are none).
+/// Requires: img1 and img2 must have the same size.
+/// On failure, returns NULL and errno/errCause are set appropriately.
+Image ImageDiff(Image img1, Image img2, long *pcount,
+                int *px, int *py, int *pw, int *ph) ;
+
+/// Compute the quality of img2 relative to the reference img1, in a
+/// single pass: sets (*psnr) to the peak signal-to-noise ratio, in dB
+/// (INFINITY if the images are equal), and (*ssim) to the mean structural
+/// similarity index of 8x8 windows, spaced 4 pixels apart.  The peak is
+/// the maxval of img1.  Either pointer may be NULL, to skip that metric.
+/// Requires: img1 and img2 must have the same size.
+void ImageQuality(Image img1, Image img2, double *psnr, double *ssim) ;
+
+/// Peak signal-to-noise ratio of img2 relative to img1 (see ImageQuality).
+double ImagePSNR(Image img1, Image img2) ;
+
+/// Mean structural similarity of img2 and img1 (see ImageQuality).
+double ImageSSIM(Image img1, Image img2) ;
+
+/// 64-bit content hash of the size, maxval and pixels of img.
+/// Equal images have equal hashes, and different images almost surely
+/// have different hashes.  Blocks of pixels are hashed in parallel.
+uint64_t ImageHash(Image img) ;
+
 #endif
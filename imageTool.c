@@ -15,12 +15,23 @@
 #include <errno.h>
 #include "error.h"
 #include <assert.h>
+#include <dirent.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
 
 #include "image8bit.h"
 #include "instrumentation.h"
 
 static const char* USAGE =
     "USAGE: imageTool [FILE...] [OPERATION [OPERAND...]]\n"
+    "       imageTool serve SOCKET [OPTION [OPERAND]...]\n"
     "  Apply pipeline of image processing operations to PGM files.\n"
     "  Arguments are processed from left to right and may be\n"
     "  FILES, OPERATIONS, or OPERANDS to operations.\n"
@@ -29,6 +40,12 @@ static const char* USAGE =
     "  The last image in the buffer is called the current image CURR and its\n"
     "  predecessor is PRED.\n"
     "  Most operations apply to CURR and some also use PRED.\n"
+    "  With serve, imageTool keeps running, and reads pipelines (one per line)\n"
+    "  from the Unix domain socket SOCKET (or stdin, if SOCKET is -).\n"
+    "  Each reply ends with a line OK or ERROR.  Named images are kept\n"
+    "  between requests.  Requests may not use -j, alloc, cache, calibrate,\n"
+    "  tic, toc or trace, which affect the whole process; the first four\n"
+    "  may be given as OPTIONs after SOCKET, to apply to the whole server.\n"
     "\n"
     "FILES:\n"
     "  Currently, only image files in 8-bit raw PGM format are accepted.\n"
@@ -37,31 +54,99 @@ static const char* USAGE =
     "OPERATIONS:\n"
     "  FILE            Load PGM image file, creating new image\n"
     "  save FILE       Save CURR to PGM file\n"
+    "  keep NAME       Move CURR out of the buffer, keeping it as image NAME\n"
+    "  use NAME        Append a copy of image NAME to the buffer\n"
+    "  drop NAME       Forget image NAME\n"
     "  info            Show information on CURR (size and range)\n"
     "  tic             Reset instrumentation counters and times.\n"
     "  toc             Print instrumentation counters and times.\n"
+    "  calibrate       Recalibrate time unit of instrumentation (and cache it)\n"
+    "  trace FILE      Trace the following operations, and save the trace\n"
+    "                  to FILE (Chrome trace JSON) when the pipeline ends\n"
+    "  -j N            Use N threads in image operations\n"
+    "                  (0: IMAGE_THREADS env variable, or number of CPUs)\n"
+    "  alloc MODE,MB   Allocate buffers of MB or more megabytes with MODE:\n"
+    "                  malloc, huge (huge pages) or hugepop (also pre-fault)\n"
+    "  cache DIR,MB    Cache results of operations on CURR in directory DIR,\n"
+    "                  keeping it under MB megabytes (0: stop caching)\n"
     "\n"              
     "  neg             Apply photo-negative effect to CURR\n"
     "  thr LEVEL       Apply thresholding to CURR\n"
     "  bri FACTOR      Scale brightness in CURR by FACTOR\n"
+    "  neg, thr, bri and blur may also be written OP@X,Y,W,H to apply them\n"
+    "  only to that rectangle of CURR (blur still reads the pixels around it)\n"
     "\n"              
     "  create W,H      Create new black image with WxH pixels\n"
     "  rotate          Rotate CURR 90º counter-clockwise, creating new image\n"
+    "  rotangle DEG    Rotate CURR DEG degrees counter-clockwise (bilinear,\n"
+    "                  black background), creating new image\n"
     "  mirror          Mirror CURR left-to-right, creating new image\n"
     "  crop X,Y,W,H    Crop a rectangle from CURR, creating new image\n"
+    "  resize W,H      Resize CURR to WxH, creating new image\n"
+    "                  (area average if shrinking, else bilinear)\n"
     "\n"              
     "  paste X,Y       Paste PRED into CURR at position (X,Y)\n"
     "  blend X,Y,alpha Blend PRED into CURR at position (X,Y) with given alpha\n"
+    "  blendmask X,Y   Blend the image before PRED into CURR at position (X,Y)\n"
+    "                  with alpha given by mask PRED (level/255 at each pixel)\n"
+    "  blendmany X,Y,alpha[,X,Y,alpha]...\n"
+    "                  Blend the N images before CURR (one per X,Y,alpha, the\n"
+    "                  first one N places before CURR) into CURR in one pass,\n"
+    "                  as N blends in that order\n"
     "\n"              
     "  locate          Search PRED in CURR, print matching position, or NOTFOUND\n"
+    "  index K         Build index of KxK blocks of CURR, for faster searches\n"
+    "  ilocate         Search PRED in CURR using its index, like locate\n"
+    "  isave FILE      Save index of CURR to FILE\n"
+    "  iload FILE      Load index of CURR from FILE\n"
+    "\n"
+    "  diff            Compare PRED with CURR: print the number of differing\n"
+    "                  pixels and their bounding box, and fail if they differ\n"
+    "  psnr            Print PSNR and SSIM of CURR relative to PRED\n"
     "\n"              
     "  blur DX,DY      blur CURR using (2DX+1)x(2Dy+1) mean filter\n"
+    "  gauss SIGMA     blur CURR using Gaussian filter\n"
+    "  fgauss SIGMA    blur CURR using fast approximate Gaussian filter\n"
+    "  sharpen SIGMA,AMOUNT  sharpen CURR using unsharp mask\n"
+    "  sobel           replace CURR by its Sobel gradient magnitude\n"
+    "  median DX,DY    filter CURR using (2DX+1)x(2DY+1) median filter\n"
+    "\n"
+    "  erode DX,DY     erode CURR with (2DX+1)x(2DY+1) rectangle\n"
+    "  dilate DX,DY    dilate CURR with (2DX+1)x(2DY+1) rectangle\n"
+    "  open DX,DY      open CURR (erode, then dilate)\n"
+    "  close DX,DY     close CURR (dilate, then erode)\n"
+    "\n"
+    "  label           Count the connected components of nonzero pixels in CURR\n"
+    "  rle             Print the runs and memory of CURR run-length encoded\n"
+    "\n"
+    "  bthr LEVEL      Apply thresholding to CURR through a binary image\n"
+    "  The following operations take images as binary (1 bit per pixel):\n"
+    "  level 0 is black and other levels are white.\n"
+    "  bnot            Apply photo-negative effect to binary CURR\n"
+    "  bcrop X,Y,W,H   Crop a rectangle from binary CURR, creating new image\n"
+    "  bpaste X,Y      Paste binary PRED into binary CURR at position (X,Y)\n"
+    "  bcount          Print the number of black pixels in CURR\n"
+    "  blocate         Search binary PRED in binary CURR, like locate\n"
+    "  bsave FILE      Save CURR to PBM file\n"
+    "  bload FILE      Load PBM image file, creating new image\n"
+    "\n"
+    "  rneg            Apply photo-negative effect to CURR run-length encoded\n"
+    "  rthr LEVEL      Apply thresholding to CURR run-length encoded\n"
+    "  rcrop X,Y,W,H   Crop a rectangle from CURR run-length encoded,\n"
+    "                  creating new image\n"
+    "  rpaste X,Y      Paste PRED into CURR, both run-length encoded\n"
+    "\n"
+    "  trotate         Rotate CURR 90º counter-clockwise in 64x64 tiles,\n"
+    "                  creating new image\n"
+    "  tcrop X,Y,W,H   Crop a rectangle from CURR in tiles, creating new image\n"
+    "  tblur DX,DY     blur CURR in tiles, as blur\n"
     "\n"              
     "OPERANDS:\n"     
     "  X,Y             Pixel coordinates: 0,0 is top left corner\n"
     "  DX,DY           Displacement\n"
     "  W,H             Width and height of image or rectangular region\n"
     "  alpha           Blending factor\n"
+    "  SIGMA           Standard deviation of Gaussian filter\n"
     "\n"
     ;
 
@@ -74,8 +159,505 @@ static char* errors[] = {
   "Invalid operand",
   "Invalid rect (overflow)",
   "Invalid alpha",
+  "No index for CURR",
+  "Unknown image name",
+  "Too many named images",
+  "Cannot save trace",
+  "Images differ",
+  "Images differ in size",
+  "Cannot use cache directory",
+  "Operation not allowed in server requests",
+};
+
+
+// Operations that take one operand (all other operations take none).
+// Keep in sync with the operations in runPipeline!
+static const char* OPS1[] = {
+  "-j", "alloc", "cache", "thr", "bri", "create", "rotangle", "crop", "resize",
+  "paste", "blend", "blendmask", "blendmany", "index", "isave", "iload", "blur", "gauss", "fgauss",
+  "sharpen", "median", "erode", "dilate", "open", "close", "save",
+  "keep", "use", "drop", "trace", "bthr", "bcrop", "bpaste", "bsave",
+  "bload", "rthr", "rcrop", "rpaste", "tcrop", "tblur", NULL
+};
+static const char* OPS0[] = {
+  "info", "tic", "toc", "calibrate", "neg", "rotate", "mirror", "locate",
+  "ilocate", "diff", "psnr", "sobel", "label", "rle", "bnot", "bcount",
+  "blocate", "rneg", "trotate", NULL
+};
+
+// Operations that change or read process-wide state (settings, counters or
+// the trace).  Server requests may not use them (see Server mode).
+static const char* GLOBALOPS[] = {
+  "-j", "alloc", "cache", "trace", "tic", "toc", "calibrate", NULL
+};
+
+// Of those, the ones that may be given as options when starting a server
+static const char* SERVEROPTS[] = {
+  "-j", "alloc", "cache", "calibrate", NULL
+};
+
+// Operations that may be restricted to a rectangle of CURR, as OP@X,Y,W,H
+static const char* RECTOPS[] = {
+  "neg", "thr", "bri", "blur", NULL
+};
+
+// Is s the operation op, or op restricted to a rectangle?
+static int isRectOp(const char* s, const char* op) {
+  size_t len = strlen(op);
+  if (strcmp(s, op) == 0) return 1;
+  if (strncmp(s, op, len) != 0 || s[len] != '@') return 0;
+  for (int i = 0; RECTOPS[i] != NULL; i++)
+    if (strcmp(RECTOPS[i], op) == 0) return 1;
+  return 0;
+}
+
+static int isOp(const char* ops[], const char* s) {
+  for (int i = 0; ops[i] != NULL; i++)
+    if (isRectOp(s, ops[i])) return 1;
+  return 0;
+}
+
+// Get the rectangle of operation s (OP@X,Y,W,H) on img into x, y, w, h,
+// or the whole image if s has none.  Returns 0 if it is not a valid
+// rectangle of img.
+static int opRect(const char* s, Image img, int* x, int* y, int* w, int* h) {
+  const char* at = strchr(s, '@');
+  char end;
+  *x = *y = 0;
+  *w = ImageWidth(img);
+  *h = ImageHeight(img);
+  if (at == NULL) return 1;
+  if (sscanf(at + 1, "%d,%d,%d,%d%c", x, y, w, h, &end) != 4) return 0;
+  if (*x < 0 || *y < 0 || *w < 0 || *h < 0) return 0;   // precondition check!
+  return ImageValidRect(img, *x, *y, *w, *h);
+}
+
+// Prefetching of input files
+//
+// Before running the pipeline, runPipeline scans the arguments as its main
+// loop would, and starts loading each input FILE in a background thread, so
+// that disk reads overlap with each other and with computation.  When the
+// main loop reaches a FILE, it only waits for that load to finish.
+// Files that the pipeline also writes (with save or isave) are not
+// prefetched: they are loaded when reached, as their contents may change.
+// If a prefetch fails, the file is loaded again when reached, so errors are
+// reported as usual.
+//
+// Operations with process-wide effects (GLOBALOPS), which change how images
+// are loaded or measured, split the pipeline into segments: only the files
+// of the current segment are prefetched, and the files after such an
+// operation start loading when it has run.  So, in "alloc huge,1 FILE",
+// FILE is allocated with huge pages, and in "tic FILE ... toc", its load
+// is counted between tic and toc.
+
+struct prefetch {
+  const char* name;
+  int arg;          // index of name in the arguments
+  int started;      // loader thread was created
+  pthread_t thread;
+  Image img;        // loaded image, or NULL
+};
+
+static void* prefetchLoad(void* arg) {
+  struct prefetch* pf = arg;
+  pf->img = ImageLoad(pf->name);
+  return NULL;
+}
+
+// Does file name refer to the same file as target?  Preserves errno.
+static int sameFile(const char* name, const char* target) {
+  struct stat s1, s2;
+  if (strcmp(name, target) == 0) return 1;
+  int errsave = errno;
+  int same = stat(name, &s1) == 0 && stat(target, &s2) == 0 &&
+             s1.st_dev == s2.st_dev && s1.st_ino == s2.st_ino;
+  errno = errsave;
+  return same;
+}
+
+// Start loading up to max input files named in av[start..ac-1], up to the
+// next barrier operation.  Returns the number of entries filled in pf.
+static int prefetchStart(int ac, char* av[], int start, struct prefetch pf[],
+                         int max) {
+  int npf = 0;
+  for (int k = start; k < ac && npf < max; k++) {
+    if (isOp(GLOBALOPS, av[k])) break;
+    if (isOp(OPS1, av[k])) { k++; continue; }
+    if (isOp(OPS0, av[k])) continue;
+    // av[k] is an input file: skip it if the pipeline writes it
+    int written = 0;
+    for (int j = 0; j + 1 < ac && !written; j++)
+      if (strcmp(av[j], "save") == 0 || strcmp(av[j], "isave") == 0 ||
+          strcmp(av[j], "bsave") == 0)
+        written = sameFile(av[k], av[j+1]);
+    if (written) continue;
+    struct prefetch* p = &pf[npf++];
+    p->name = av[k];
+    p->arg = k;
+    p->img = NULL;
+    p->started = pthread_create(&p->thread, NULL, prefetchLoad, p) == 0;
+  }
+  return npf;
+}
+
+// Wait for a prefetch to finish.  Returns its image (or NULL on failure),
+// which the caller owns.
+static Image prefetchWait(struct prefetch* p) {
+  if (p->started) {
+    pthread_join(p->thread, NULL);
+    p->started = 0;
+  }
+  Image img = p->img;
+  p->img = NULL;
+  return img;
+}
+
+// Wait for prefetches pf[*p..npf-1] to finish, and destroy their images.
+// Sets (*p) to npf.  Preserves errno.
+static void prefetchDrop(struct prefetch pf[], int* p, int npf) {
+  int errsave = errno;
+  while (*p < npf) {
+    Image unused = prefetchWait(&pf[(*p)++]);
+    ImageDestroy(&unused);
+  }
+  errno = errsave;
+}
+
+// Capacity of the image buffer of a pipeline
+#define N 10
+
+// State of a pipeline of operations
+struct pipeline {
+  Image img[N];       // the image buffer
+  int n;              // number of images created
+  SubImageIndex idx;  // the search index (of image idxImg)
+  int idxImg;
+  FILE* out;          // where results are printed
+  int server;         // running a server request?
+};
+
+// Report progress of pipeline pl (only on the command line).
+static void progress(struct pipeline* pl, const char* fmt, ...) {
+  if (pl->server) return;
+  va_list ap;
+  va_start(ap, fmt);
+  vfprintf(stderr, fmt, ap);
+  va_end(ap);
+}
+
+// Named images
+//
+// The keep operation moves CURR out of the image buffer into a table of
+// named images, where it stays until the program ends (or it is dropped).
+// The use operation appends a copy of a named image to the buffer, so
+// the named image itself is never modified.  In server mode, named images
+// are shared by all requests, so they are protected by a lock.
+
+#define NNAMED 64
+
+static struct {
+  char* name;
+  Image img;
+} named[NNAMED];
+static pthread_mutex_t namedLock = PTHREAD_MUTEX_INITIALIZER;
+
+// Index of image name in named[], or -1.  Call with namedLock held.
+static int namedFind(const char* name) {
+  for (int i = 0; i < NNAMED; i++)
+    if (named[i].name != NULL && strcmp(named[i].name, name) == 0) return i;
+  return -1;
+}
+
+// Store img (which the table now owns) as image name, replacing any image
+// with that name.  Returns 0 if the table is full.
+static int namedPut(const char* name, Image img) {
+  pthread_mutex_lock(&namedLock);
+  int i = namedFind(name);
+  if (i < 0) {
+    for (i = 0; i < NNAMED && named[i].name != NULL; i++) {}
+    if (i < NNAMED && (named[i].name = strdup(name)) == NULL) i = NNAMED;
+  }
+  if (i < NNAMED) {
+    ImageDestroy(&named[i].img);
+    named[i].img = img;
+  }
+  pthread_mutex_unlock(&namedLock);
+  return i < NNAMED;
+}
+
+// Set (*imgp) to a copy of image name (NULL if the copy fails).
+// Returns 0 if there is no such image.
+static int namedCopy(const char* name, Image* imgp) {
+  pthread_mutex_lock(&namedLock);
+  int i = namedFind(name);
+  if (i >= 0) *imgp = ImageCopy(named[i].img);
+  pthread_mutex_unlock(&namedLock);
+  return i >= 0;
+}
+
+// Forget image name.  Returns 0 if there is no such image.
+static int namedDrop(const char* name) {
+  pthread_mutex_lock(&namedLock);
+  int i = namedFind(name);
+  if (i >= 0) {
+    ImageDestroy(&named[i].img);
+    free(named[i].name);
+    named[i].name = NULL;
+  }
+  pthread_mutex_unlock(&namedLock);
+  return i >= 0;
+}
+
+// Result cache
+//
+// After "cache DIR,MB", the results of chains of operations on CURR are
+// cached as PGM files in directory DIR, which is kept under MB megabytes by
+// deleting the least recently used files.  Only the operations in CACHEOPS
+// are cached: they modify CURR in place, and their result only depends on
+// CURR and their operand.
+// Each image loaded from a FILE gets a key, its content hash (ImageHash),
+// and each cached operation on it derives a new key from the old one and
+// the operation with its operand, as written.  Keys also depend on the
+// size and time of the imageTool executable, so a new build does not reuse
+// old results.  When the pipeline reaches a chain of cached operations, it
+// looks for the results of its prefixes, and loads the longest one found
+// instead of running those operations.  As it runs a chain, it saves the
+// result of each operation that is not cached yet, so that pipelines that
+// share a prefix of the chain and differ in the rest reuse that prefix.
+// Files are named by their key, and written under a temporary
+// name and then renamed, so processes can safely share a cache.  Using a
+// file updates its time, which is what eviction goes by.
+
+static const char* CACHEOPS[] = {
+  "neg", "thr", "bri", "blur", "gauss", "fgauss", "sharpen", "sobel",
+  "median", "erode", "dilate", "open", "close", NULL
+};
+
+// Operations that do not modify any image in the buffer
+static const char* READOPS[] = {
+  "info", "tic", "toc", "calibrate", "trace", "-j", "alloc", "cache",
+  "create", "rotate", "rotangle", "mirror", "crop", "resize",
+  "locate", "index", "ilocate", "isave", "iload", "diff", "psnr",
+  "label", "rle", "keep", "use", "drop", "save", "bcrop", "bcount",
+  "blocate", "bsave", "bload", "rcrop", "trotate", "tcrop", NULL
 };
 
+static char* cacheDir = NULL;     // NULL if not caching
+static long long cacheLimit;      // bytes
+static uint64_t cacheSeed;        // identifies the executable
+static pthread_mutex_t cacheLock = PTHREAD_MUTEX_INITIALIZER;
+
+// Mix a 64-bit value (splitmix64 finalizer).
+static uint64_t mix64(uint64_t h) {
+  h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ull;
+  h = (h ^ (h >> 27)) * 0x94d049bb133111ebull;
+  return h ^ (h >> 31);
+}
+
+// Add string s (and its terminator) to hash h (FNV-1a).
+static uint64_t hashString(uint64_t h, const char* s) {
+  do {
+    h = (h ^ (unsigned char)*s) * 0x100000001b3ull;
+  } while (*s++ != '\0');
+  return h;
+}
+
+// Key of the result of the operation av[k] (with its operand, if any) on
+// an image with the given key.  Returns the index of the next operation.
+static int cacheKeyOp(uint64_t* key, int ac, char* av[], int k) {
+  uint64_t h = hashString(*key ^ cacheSeed, av[k]);
+  if (isOp(OPS1, av[k]) && k + 1 < ac) h = hashString(h, av[++k]);
+  *key = mix64(h);
+  return k + 1;
+}
+
+// Set the cache directory and size limit (dir NULL to stop caching).
+// Returns 0 if the directory cannot be created.
+static int cacheSet(const char* dir, long long limit) {
+  struct stat st;
+  int errsave = errno;
+  int ok = dir == NULL ||
+           ((mkdir(dir, 0777) == 0 || errno == EEXIST) && stat(dir, &st) == 0 &&
+            (S_ISDIR(st.st_mode) || (errno = ENOTDIR, 0)));
+  pthread_mutex_lock(&cacheLock);
+  free(cacheDir);
+  cacheDir = ok && dir != NULL ? strdup(dir) : NULL;
+  cacheLimit = limit;
+  cacheSeed = stat("/proc/self/exe", &st) == 0
+      ? mix64((uint64_t)st.st_size ^ mix64((uint64_t)st.st_mtime)) : 0;
+  pthread_mutex_unlock(&cacheLock);
+  if (ok) errno = errsave;
+  return ok;
+}
+
+// Is caching enabled?
+static int caching(void) {
+  pthread_mutex_lock(&cacheLock);
+  int on = cacheDir != NULL;
+  pthread_mutex_unlock(&cacheLock);
+  return on;
+}
+
+// Write the path of the cache file for key into path[size].
+// Returns 0 if caching is disabled.
+static int cachePath(char* path, size_t size, uint64_t key) {
+  pthread_mutex_lock(&cacheLock);
+  int on = cacheDir != NULL;
+  if (on)
+    snprintf(path, size, "%s/%016llx.pgm", cacheDir, (unsigned long long)key);
+  pthread_mutex_unlock(&cacheLock);
+  return on;
+}
+
+// Is there a cached result for key?  Preserves errno.
+static int cacheHas(uint64_t key) {
+  char path[PATH_MAX];
+  int errsave = errno;
+  int has = cachePath(path, sizeof(path), key) && access(path, R_OK) == 0;
+  errno = errsave;
+  return has;
+}
+
+// Load the cached result for key, marking it as recently used.
+// Returns NULL if it cannot be loaded.  Preserves errno.
+static Image cacheLoad(uint64_t key) {
+  char path[PATH_MAX];
+  int errsave = errno;
+  Image img = NULL;
+  if (cachePath(path, sizeof(path), key) && (img = ImageLoad(path)) != NULL)
+    utimes(path, NULL);
+  errno = errsave;
+  return img;
+}
+
+// A cache file, for eviction
+struct cachefile {
+  char name[32];
+  long long size;
+  struct timespec time;  // last modification (or use)
+};
+
+static int cacheOlder(const void* a, const void* b) {
+  const struct cachefile* fa = a;
+  const struct cachefile* fb = b;
+  if (fa->time.tv_sec != fb->time.tv_sec)
+    return (fa->time.tv_sec > fb->time.tv_sec) - (fa->time.tv_sec < fb->time.tv_sec);
+  return (fa->time.tv_nsec > fb->time.tv_nsec) - (fa->time.tv_nsec < fb->time.tv_nsec);
+}
+
+// Delete the least recently used files until the cache fits its limit.
+// Call with cacheLock held.
+static void cacheEvict(void) {
+  DIR* d = opendir(cacheDir);
+  if (d == NULL) return;
+  struct cachefile* files = NULL;
+  size_t nfiles = 0, max = 0;
+  long long total = 0;
+  char path[PATH_MAX];
+  struct dirent* e;
+  while ((e = readdir(d)) != NULL) {
+    struct stat st;
+    size_t len = strlen(e->d_name);
+    if (len != 20 || strcmp(e->d_name + 16, ".pgm") != 0) continue;
+    snprintf(path, sizeof(path), "%s/%s", cacheDir, e->d_name);
+    if (stat(path, &st) != 0) continue;
+    if (nfiles == max) {
+      max = max > 0 ? 2 * max : 64;
+      struct cachefile* more = realloc(files, max * sizeof(*files));
+      if (more == NULL) break;
+      files = more;
+    }
+    strcpy(files[nfiles].name, e->d_name);
+    files[nfiles].size = st.st_size;
+    files[nfiles].time = st.st_mtim;
+    total += st.st_size;
+    nfiles++;
+  }
+  closedir(d);
+  qsort(files, nfiles, sizeof(*files), cacheOlder);
+  for (size_t i = 0; i < nfiles && total > cacheLimit; i++) {
+    snprintf(path, sizeof(path), "%s/%s", cacheDir, files[i].name);
+    if (unlink(path) == 0) total -= files[i].size;
+  }
+  free(files);
+}
+
+// Save img as the cached result for key, and evict old results.
+// Failures are ignored (the result is just not cached).  Preserves errno.
+static void cacheSave(Image img, uint64_t key) {
+  static long tmpCount = 0;
+  char path[PATH_MAX], tmp[PATH_MAX];
+  int errsave = errno;
+  if (cachePath(path, sizeof(path), key)) {
+    long c = __atomic_fetch_add(&tmpCount, 1, __ATOMIC_RELAXED);
+    int len = snprintf(tmp, sizeof(tmp), "%s.%ld.%ld.tmp", path, (long)getpid(), c);
+    if (len < (int)sizeof(tmp) && ImageSave(img, tmp) && rename(tmp, path) == 0) {
+      pthread_mutex_lock(&cacheLock);
+      if (cacheDir != NULL) cacheEvict();
+      pthread_mutex_unlock(&cacheLock);
+    } else {
+      unlink(tmp);
+    }
+  }
+  errno = errsave;
+}
+
+// Binary images
+//
+// The operations on binary images (bnot, bcrop, ...) convert their operands
+// from the images in the buffer, and their results back, so that they can
+// be compared with the same operations on 8-bit images.
+
+// Binary image of img: level 0 is black, and other levels white.
+static BitImage bitsOf(Image img) {
+  return BitImageFromImage(img, 1);
+}
+
+// Replace (*imgp) by binary image (*bitsp), keeping the maxval of (*imgp),
+// and destroy (*bitsp).  Returns 0 if (*bitsp) is NULL or the conversion
+// fails, leaving (*imgp) unchanged.
+static int bitsBack(Image* imgp, BitImage* bitsp) {
+  Image out = *bitsp != NULL ? BitImageToImage(*bitsp, ImageMaxval(*imgp)) : NULL;
+  BitImageDestroy(bitsp);
+  if (out == NULL) return 0;
+  ImageDestroy(imgp);
+  *imgp = out;
+  return 1;
+}
+
+// Run-length encoded images
+//
+// Likewise, the operations on RLE images (rneg, rcrop, ...) encode their
+// operands, and decode their results back into the buffer.
+
+// Replace (*imgp) by the decoding of (*rlep), and destroy (*rlep).
+// Returns 0 if (*rlep) is NULL or the decoding fails, leaving (*imgp)
+// unchanged.
+static int rleBack(Image* imgp, RleImage* rlep) {
+  Image out = *rlep != NULL ? RleImageToImage(*rlep) : NULL;
+  RleImageDestroy(rlep);
+  if (out == NULL) return 0;
+  ImageDestroy(imgp);
+  *imgp = out;
+  return 1;
+}
+
+// Tiled images
+//
+// And the operations on tiled images (trotate, tcrop, tblur) convert CURR
+// to tiles, and their result back.
+
+// Replace (*imgp) by tiled image (*tilesp), and destroy (*tilesp).
+// Returns 0 if (*tilesp) is NULL or the conversion fails, leaving (*imgp)
+// unchanged.
+static int tilesBack(Image* imgp, TiledImage* tilesp) {
+  Image out = *tilesp != NULL ? TiledImageToImage(*tilesp) : NULL;
+  TiledImageDestroy(tilesp);
+  if (out == NULL) return 0;
+  ImageDestroy(imgp);
+  *imgp = out;
+  return 1;
+}
 
 // This program strives for correctness and robustness.
 // You may want to temporarily comment out operand validation, namely
@@ -85,76 +667,162 @@ static char* errors[] = {
 // Also, the program does not test every module function, but you may easily
 // add new operations for that purpose.
 
-int main(int ac, char* av[]) {
-  program_name = av[0];
-  if (ac <= 1) {
-    error(5, 0, "\n%s", USAGE);
-  }
-
-  ImageInit();
-
+// Run the operations in av[0..ac-1] on pipeline pl.
+// Returns 0 on success, or the index of the error message in errors[].
+static int runPipeline(struct pipeline* pl, int ac, char* av[]) {
   int err = 0;
   int x, y, w, h;
 
-  // The image buffer
-  const int N = 10;   // buffer capacity
-  Image img[N];     // the images
-  int n = 0;          // number of images created
+  // Work on local copies of the pipeline state
+  Image* img = pl->img;
+  int n = pl->n;
+  SubImageIndex idx = pl->idx;
+  int idxImg = pl->idxImg;
+  const char* trace = NULL;  // file to save the trace to
+
+  // Cache keys of the images in the buffer (see Result cache)
+  uint64_t key[N];
+  int keyed[N] = {0};  // image has a key
+  int chainEnd = 0;    // argument after the current chain of cached operations
 
-  int k = 1;
+  // Input files being loaded in the background (of the current segment)
+  struct prefetch pf[N];
+  int npf = prefetchStart(ac, av, 0, pf, N - n);
+  int p = 0;          // next prefetch to be used
+
+  int k = 0;
   while (k < ac) {
+    InstrSpan span;  // span of each operation, when tracing
+    if (k >= chainEnd && n > 0 && keyed[n-1] && isOp(CACHEOPS, av[k]) &&
+        caching()) {
+      // Start of a chain: replace its longest cached prefix by its result
+      InstrSpanBegin(&span, "cache");
+      uint64_t chainKey = key[n-1], hitKey = 0;
+      int hitEnd = k, ops = 0, hitOps = 0;
+      for (chainEnd = k; chainEnd < ac && isOp(CACHEOPS, av[chainEnd]); ops++) {
+        chainEnd = cacheKeyOp(&chainKey, ac, av, chainEnd);
+        if (cacheHas(chainKey)) { hitEnd = chainEnd; hitKey = chainKey; hitOps = ops + 1; }
+      }
+      Image cached = hitEnd > k ? cacheLoad(hitKey) : NULL;
+      if (cached != NULL) {
+        progress(pl, "Using cached result of %d operations on I%d\n", hitOps, n-1);
+        if (idxImg == n-1) ImageIndexDestroy(&idx);
+        ImageDestroy(&img[n-1]);
+        img[n-1] = cached;
+        key[n-1] = hitKey;
+        InstrSpanArg(&span, "ops", hitOps);
+        k = hitEnd;
+      }
+      InstrSpanEnd(&span);
+      if (k >= ac) break;
+    }
+    const int opk = k;    // index of the operation
+    const int opn = n;    // images before the operation
+    if (pl->server && isOp(GLOBALOPS, av[k])) { err = 15; break; }
+    if (isOp(GLOBALOPS, av[k])) prefetchDrop(pf, &p, npf);  // none in flight
+    InstrSpanBegin(&span, av[k]);
     if (strcmp(av[k], "info") == 0) {
       if (n < 1) { err = 2; break; }
-      fprintf(stderr, "Info on I%d\n", n-1);
+      progress(pl, "Info on I%d\n", n-1);
       uint8 min, max;
       w = ImageWidth(img[n-1]);
       h = ImageHeight(img[n-1]);
       uint8 maxval = ImageMaxval(img[n-1]);
       ImageStats(img[n-1], &min, &max);
-      printf("# Size: %dx%d\n# Maxval: %hhu\n", w, h, maxval);
-      printf("# Gray level range: [%hhu, %hhu]\n", min, max);
+      fprintf(pl->out, "# Size: %dx%d\n# Maxval: %hhu\n", w, h, maxval);
+      fprintf(pl->out, "# Gray level range: [%hhu, %hhu]\n", min, max);
     } else if (strcmp(av[k], "tic") == 0) {
       InstrReset();
     } else if (strcmp(av[k], "toc") == 0) {
-      InstrPrint();
-    } else if (strcmp(av[k], "neg") == 0) {
+      InstrFPrint(pl->out);
+    } else if (strcmp(av[k], "trace") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      progress(pl, "Tracing to %s\n", av[k]);
+      trace = av[k];
+      InstrTraceStart();
+    } else if (strcmp(av[k], "calibrate") == 0) {
+      progress(pl, "Calibrating instrumentation\n");
+      InstrCalibrate();
+      fprintf(pl->out, "# CTU: %.6f s\n", InstrCTU);
+    } else if (strcmp(av[k], "-j") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      int nthreads;
+      if (sscanf(av[k], "%d", &nthreads) != 1) { err = 5; break; }
+      ImageSetThreads(nthreads);
+      progress(pl, "Using %d threads\n", ImageThreads());
+    } else if (strcmp(av[k], "cache") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      const char* comma = strrchr(av[k], ',');
+      int mb;
+      if (comma == NULL || comma == av[k] || sscanf(comma + 1, "%d", &mb) != 1 || mb < 0) { err = 5; break; }
+      char dir[PATH_MAX];
+      snprintf(dir, sizeof(dir), "%.*s", (int)(comma - av[k]), av[k]);
+      progress(pl, "Caching results in %s up to %d MB\n", dir, mb);
+      if (!cacheSet(mb > 0 ? dir : NULL, (long long)mb << 20)) { err = 14; break; }
+    } else if (strcmp(av[k], "alloc") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      char mode[16];
+      int mb;
+      if (sscanf(av[k], "%15[a-z],%d", mode, &mb) != 2 || mb < 0) { err = 5; break; }
+      if (strcmp(mode, "malloc") == 0) {
+        ImageSetAlloc(IMAGE_ALLOC_MALLOC, 0);
+      } else if (strcmp(mode, "huge") == 0) {
+        ImageSetAlloc(IMAGE_ALLOC_HUGE, (size_t)mb << 20);
+      } else if (strcmp(mode, "hugepop") == 0) {
+        ImageSetAlloc(IMAGE_ALLOC_HUGE_POPULATE, (size_t)mb << 20);
+      } else { err = 5; break; }
+      progress(pl, "Allocating with %s from %d MB\n", mode, mb);
+    } else if (isRectOp(av[k], "neg")) {
       if (n < 1) { err = 2; break; }
-      fprintf(stderr, "Negating I%d\n", n-1);
-      ImageNegative(img[n-1]);
-    } else if (strcmp(av[k], "thr") == 0) {
+      if (!opRect(av[k], img[n-1], &x, &y, &w, &h)) { err = 5; break; }
+      progress(pl, "Negating I%d (%d,%d,%d,%d)\n", n-1, x, y, w, h);
+      ImageNegativeRect(img[n-1], x, y, w, h);
+    } else if (isRectOp(av[k], "thr")) {
       if (++k >= ac) { err = 1; break; }
       if (n < 1) { err = 2; break; }
+      if (!opRect(av[k-1], img[n-1], &x, &y, &w, &h)) { err = 5; break; }
       uint8 thr;
       if (sscanf(av[k], "%hhu", &thr) != 1) { err = 5; break; }
-      fprintf(stderr, "Thresholding I%d at %d\n", n-1, thr);
-      ImageThreshold(img[n-1], (uint8)thr);
-    } else if (strcmp(av[k], "bri") == 0) {
+      progress(pl, "Thresholding I%d (%d,%d,%d,%d) at %d\n", n-1, x, y, w, h, thr);
+      ImageThresholdRect(img[n-1], x, y, w, h, (uint8)thr);
+    } else if (isRectOp(av[k], "bri")) {
       if (++k >= ac) { err = 1; break; }
       if (n < 1) { err = 2; break; }
+      if (!opRect(av[k-1], img[n-1], &x, &y, &w, &h)) { err = 5; break; }
       double factor;
       if (sscanf(av[k], "%lf", &factor) != 1) { err = 5; break; }
-      fprintf(stderr, "Brightening I%d by %lf\n", n-1, factor);
-      ImageBrighten(img[n-1], factor);
+      progress(pl, "Brightening I%d (%d,%d,%d,%d) by %lf\n", n-1, x, y, w, h, factor);
+      ImageBrightenRect(img[n-1], x, y, w, h, factor);
     } else if (strcmp(av[k], "create") == 0) {
       if (++k >= ac) { err = 1; break; }
       if (n >= N) { err = 3; break; }
       if (sscanf(av[k], "%d,%d", &w, &h) != 2) { err = 5; break; }
       if (w < 0 || h < 0) { err = 5; break; }   // precondition check!
-      fprintf(stderr, "Creating black image (%d,%d) -> I%d\n", w, h, n);
+      progress(pl, "Creating black image (%d,%d) -> I%d\n", w, h, n);
       img[n] = ImageCreate(w, h, PixMax);
       if (img[n] == NULL) { err = 4; break; }
       n++;
     } else if (strcmp(av[k], "rotate") == 0) {
       if (n < 1) { err = 2; break; }
       if (n >= N) { err = 3; break; }
-      fprintf(stderr, "Rotating I%d -> I%d\n", n-1, n);
+      progress(pl, "Rotating I%d -> I%d\n", n-1, n);
       img[n] = ImageRotate(img[n-1]);
       if (img[n] == NULL) { err = 4; break; }
       n++;
+    } else if (strcmp(av[k], "rotangle") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      if (n < 1) { err = 2; break; }
+      if (n >= N) { err = 3; break; }
+      double deg;
+      if (sscanf(av[k], "%lf", &deg) != 1) { err = 5; break; }
+      progress(pl, "Rotating I%d by %.3f degrees -> I%d\n", n-1, deg, n);
+      img[n] = ImageRotateAngle(img[n-1], deg, IMAGE_INTERP_BILINEAR, 0);
+      if (img[n] == NULL) { err = 4; break; }
+      n++;
     } else if (strcmp(av[k], "mirror") == 0) {
       if (n < 1) { err = 2; break; }
       if (n >= N) { err = 3; break; }
-      fprintf(stderr, "Mirroring I%d -> I%d\n", n-1, n);
+      progress(pl, "Mirroring I%d -> I%d\n", n-1, n);
       img[n] = ImageMirror(img[n-1]);
       if (img[n] == NULL) { err = 4; break; }
       n++;
@@ -164,10 +832,24 @@ int main(int ac, char* av[]) {
       if (n >= N) { err = 3; break; }
       if (sscanf(av[k], "%d,%d,%d,%d", &x, &y, &w, &h) != 4) { err = 5; break; }
       if (!ImageValidRect(img[n-1], x, y, w, h)) { err = 5; break; }   // precondition check!
-      fprintf(stderr, "Cropping I%d (%d,%d,%d,%d) -> I%d\n", n-1, x, y, w, h, n);
+      progress(pl, "Cropping I%d (%d,%d,%d,%d) -> I%d\n", n-1, x, y, w, h, n);
       img[n] = ImageCrop(img[n-1], x, y, w, h);
       if (img[n] == NULL) { err = 4; break; }
       n++;
+    } else if (strcmp(av[k], "resize") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      if (n < 1) { err = 2; break; }
+      if (n >= N) { err = 3; break; }
+      if (sscanf(av[k], "%d,%d", &w, &h) != 2) { err = 5; break; }
+      if (w <= 0 || h <= 0) { err = 5; break; }   // precondition check!
+      if (ImageWidth(img[n-1]) == 0 || ImageHeight(img[n-1]) == 0) { err = 5; break; }
+      ImageResizeMode mode = IMAGE_RESIZE_BILINEAR;
+      if (w <= ImageWidth(img[n-1]) && h <= ImageHeight(img[n-1]))
+        mode = IMAGE_RESIZE_AREA;
+      progress(pl, "Resizing I%d to (%d,%d) -> I%d\n", n-1, w, h, n);
+      img[n] = ImageResize(img[n-1], w, h, mode);
+      if (img[n] == NULL) { err = 4; break; }
+      n++;
     } else if (strcmp(av[k], "paste") == 0) {
       if (++k >= ac) { err = 1; break; }
       if (n < 2) { err = 2; break; }
@@ -175,7 +857,7 @@ int main(int ac, char* av[]) {
       w = ImageWidth(img[n-2]);
       h = ImageHeight(img[n-2]);
       if (!ImageValidRect(img[n-1], x, y, w, h)) { err = 6; break; }
-      fprintf(stderr, "Pasting I%d at I%d (%d,%d)\n", n-2, n-1, x, y);
+      progress(pl, "Pasting I%d at I%d (%d,%d)\n", n-2, n-1, x, y);
       ImagePaste(img[n-1], x, y, img[n-2]);
     } else if (strcmp(av[k], "blend") == 0) {
       if (++k >= ac) { err = 1; break; }
@@ -185,44 +867,582 @@ int main(int ac, char* av[]) {
       w = ImageWidth(img[n-2]);
       h = ImageHeight(img[n-2]);
       if (!ImageValidRect(img[n-1], x, y, w, h)) { err = 6; break; }
-      fprintf(stderr, "Blending I%d with I%d@(%d,%d) with alpha=%.3f\n", n-2, n-1, x, y, alpha);
+      progress(pl, "Blending I%d with I%d@(%d,%d) with alpha=%.3f\n", n-2, n-1, x, y, alpha);
       ImageBlend(img[n-1], x, y, img[n-2], alpha);
+    } else if (strcmp(av[k], "blendmask") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      if (n < 3) { err = 2; break; }
+      if (sscanf(av[k], "%d,%d", &x, &y) != 2) { err = 5; break; }
+      w = ImageWidth(img[n-3]);
+      h = ImageHeight(img[n-3]);
+      if (ImageWidth(img[n-2]) != w || ImageHeight(img[n-2]) != h) { err = 5; break; }
+      if (!ImageValidRect(img[n-1], x, y, w, h)) { err = 6; break; }
+      progress(pl, "Blending I%d with I%d@(%d,%d) with mask I%d\n", n-3, n-1, x, y, n-2);
+      ImageBlendMask(img[n-1], x, y, img[n-3], img[n-2]);
+    } else if (strcmp(av[k], "blendmany") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      int pos[2*N];
+      double alpha[N];
+      int m = 0, len;
+      const char* arg = av[k];
+      do {  // one X,Y,alpha per layer
+        if (m >= N || sscanf(arg, "%d,%d,%lf%n", &pos[2*m], &pos[2*m+1],
+                             &alpha[m], &len) != 3) { m = -1; break; }
+        m++;
+        arg += len;
+      } while (*arg++ == ',');
+      if (m < 0 || arg[-1] != '\0') { err = 5; break; }
+      if (n < m + 1) { err = 2; break; }
+      Image* layers = &img[n-1-m];
+      for (int i = 0; i < m && err == 0; i++) {
+        if (!ImageValidRect(img[n-1], pos[2*i], pos[2*i+1],
+                            ImageWidth(layers[i]), ImageHeight(layers[i]))) err = 6;
+      }
+      if (err != 0) break;
+      progress(pl, "Blending I%d..I%d into I%d\n", n-1-m, n-2, n-1);
+      ImageBlendMany(img[n-1], layers, pos, alpha, m);
     } else if (strcmp(av[k], "locate") == 0) {
       if (n < 2) { err = 2; break; }
-      fprintf(stderr, "Locating I%d in I%d\n", n-2, n-1);
+      progress(pl, "Locating I%d in I%d\n", n-2, n-1);
       if (ImageLocateSubImage(img[n-1], &x, &y, img[n-2])) {
-        printf("# FOUND (%d,%d)\n", x, y);
+        fprintf(pl->out, "# FOUND (%d,%d)\n", x, y);
+      } else {
+        fprintf(pl->out, "# NOTFOUND\n");
+      }
+    } else if (strcmp(av[k], "diff") == 0) {
+      if (n < 2) { err = 2; break; }
+      progress(pl, "Comparing I%d with I%d\n", n-2, n-1);
+      if (!ImageEqual(img[n-2], img[n-1])) {
+        w = ImageWidth(img[n-1]);
+        h = ImageHeight(img[n-1]);
+        long count = 0;
+        if (ImageWidth(img[n-2]) == w && ImageHeight(img[n-2]) == h) {
+          Image d = ImageDiff(img[n-2], img[n-1], &count, &x, &y, &w, &h);
+          if (d == NULL) { err = 4; break; }
+          ImageDestroy(&d);
+        }
+        if (count > 0) {
+          fprintf(pl->out, "# Differing pixels: %ld in %d,%d,%d,%d\n",
+                  count, x, y, w, h);
+        } else {
+          fprintf(pl->out, "# Size: %dx%d, maxval %d (was %dx%d, maxval %d)\n",
+                  ImageWidth(img[n-1]), ImageHeight(img[n-1]), ImageMaxval(img[n-1]),
+                  ImageWidth(img[n-2]), ImageHeight(img[n-2]), ImageMaxval(img[n-2]));
+        }
+        err = 12; break;
+      }
+      fprintf(pl->out, "# EQUAL\n");
+    } else if (strcmp(av[k], "psnr") == 0) {
+      if (n < 2) { err = 2; break; }
+      if (ImageWidth(img[n-2]) != ImageWidth(img[n-1]) ||
+          ImageHeight(img[n-2]) != ImageHeight(img[n-1])) { err = 13; break; }
+      progress(pl, "Measuring I%d relative to I%d\n", n-1, n-2);
+      double psnr, ssim;
+      ImageQuality(img[n-2], img[n-1], &psnr, &ssim);
+      fprintf(pl->out, "# PSNR: %.2f dB\n# SSIM: %.4f\n", psnr, ssim);
+    } else if (strcmp(av[k], "index") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      if (n < 1) { err = 2; break; }
+      int bk;
+      if (sscanf(av[k], "%d", &bk) != 1) { err = 5; break; }
+      if (bk < 1) { err = 5; break; }   // precondition check!
+      progress(pl, "Indexing %dx%d blocks of I%d\n", bk, bk, n-1);
+      ImageIndexDestroy(&idx);
+      idx = ImageIndexCreate(img[n-1], bk);
+      if (idx == NULL) { err = 4; break; }
+      idxImg = n-1;
+    } else if (strcmp(av[k], "ilocate") == 0) {
+      if (n < 2) { err = 2; break; }
+      if (idx == NULL || idxImg != n-1) { err = 8; break; }
+      progress(pl, "Locating I%d in I%d using index\n", n-2, n-1);
+      if (ImageIndexLocate(idx, &x, &y, img[n-2])) {
+        fprintf(pl->out, "# FOUND (%d,%d)\n", x, y);
       } else {
-        printf("# NOTFOUND\n");
+        fprintf(pl->out, "# NOTFOUND\n");
       }
-    } else if (strcmp(av[k], "blur") == 0) {
+    } else if (strcmp(av[k], "isave") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      if (n < 1) { err = 2; break; }
+      if (idx == NULL || idxImg != n-1) { err = 8; break; }
+      progress(pl, "Saving index %s <- I%d\n", av[k], n-1);
+      if (ImageIndexSave(idx, av[k]) == 0) { err = 4; break; }
+    } else if (strcmp(av[k], "iload") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      if (n < 1) { err = 2; break; }
+      progress(pl, "Loading index %s -> I%d\n", av[k], n-1);
+      ImageIndexDestroy(&idx);
+      idx = ImageIndexLoad(av[k], img[n-1]);
+      if (idx == NULL) { err = 4; break; }
+      idxImg = n-1;
+    } else if (isRectOp(av[k], "blur")) {
+      if (++k >= ac) { err = 1; break; }
+      if (n < 1) { err = 2; break; }
+      if (!opRect(av[k-1], img[n-1], &x, &y, &w, &h)) { err = 5; break; }
+      int dx; int dy;
+      if (sscanf(av[k], "%d,%d", &dx, &dy) != 2) { err = 5; break; }
+      if (dx < 0 || dy < 0) { err = 5; break; }   // precondition check!
+      progress(pl, "Blur I%d (%d,%d,%d,%d) with %dx%d mean filter\n", n-1, x, y, w, h, 2*dx+1, 2*dy+1);
+      if (ImageBlurRect(img[n-1], x, y, w, h, dx, dy) == 0) { err = 4; break; }
+    } else if (strcmp(av[k], "gauss") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      if (n < 1) { err = 2; break; }
+      double sigma;
+      if (sscanf(av[k], "%lf", &sigma) != 1) { err = 5; break; }
+      if (sigma <= 0.0) { err = 5; break; }   // precondition check!
+      progress(pl, "Gaussian blur I%d with sigma=%.3f\n", n-1, sigma);
+      if (ImageGaussian(img[n-1], sigma) == 0) { err = 4; break; }
+    } else if (strcmp(av[k], "fgauss") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      if (n < 1) { err = 2; break; }
+      double sigma;
+      if (sscanf(av[k], "%lf", &sigma) != 1) { err = 5; break; }
+      if (sigma <= 0.0) { err = 5; break; }   // precondition check!
+      progress(pl, "Fast Gaussian blur I%d with sigma=%.3f\n", n-1, sigma);
+      if (ImageGaussianFast(img[n-1], sigma) == 0) { err = 4; break; }
+    } else if (strcmp(av[k], "sharpen") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      if (n < 1) { err = 2; break; }
+      double sigma, amount;
+      if (sscanf(av[k], "%lf,%lf", &sigma, &amount) != 2) { err = 5; break; }
+      if (sigma <= 0.0 || amount < 0.0) { err = 5; break; }   // precondition check!
+      progress(pl, "Sharpen I%d with sigma=%.3f amount=%.3f\n", n-1, sigma, amount);
+      if (ImageSharpen(img[n-1], sigma, amount) == 0) { err = 4; break; }
+    } else if (strcmp(av[k], "sobel") == 0) {
+      if (n < 1) { err = 2; break; }
+      progress(pl, "Sobel gradient of I%d\n", n-1);
+      if (ImageSobel(img[n-1]) == 0) { err = 4; break; }
+    } else if (strcmp(av[k], "median") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      if (n < 1) { err = 2; break; }
+      int dx; int dy;
+      if (sscanf(av[k], "%d,%d", &dx, &dy) != 2) { err = 5; break; }
+      if (dx < 0 || dy < 0) { err = 5; break; }   // precondition check!
+      progress(pl, "Median filter I%d with %dx%d window\n", n-1, 2*dx+1, 2*dy+1);
+      if (ImageMedian(img[n-1], dx, dy) == 0) { err = 4; break; }
+    } else if (strcmp(av[k], "erode") == 0 || strcmp(av[k], "dilate") == 0 ||
+               strcmp(av[k], "open") == 0 || strcmp(av[k], "close") == 0) {
+      const char* op = av[k];
+      if (++k >= ac) { err = 1; break; }
+      if (n < 1) { err = 2; break; }
+      int dx; int dy;
+      if (sscanf(av[k], "%d,%d", &dx, &dy) != 2) { err = 5; break; }
+      if (dx < 0 || dy < 0) { err = 5; break; }   // precondition check!
+      progress(pl, "Morphology %s I%d with %dx%d rectangle\n", op, n-1, 2*dx+1, 2*dy+1);
+      int ok;
+      if (strcmp(op, "erode") == 0) ok = ImageErode(img[n-1], dx, dy);
+      else if (strcmp(op, "dilate") == 0) ok = ImageDilate(img[n-1], dx, dy);
+      else if (strcmp(op, "open") == 0) ok = ImageOpen(img[n-1], dx, dy);
+      else ok = ImageClose(img[n-1], dx, dy);
+      if (!ok) { err = 4; break; }
+    } else if (strcmp(av[k], "label") == 0) {
+      if (n < 1) { err = 2; break; }
+      progress(pl, "Labeling components of I%d\n", n-1);
+      uint32_t* labels;
+      ImageComponent* comps;
+      long count;
+      if (ImageLabelComponents(img[n-1], &labels, &comps, &count) == 0) { err = 4; break; }
+      fprintf(pl->out, "# Components: %ld\n", count);
+      free(labels);
+      free(comps);
+    } else if (strcmp(av[k], "rle") == 0) {
+      if (n < 1) { err = 2; break; }
+      progress(pl, "Encoding I%d\n", n-1);
+      RleImage rle = RleImageFromImage(img[n-1]);
+      if (rle == NULL) { err = 4; break; }
+      double bytes = (double)ImageWidth(img[n-1]) * ImageHeight(img[n-1]);
+      fprintf(pl->out, "# Runs: %ld\n# RLE bytes: %zu (%.1f%% of %.0f)\n",
+              RleImageRuns(rle), RleImageBytes(rle),
+              bytes > 0 ? 100.0 * RleImageBytes(rle) / bytes : 0.0, bytes);
+      RleImageDestroy(&rle);
+    } else if (strcmp(av[k], "bthr") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      if (n < 1) { err = 2; break; }
+      uint8 thr;
+      if (sscanf(av[k], "%hhu", &thr) != 1) { err = 5; break; }
+      progress(pl, "Thresholding I%d at %d to binary image\n", n-1, thr);
+      BitImage bits = BitImageFromImage(img[n-1], thr);
+      if (!bitsBack(&img[n-1], &bits)) { err = 4; break; }
+      if (idxImg == n-1) ImageIndexDestroy(&idx);
+    } else if (strcmp(av[k], "bnot") == 0) {
+      if (n < 1) { err = 2; break; }
+      progress(pl, "Negating binary I%d\n", n-1);
+      BitImage bits = bitsOf(img[n-1]);
+      if (bits != NULL) BitImageNot(bits);
+      if (!bitsBack(&img[n-1], &bits)) { err = 4; break; }
+      if (idxImg == n-1) ImageIndexDestroy(&idx);
+    } else if (strcmp(av[k], "bcrop") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      if (n < 1) { err = 2; break; }
+      if (n >= N) { err = 3; break; }
+      if (sscanf(av[k], "%d,%d,%d,%d", &x, &y, &w, &h) != 4) { err = 5; break; }
+      if (!ImageValidRect(img[n-1], x, y, w, h)) { err = 5; break; }   // precondition check!
+      progress(pl, "Cropping binary I%d (%d,%d,%d,%d) -> I%d\n", n-1, x, y, w, h, n);
+      BitImage bits = bitsOf(img[n-1]);
+      BitImage crop = bits != NULL ? BitImageCrop(bits, x, y, w, h) : NULL;
+      BitImageDestroy(&bits);
+      img[n] = crop != NULL ? BitImageToImage(crop, ImageMaxval(img[n-1])) : NULL;
+      BitImageDestroy(&crop);
+      if (img[n] == NULL) { err = 4; break; }
+      n++;
+    } else if (strcmp(av[k], "bpaste") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      if (n < 2) { err = 2; break; }
+      if (sscanf(av[k], "%d,%d", &x, &y) != 2) { err = 5; break; }
+      w = ImageWidth(img[n-2]);
+      h = ImageHeight(img[n-2]);
+      if (!ImageValidRect(img[n-1], x, y, w, h)) { err = 6; break; }
+      progress(pl, "Pasting binary I%d at I%d (%d,%d)\n", n-2, n-1, x, y);
+      BitImage bits1 = bitsOf(img[n-1]);
+      BitImage bits2 = bits1 != NULL ? bitsOf(img[n-2]) : NULL;
+      if (bits2 != NULL) BitImagePaste(bits1, x, y, bits2);
+      else BitImageDestroy(&bits1);
+      BitImageDestroy(&bits2);
+      if (!bitsBack(&img[n-1], &bits1)) { err = 4; break; }
+      if (idxImg == n-1) ImageIndexDestroy(&idx);
+    } else if (strcmp(av[k], "bcount") == 0) {
+      if (n < 1) { err = 2; break; }
+      progress(pl, "Counting black pixels of binary I%d\n", n-1);
+      BitImage bits = bitsOf(img[n-1]);
+      if (bits == NULL) { err = 4; break; }
+      fprintf(pl->out, "# Black pixels: %ld\n", BitImageCount(bits));
+      BitImageDestroy(&bits);
+    } else if (strcmp(av[k], "blocate") == 0) {
+      if (n < 2) { err = 2; break; }
+      progress(pl, "Locating binary I%d in I%d\n", n-2, n-1);
+      BitImage bits1 = bitsOf(img[n-1]);
+      BitImage bits2 = bits1 != NULL ? bitsOf(img[n-2]) : NULL;
+      int found = bits2 != NULL && BitImageLocateSubImage(bits1, &x, &y, bits2);
+      BitImageDestroy(&bits1);
+      if (bits2 == NULL) { err = 4; break; }
+      BitImageDestroy(&bits2);
+      if (found) {
+        fprintf(pl->out, "# FOUND (%d,%d)\n", x, y);
+      } else {
+        fprintf(pl->out, "# NOTFOUND\n");
+      }
+    } else if (strcmp(av[k], "bsave") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      if (n < 1) { err = 2; break; }
+      progress(pl, "Saving binary %s <- I%d\n", av[k], n-1);
+      BitImage bits = bitsOf(img[n-1]);
+      int ok = bits != NULL && BitImageSave(bits, av[k]);
+      BitImageDestroy(&bits);
+      if (!ok) { err = 4; break; }
+      if (pl->server) fprintf(pl->out, "# SAVED %s\n", av[k]);
+    } else if (strcmp(av[k], "bload") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      if (n >= N) { err = 3; break; }
+      progress(pl, "Loading binary %s -> I%d\n", av[k], n);
+      BitImage bits = BitImageLoad(av[k]);
+      img[n] = bits != NULL ? BitImageToImage(bits, PixMax) : NULL;
+      BitImageDestroy(&bits);
+      if (img[n] == NULL) { err = 4; break; }
+      n++;
+    } else if (strcmp(av[k], "rneg") == 0) {
+      if (n < 1) { err = 2; break; }
+      progress(pl, "Negating I%d run-length encoded\n", n-1);
+      RleImage rle = RleImageFromImage(img[n-1]);
+      if (rle != NULL) RleImageNegative(rle);
+      if (!rleBack(&img[n-1], &rle)) { err = 4; break; }
+      if (idxImg == n-1) ImageIndexDestroy(&idx);
+    } else if (strcmp(av[k], "rthr") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      if (n < 1) { err = 2; break; }
+      uint8 thr;
+      if (sscanf(av[k], "%hhu", &thr) != 1) { err = 5; break; }
+      progress(pl, "Thresholding I%d at %d run-length encoded\n", n-1, thr);
+      RleImage rle = RleImageFromImage(img[n-1]);
+      if (rle != NULL) RleImageThreshold(rle, thr);
+      if (!rleBack(&img[n-1], &rle)) { err = 4; break; }
+      if (idxImg == n-1) ImageIndexDestroy(&idx);
+    } else if (strcmp(av[k], "rcrop") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      if (n < 1) { err = 2; break; }
+      if (n >= N) { err = 3; break; }
+      if (sscanf(av[k], "%d,%d,%d,%d", &x, &y, &w, &h) != 4) { err = 5; break; }
+      if (!ImageValidRect(img[n-1], x, y, w, h)) { err = 5; break; }   // precondition check!
+      progress(pl, "Cropping I%d (%d,%d,%d,%d) run-length encoded -> I%d\n", n-1, x, y, w, h, n);
+      RleImage rle = RleImageFromImage(img[n-1]);
+      RleImage crop = rle != NULL ? RleImageCrop(rle, x, y, w, h) : NULL;
+      RleImageDestroy(&rle);
+      img[n] = crop != NULL ? RleImageToImage(crop) : NULL;
+      RleImageDestroy(&crop);
+      if (img[n] == NULL) { err = 4; break; }
+      n++;
+    } else if (strcmp(av[k], "rpaste") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      if (n < 2) { err = 2; break; }
+      if (sscanf(av[k], "%d,%d", &x, &y) != 2) { err = 5; break; }
+      w = ImageWidth(img[n-2]);
+      h = ImageHeight(img[n-2]);
+      if (!ImageValidRect(img[n-1], x, y, w, h)) { err = 6; break; }
+      progress(pl, "Pasting I%d at I%d (%d,%d) run-length encoded\n", n-2, n-1, x, y);
+      RleImage rle1 = RleImageFromImage(img[n-1]);
+      RleImage rle2 = rle1 != NULL ? RleImageFromImage(img[n-2]) : NULL;
+      if (rle2 == NULL || !RleImagePaste(rle1, x, y, rle2)) RleImageDestroy(&rle1);
+      RleImageDestroy(&rle2);
+      if (!rleBack(&img[n-1], &rle1)) { err = 4; break; }
+      if (idxImg == n-1) ImageIndexDestroy(&idx);
+    } else if (strcmp(av[k], "trotate") == 0) {
+      if (n < 1) { err = 2; break; }
+      if (n >= N) { err = 3; break; }
+      progress(pl, "Rotating I%d in tiles -> I%d\n", n-1, n);
+      TiledImage tiles = TiledImageFromImage(img[n-1]);
+      TiledImage rot = tiles != NULL ? TiledImageRotate(tiles) : NULL;
+      TiledImageDestroy(&tiles);
+      img[n] = rot != NULL ? TiledImageToImage(rot) : NULL;
+      TiledImageDestroy(&rot);
+      if (img[n] == NULL) { err = 4; break; }
+      n++;
+    } else if (strcmp(av[k], "tcrop") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      if (n < 1) { err = 2; break; }
+      if (n >= N) { err = 3; break; }
+      if (sscanf(av[k], "%d,%d,%d,%d", &x, &y, &w, &h) != 4) { err = 5; break; }
+      if (!ImageValidRect(img[n-1], x, y, w, h)) { err = 5; break; }   // precondition check!
+      progress(pl, "Cropping I%d (%d,%d,%d,%d) in tiles -> I%d\n", n-1, x, y, w, h, n);
+      TiledImage tiles = TiledImageFromImage(img[n-1]);
+      TiledImage crop = tiles != NULL ? TiledImageCrop(tiles, x, y, w, h) : NULL;
+      TiledImageDestroy(&tiles);
+      img[n] = crop != NULL ? TiledImageToImage(crop) : NULL;
+      TiledImageDestroy(&crop);
+      if (img[n] == NULL) { err = 4; break; }
+      n++;
+    } else if (strcmp(av[k], "tblur") == 0) {
       if (++k >= ac) { err = 1; break; }
       if (n < 1) { err = 2; break; }
       int dx; int dy;
       if (sscanf(av[k], "%d,%d", &dx, &dy) != 2) { err = 5; break; }
-      fprintf(stderr, "Blur I%d with %dx%d mean filter\n", n-1, 2*dx+1, 2*dy+1);
-      ImageBlur(img[n-1], dx, dy);
+      if (dx < 0 || dy < 0) { err = 5; break; }   // precondition check!
+      progress(pl, "Blur I%d in tiles with %dx%d mean filter\n", n-1, 2*dx+1, 2*dy+1);
+      TiledImage tiles = TiledImageFromImage(img[n-1]);
+      if (tiles != NULL && !TiledImageBlur(tiles, dx, dy)) TiledImageDestroy(&tiles);
+      if (!tilesBack(&img[n-1], &tiles)) { err = 4; break; }
+      if (idxImg == n-1) ImageIndexDestroy(&idx);
+    } else if (strcmp(av[k], "keep") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      if (n < 1) { err = 2; break; }
+      progress(pl, "Keeping I%d as %s\n", n-1, av[k]);
+      if (!namedPut(av[k], img[n-1])) { err = 10; break; }
+      if (idxImg == n-1) ImageIndexDestroy(&idx);
+      n--;
+    } else if (strcmp(av[k], "use") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      if (n >= N) { err = 3; break; }
+      progress(pl, "Using %s -> I%d\n", av[k], n);
+      if (!namedCopy(av[k], &img[n])) { err = 9; break; }
+      if (img[n] == NULL) { err = 4; break; }
+      n++;
+    } else if (strcmp(av[k], "drop") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      progress(pl, "Dropping %s\n", av[k]);
+      if (!namedDrop(av[k])) { err = 9; break; }
     } else if (strcmp(av[k], "save") == 0) {
       if (++k >= ac) { err = 1; break; }
       if (n < 1) { err = 2; break; }
-      fprintf(stderr, "Saving %s <- I%d\n", av[k], n-1);
+      progress(pl, "Saving %s <- I%d\n", av[k], n-1);
       if (ImageSave(img[n-1], av[k]) == 0) { err = 4; break; }
+      if (pl->server) fprintf(pl->out, "# SAVED %s\n", av[k]);
     } else {  // image file
       if (n >= N) { err = 3; break; }
-      fprintf(stderr, "Loading %s -> I%d\n", av[k], n);
-      img[n] = ImageLoad(av[k]);
+      progress(pl, "Loading %s -> I%d\n", av[k], n);
+      img[n] = NULL;
+      if (p < npf && pf[p].arg == k)
+        img[n] = prefetchWait(&pf[p++]);
+      if (img[n] == NULL)  // not prefetched, or failed: load now
+        img[n] = ImageLoad(av[k]);
       if (img[n] == NULL) { err = 4; break; }
       n++;
     }
+    // Update the cache keys: new images have none, unless loaded from a
+    // file, and operations that are not cached invalidate the key of CURR
+    for (int i = opn; i < n; i++) keyed[i] = 0;
+    if (!isOp(OPS0, av[opk]) && !isOp(OPS1, av[opk])) {  // image file
+      if (caching()) {
+        key[n-1] = ImageHash(img[n-1]);
+        keyed[n-1] = 1;
+      }
+    } else if (isOp(CACHEOPS, av[opk])) {
+      if (keyed[n-1]) {
+        cacheKeyOp(&key[n-1], ac, av, opk);
+        if (!cacheHas(key[n-1])) cacheSave(img[n-1], key[n-1]);
+      }
+    } else if (!isOp(READOPS, av[opk]) && n > 0) {
+      keyed[n-1] = 0;
+    }
+    if (n > 0) {
+      InstrSpanArg(&span, "width", ImageWidth(img[n-1]));
+      InstrSpanArg(&span, "height", ImageHeight(img[n-1]));
+    }
+    InstrSpanEnd(&span);
     k++;
+    if (isOp(GLOBALOPS, av[opk])) {  // start the next segment
+      npf = prefetchStart(ac, av, k, pf, N - n);
+      p = 0;
+    }
   }
-  
-  // Destroy remaining images
-  while (n > 0) {
-    ImageDestroy(&img[--n]);
+
+  // Destroy unused prefetches
+  prefetchDrop(pf, &p, npf);
+  int errsave = errno;
+
+  if (trace != NULL) {
+    progress(pl, "Saving trace %s\n", trace);
+    if (InstrTraceSave(trace)) errno = errsave;
+    else if (err == 0) err = 11;
   }
 
+  pl->n = n;
+  pl->idx = idx;
+  pl->idxImg = idxImg;
+  return err;
+}
+
+// Destroy the index and all images of pipeline pl.
+static void pipelineClear(struct pipeline* pl) {
+  ImageIndexDestroy(&pl->idx);
+  pl->idxImg = -1;
+  while (pl->n > 0) {
+    ImageDestroy(&pl->img[--pl->n]);
+  }
+}
+
+// Server mode
+//
+// "imageTool serve SOCKET" runs until killed, serving requests received on
+// the Unix domain socket SOCKET, or on standard input if SOCKET is "-".
+// A request is one line with FILES and OPERATIONS separated by blanks, as
+// on the command line.  Each request runs on an empty image buffer, so only
+// named images persist between requests.  The reply is the output of the
+// operations, followed by a line with "OK" or "ERROR message".
+// Each client connection is served by its own thread.
+// As clients run concurrently, requests may not use operations with
+// process-wide effects (GLOBALOPS): a -j could resize the thread pool in
+// the middle of another client's operation, and tic or toc would reset or
+// read counters that all clients update.  The settings (SERVEROPTS) are
+// given when the server starts instead, before any client is served.
+
+#define MAXLINE 4096
+#define MAXARGS (MAXLINE / 2 + 1)  // enough for any line
+
+// Serve the requests read from in, replying on out, until end of file.
+static void serveStream(FILE* in, FILE* out) {
+  char line[MAXLINE];
+  char* av[MAXARGS];
+  while (fgets(line, sizeof(line), in) != NULL) {
+    int ac = 0;
+    int err = 0;
+    errno = 0;
+    if (strchr(line, '\n') == NULL && !feof(in)) {
+      // Request too long: skip the rest of it
+      int c;
+      while ((c = getc(in)) != EOF && c != '\n') {}
+      err = 1;
+    } else {
+      char* save;
+      for (char* tok = strtok_r(line, " \t\r\n", &save); tok != NULL;
+           tok = strtok_r(NULL, " \t\r\n", &save))
+        av[ac++] = tok;
+    }
+    if (ac > 0) {
+      struct pipeline pl = {.n = 0, .idx = NULL, .idxImg = -1,
+                            .out = out, .server = 1};
+      err = runPipeline(&pl, ac, av);
+      pipelineClear(&pl);
+    }
+    if (err == 0) {
+      fprintf(out, "OK\n");
+    } else {
+      fprintf(out, "ERROR ");
+      fprintf(out, errors[err], ImageErrMsg());
+      if (errno != 0) fprintf(out, ": %s", strerror(errno));
+      fprintf(out, "\n");
+    }
+    fflush(out);
+  }
+}
+
+static void* serveClient(void* arg) {
+  int fd = (int)(long)arg;
+  FILE* in = fdopen(fd, "r");
+  int fd2 = dup(fd);
+  FILE* out = fd2 >= 0 ? fdopen(fd2, "w") : NULL;
+  char name[32];
+  snprintf(name, sizeof(name), "client %d", fd);
+  InstrTraceThreadName(name);
+  if (in != NULL && out != NULL) {
+    serveStream(in, out);
+  }
+  if (out != NULL) fclose(out); else if (fd2 >= 0) close(fd2);
+  if (in != NULL) fclose(in); else close(fd);
+  return NULL;
+}
+
+// Serve requests on Unix domain socket path (or stdin/stdout if "-").
+// Only returns at end of input, in the stdin case.
+static void serve(const char* path) {
+  if (strcmp(path, "-") == 0) {
+    serveStream(stdin, stdout);
+    return;
+  }
+  signal(SIGPIPE, SIG_IGN);  // clients may go away at any time
+  struct sockaddr_un addr = {.sun_family = AF_UNIX};
+  if (strlen(path) >= sizeof(addr.sun_path))
+    error(5, 0, "Socket path too long: %s", path);
+  strcpy(addr.sun_path, path);
+  struct stat st;
+  if (stat(path, &st) == 0 && S_ISSOCK(st.st_mode))
+    unlink(path);  // stale socket from a previous server
+  int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (sock < 0 || bind(sock, (struct sockaddr*)&addr, sizeof(addr)) != 0 ||
+      listen(sock, 64) != 0)
+    error(4, errno, "Cannot listen on %s", path);
+  fprintf(stderr, "Serving on %s\n", path);
+  for (;;) {
+    int fd = accept(sock, NULL, NULL);
+    if (fd < 0) {
+      if (errno == EINTR || errno == ECONNABORTED) continue;
+      error(4, errno, "accept");
+    }
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, serveClient, (void*)(long)fd) == 0)
+      pthread_detach(thread);
+    else
+      close(fd);
+  }
+}
+
+int main(int ac, char* av[]) {
+  program_name = av[0];
+  if (ac <= 1) {
+    error(5, 0, "\n%s", USAGE);
+  }
+
+  ImageInit();
+  InstrTraceThreadName("main");
+
+  if (strcmp(av[1], "serve") == 0) {
+    if (ac < 3) error(5, 0, "\n%s", USAGE);
+    // Apply the server options, if any
+    for (int k = 3; k < ac; k++) {
+      if (!isOp(SERVEROPTS, av[k])) error(5, 0, "Not a server option: %s", av[k]);
+      if (isOp(OPS1, av[k])) k++;
+    }
+    struct pipeline pl = {.n = 0, .idx = NULL, .idxImg = -1,
+                          .out = stdout, .server = 0};
+    int err = runPipeline(&pl, ac-3, av+3);
+    if (err != 0) error(err, errno, errors[err], ImageErrMsg());
+    serve(av[2]);
+    return 0;
+  }
+
+  struct pipeline pl = {.n = 0, .idx = NULL, .idxImg = -1,
+                        .out = stdout, .server = 0};
+  int err = runPipeline(&pl, ac-1, av+1);
+  
+  // Destroy index and remaining images
+  pipelineClear(&pl);
+
   error(err, errno, errors[err], ImageErrMsg());
   return 0;
 }
-
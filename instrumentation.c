@@ -9,7 +9,8 @@
 /// // Name the counters you're going to use: 
 /// InstrName[0] = "memops";
 /// InstrName[1] = "adds";
-/// InstrCalibrate();  // Call once, to measure CTU
+/// // The CTU is calibrated (or read from a cache) when first needed.
+/// // InstrCalibrate();  // Call to force a new calibration
 /// ...
 /// InstrReset();  // reset to zero
 /// for (...) {
@@ -18,10 +19,16 @@
 ///   a[k] = a[i] + a[j];
 /// }
 /// InstrPrint();  // to show time and counters
+///
+/// Spans (see InstrSpanBegin) time parts of a program, and are saved as a
+/// trace that can be viewed with chrome://tracing or ui.perfetto.dev.
 
 #include "instrumentation.h"
+#include <errno.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 /// Cpu time in seconds
 double cpu_time(void) ; ///
@@ -32,7 +39,18 @@ double cpu_time(void) ; ///
 // GNU/Linux and MacOS code to measure elapsed time
 //
 
+#include <sys/stat.h>
 #include <time.h>
+#include <unistd.h>
+
+static long processId(void) {
+  return (long)getpid();
+}
+
+// Create directory path (if it does not exist yet).
+static int makeDir(const char *path) {
+  return mkdir(path, 0777) == 0 || errno == EEXIST;
+}
 
 double cpu_time(void) {
   struct timespec current_time;
@@ -42,6 +60,15 @@ double cpu_time(void) {
   return (double)current_time.tv_sec + 1.0e-9 * (double)current_time.tv_nsec;
 }
 
+// Wall-clock time in seconds (from an arbitrary origin)
+static double wall_time(void) {
+  struct timespec current_time;
+
+  if (clock_gettime(CLOCK_MONOTONIC, &current_time) != 0)
+    return -1.0;
+  return (double)current_time.tv_sec + 1.0e-9 * (double)current_time.tv_nsec;
+}
+
 #endif
 
 
@@ -53,6 +80,16 @@ double cpu_time(void) {
 
 #include <windows.h>
 
+static long processId(void) {
+  return (long)GetCurrentProcessId();
+}
+
+// Create directory path (if it does not exist yet).
+static int makeDir(const char *path) {
+  return CreateDirectoryA(path, NULL) ||
+         GetLastError() == ERROR_ALREADY_EXISTS;
+}
+
 double cpu_time(void) {
   static LARGE_INTEGER frequency;
   static int first_time = 1;
@@ -66,6 +103,11 @@ double cpu_time(void) {
   return (double)current_time.QuadPart / (double)frequency.QuadPart;
 }
 
+// Wall-clock time in seconds (from an arbitrary origin)
+static double wall_time(void) {
+  return cpu_time();  // already measures elapsed time
+}
+
 #endif
 
 /// Array of operation counters:
@@ -79,12 +121,127 @@ char* InstrName[NUMCOUNTERS] = {NULL};  ///extern
 /// Cpu_time read on previous reset (~seconds)
 double InstrTime;  ///extern
 
-/// Calibrated Time Unit (in seconds, initially 1s)
+/// Function called to update counters before they are printed (or NULL).
+void (*InstrUpdate)(void) = NULL;  ///extern
+
+/// Calibrated Time Unit (in seconds, initially 1s).
+/// Only valid after InstrCalibrate or InstrGetCTU: use InstrGetCTU.
 double InstrCTU = 1.0;  ///extern
 
+// Has InstrCTU been calibrated (or read from the cache)?
+static int calibrated = 0;
+
+// CTU cache
+//
+// Calibration takes a noticeable time, so its result is kept in a cache
+// file, with one line per CPU: a key identifying the CPU, a tab, and the
+// CTU.  The key is the CPU model name and maximum frequency (on Linux,
+// from /proc/cpuinfo and /sys/devices/system/cpu), so a cache in a shared
+// home directory works on different machines.
+
+// Path of the cache file in path (of size n).  Returns 0 if there is none.
+static int cachePath(char *path, size_t n) {
+  const char *env = getenv("INSTR_CTU_CACHE");
+  if (env != NULL)
+    return snprintf(path, n, "%s", env) < (int)n;
+  env = getenv("XDG_CACHE_HOME");
+  if (env != NULL && env[0] != '\0')
+    return snprintf(path, n, "%s/instr_ctu", env) < (int)n;
+  env = getenv("HOME");
+  if (env != NULL && env[0] != '\0')
+    return snprintf(path, n, "%s/.cache/instr_ctu", env) < (int)n;
+  return 0;
+}
+
+// Key identifying this CPU in key (of size n), with no tabs or newlines.
+static void cacheKey(char *key, size_t n) {
+  char model[128] = "unknown";
+  long khz = 0;
+  double mhz = 0.0;
+  char line[256];
+  FILE *f = fopen("/proc/cpuinfo", "r");
+  if (f != NULL) {
+    while (fgets(line, sizeof(line), f) != NULL) {
+      char *colon = strchr(line, ':');
+      if (colon == NULL)
+        continue;
+      if (strncmp(line, "model name", 10) == 0)
+        snprintf(model, sizeof(model), "%s", colon + 2);
+      else if (strncmp(line, "cpu MHz", 7) == 0)
+        sscanf(colon + 1, "%lf", &mhz);
+      else if (line[0] == '\n')
+        break; // end of first CPU
+    }
+    fclose(f);
+  }
+  f = fopen("/sys/devices/system/cpu/cpu0/cpufreq/cpuinfo_max_freq", "r");
+  if (f == NULL || fscanf(f, "%ld", &khz) != 1)
+    khz = (long)(mhz / 100.0 + 0.5) * 100000; // current, to 100 MHz
+  if (f != NULL)
+    fclose(f);
+  model[strcspn(model, "\t\n")] = '\0';
+  snprintf(key, n, "%s @ %ld kHz", model, khz);
+}
+
+// Look up the CTU for key in the cache.  Returns 0 if not found.
+static int cacheGet(const char *key, double *ctu) {
+  char path[1024], line[512];
+  FILE *f;
+  if (!cachePath(path, sizeof(path)) || (f = fopen(path, "r")) == NULL)
+    return 0;
+  size_t len = strlen(key);
+  int found = 0;
+  while (!found && fgets(line, sizeof(line), f) != NULL)
+    found = strncmp(line, key, len) == 0 && line[len] == '\t' &&
+            sscanf(line + len + 1, "%lf", ctu) == 1 && *ctu > 0.0;
+  fclose(f);
+  return found;
+}
+
+// Create the directories leading to file path, like mkdir -p.
+// Returns 0 if one could not be created.
+static int makeParents(const char *path) {
+  char dir[1024];
+  if (snprintf(dir, sizeof(dir), "%s", path) >= (int)sizeof(dir))
+    return 0;
+  int ok = 1;
+  for (char *p = strchr(dir + 1, '/'); ok && p != NULL; p = strchr(p + 1, '/')) {
+    *p = '\0';
+    ok = makeDir(dir);
+    *p = '/';
+  }
+  return ok;
+}
+
+// Store the CTU for key in the cache, replacing any previous value.
+// The file is rewritten to a temporary file and renamed, so concurrent
+// readers never see a partial file.  Failures are ignored.
+static void cachePut(const char *key, double ctu) {
+  char path[1024], tmp[1100], line[512];
+  if (!cachePath(path, sizeof(path)) || !makeParents(path))
+    return;
+  snprintf(tmp, sizeof(tmp), "%s.%ld", path, processId());
+  FILE *out = fopen(tmp, "w");
+  if (out == NULL)
+    return;
+  FILE *in = fopen(path, "r");
+  size_t len = strlen(key);
+  if (in != NULL) {
+    // Copy the entries of other CPUs
+    while (fgets(line, sizeof(line), in) != NULL)
+      if (!(strncmp(line, key, len) == 0 && line[len] == '\t'))
+        fputs(line, out);
+    fclose(in);
+  }
+  fprintf(out, "%s\t%.9g\n", key, ctu);
+  if (fclose(out) != 0 || rename(tmp, path) != 0)
+    remove(tmp);
+}
+
 /// Find the Calibrated Time Unit (CTU).
 /// Run and time a loop of basic memory and arithmetic operations to set
 /// a reasonably cpu-independent time unit.
+/// The result is saved in the CTU cache file (see InstrGetCTU).
 void InstrCalibrate(void) { ///
   const int size = 4*1024;     // 2^12!
   const int mask = size - 1;
@@ -99,6 +256,30 @@ void InstrCalibrate(void) { ///
     //printf("%d %d %d\n", i, j, k);  // debug
   }
   InstrCTU = cpu_time() - time;
+  calibrated = 1;
+
+  int errsave = errno;
+  char key[256];
+  cacheKey(key, sizeof(key));
+  cachePut(key, InstrCTU);
+  errno = errsave;
+}
+
+/// Get the Calibrated Time Unit.
+/// On first use, the CTU is read from a cache file, if it has a value for
+/// this CPU (model and frequency); if not, it is calibrated and saved there.
+double InstrGetCTU(void) { ///
+  if (!calibrated) {
+    int errsave = errno;
+    char key[256];
+    cacheKey(key, sizeof(key));
+    if (cacheGet(key, &InstrCTU))
+      calibrated = 1;
+    else
+      InstrCalibrate();
+    errno = errsave;
+  }
+  return InstrCTU;
 }
 
 /// Reset counters to zero and store cpu_time.
@@ -110,20 +291,199 @@ void InstrReset(void) { ///
 
 // Print times and all named counter values
 void InstrPrint(void) { ///
+  InstrFPrint(stdout);
+}
+
+// Print times and all named counter values to file f
+void InstrFPrint(FILE *f) { ///
   // elapsed time since last reset:
   double time = cpu_time() - InstrTime;
   // compute time in calibrated time units:
-  double caltime = time / InstrCTU;
+  double caltime = time / InstrGetCTU();
+  if (InstrUpdate != NULL)
+    InstrUpdate();
 
-  printf("#%14.15s\t%15.15s", "time", "caltime");
+  fprintf(f, "#%14.15s\t%15.15s", "time", "caltime");
   for (int i = 0; i < NUMCOUNTERS; i++)
     if (InstrName[i] != NULL)
-      printf("\t%15.15s", InstrName[i]);
-  puts("");
-  printf("%15.6f\t%15.6f", time, caltime);
+      fprintf(f, "\t%15.15s", InstrName[i]);
+  fputs("\n", f);
+  fprintf(f, "%15.6f\t%15.6f", time, caltime);
   for (int i = 0; i < NUMCOUNTERS; i++)
     if (InstrName[i] != NULL)
-      printf("\t%15lu", InstrCount[i]);  
-  puts("");
+      fprintf(f, "\t%15lu", InstrCount[i]);
+  fputs("\n", f);
+}
+
+
+// Tracing
+//
+// Spans are kept in memory, as trace events, until the trace is saved.
+// Events may be added by any thread, so they are protected by traceLock.
+// Each thread gets a small id (its tid in the trace) on its first event.
+
+struct event {
+  char name[48];
+  double start;  // seconds since InstrTraceStart
+  double dur;    // seconds
+  int tid;
+  int nargs;
+  const char *argName[INSTR_SPAN_ARGS + NUMCOUNTERS];
+  long argValue[INSTR_SPAN_ARGS + NUMCOUNTERS];
+};
+
+#define TRACE_THREADS 256
+
+static int tracing = 0;      // recording spans?
+static double traceOrigin;   // wall_time at InstrTraceStart
+static struct event *events = NULL;
+static size_t nevents = 0;
+static size_t maxevents = 0;
+static int nthreads = 0;     // ids given to threads
+static char threadName[TRACE_THREADS][32];
+static pthread_mutex_t traceLock = PTHREAD_MUTEX_INITIALIZER;
+
+static __thread int traceTid = 0;  // id of this thread (0: none yet)
+
+// Id of the calling thread.  Call with traceLock held.
+static int threadId(void) {
+  if (traceTid == 0)
+    traceTid = ++nthreads;
+  return traceTid;
+}
+
+/// Name the calling thread in traces.
+void InstrTraceThreadName(const char *name) { ///
+  pthread_mutex_lock(&traceLock);
+  int tid = threadId();
+  if (tid < TRACE_THREADS)
+    snprintf(threadName[tid], sizeof(threadName[tid]), "%s", name);
+  pthread_mutex_unlock(&traceLock);
+}
+
+/// Start recording spans, discarding the ones recorded before.
+void InstrTraceStart(void) { ///
+  pthread_mutex_lock(&traceLock);
+  nevents = 0;
+  traceOrigin = wall_time();
+  __atomic_store_n(&tracing, 1, __ATOMIC_RELAXED);
+  pthread_mutex_unlock(&traceLock);
 }
 
+/// Begin a span named name (which is copied when the span ends).
+/// The span is only recorded if tracing is on when it begins.
+void InstrSpanBegin(InstrSpan *span, const char *name) { ///
+  span->name = NULL;
+  if (!__atomic_load_n(&tracing, __ATOMIC_RELAXED))
+    return;
+  span->name = name;
+  span->nargs = 0;
+  for (int i = 0; i < NUMCOUNTERS; i++)
+    span->count[i] = InstrCount[i];
+  span->start = wall_time();
+}
+
+/// Attach a named value to a span (ignored after INSTR_SPAN_ARGS values).
+/// The name must remain valid until the trace is saved (use a literal).
+void InstrSpanArg(InstrSpan *span, const char *name, long value) { ///
+  if (span->name == NULL || span->nargs >= INSTR_SPAN_ARGS)
+    return;
+  span->argName[span->nargs] = name;
+  span->argValue[span->nargs] = value;
+  span->nargs++;
+}
+
+/// End a span, and record it with its values and the change of each named
+/// counter during the span (counters are shared by all threads).
+void InstrSpanEnd(InstrSpan *span) { ///
+  if (span->name == NULL)
+    return;
+  double end = wall_time();
+  struct event ev;
+  snprintf(ev.name, sizeof(ev.name), "%s", span->name);
+  ev.dur = end - span->start;
+  ev.nargs = 0;
+  for (int i = 0; i < span->nargs; i++) {
+    ev.argName[ev.nargs] = span->argName[i];
+    ev.argValue[ev.nargs++] = span->argValue[i];
+  }
+  for (int i = 0; i < NUMCOUNTERS; i++) {
+    if (InstrName[i] != NULL) {
+      ev.argName[ev.nargs] = InstrName[i];
+      ev.argValue[ev.nargs++] = (long)(InstrCount[i] - span->count[i]);
+    }
+  }
+  span->name = NULL;
+
+  int errsave = errno;
+  pthread_mutex_lock(&traceLock);
+  ev.tid = threadId();
+  ev.start = span->start - traceOrigin;
+  if (tracing && nevents == maxevents) {
+    size_t max = maxevents > 0 ? 2 * maxevents : 1024;
+    struct event *p = realloc(events, max * sizeof(*p));
+    if (p != NULL) {
+      events = p;
+      maxevents = max;
+    }
+  }
+  if (tracing && nevents < maxevents) // else, drop it
+    events[nevents++] = ev;
+  pthread_mutex_unlock(&traceLock);
+  errno = errsave;
+}
+
+// Write string s to f as a JSON string.
+static void jsonString(FILE *f, const char *s) {
+  fputc('"', f);
+  for (; *s != '\0'; s++) {
+    unsigned char c = (unsigned char)*s;
+    if (c == '"' || c == '\\')
+      fprintf(f, "\\%c", c);
+    else if (c < 0x20)
+      fprintf(f, "\\u%04x", c);
+    else
+      fputc(c, f);
+  }
+  fputc('"', f);
+}
+
+/// Stop recording spans, and save the ones recorded since InstrTraceStart
+/// to file path, in the Chrome trace event format (JSON).
+/// Returns 1 on success, 0 on failure (errno set).
+int InstrTraceSave(const char *path) { ///
+  FILE *f = fopen(path, "w");
+  if (f == NULL)
+    return 0;
+  pthread_mutex_lock(&traceLock);
+  __atomic_store_n(&tracing, 0, __ATOMIC_RELAXED);
+  fputs("{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n", f);
+  const char *sep = "";
+  for (int tid = 1; tid <= nthreads && tid < TRACE_THREADS; tid++) {
+    if (threadName[tid][0] == '\0')
+      continue;
+    fprintf(f, "%s{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, "
+               "\"tid\": %d, \"args\": {\"name\": ", sep, tid);
+    jsonString(f, threadName[tid]);
+    fputs("}}", f);
+    sep = ",\n";
+  }
+  for (size_t i = 0; i < nevents; i++) {
+    const struct event *ev = &events[i];
+    fprintf(f, "%s{\"name\": ", sep);
+    jsonString(f, ev->name);
+    fprintf(f, ", \"ph\": \"X\", \"pid\": 1, \"tid\": %d, "
+               "\"ts\": %.3f, \"dur\": %.3f, \"args\": {",
+            ev->tid, ev->start * 1e6, ev->dur * 1e6);
+    for (int j = 0; j < ev->nargs; j++) {
+      fputs(j > 0 ? ", " : "", f);
+      jsonString(f, ev->argName[j]);
+      fprintf(f, ": %ld", ev->argValue[j]);
+    }
+    fputs("}}", f);
+    sep = ",\n";
+  }
+  fputs("\n]}\n", f);
+  pthread_mutex_unlock(&traceLock);
+  return fclose(f) == 0;
+}
@@ -9,7 +9,8 @@
 /// // Name the counters you're going to use: 
 /// InstrName[0] = "memops";
 /// InstrName[1] = "adds";
-/// InstrCalibrate();  // Call once, to measure CTU
+/// // The CTU is calibrated (or read from a cache) when first needed.
+/// // InstrCalibrate();  // Call to force a new calibration
 /// ...
 /// InstrReset();  // reset to zero
 /// for (...) {
@@ -18,10 +19,27 @@
 ///   a[k] = a[i] + a[j];
 /// }
 /// InstrPrint();  // to show time and counters
+///
+/// To see which parts of a program take the time, on which threads:
+///
+/// InstrTraceStart();  // start recording spans
+/// ...
+/// InstrSpan span;
+/// InstrSpanBegin(&span, "sort");
+/// ...
+/// InstrSpanArg(&span, "items", n);  // optional values
+/// InstrSpanEnd(&span);  // record the span
+/// ...
+/// InstrTraceSave("trace.json");  // view with chrome://tracing or
+///                                // ui.perfetto.dev
+///
+/// Spans cost almost nothing while tracing is off.
 
 #ifndef INSTRUMENTATION_H
 #define INSTRUMENTATION_H
 
+#include <stdio.h>
+
 /// Cpu time in seconds
 double cpu_time(void) ; ///
 
@@ -37,18 +55,70 @@ extern char* InstrName[NUMCOUNTERS];  ///extern
 /// Cpu_time read on previous reset (~seconds)
 extern double InstrTime;  ///extern
 
-/// Calibrated Time Unit (in seconds, initially 1s)
+/// Function called to update counters before they are printed (or NULL).
+extern void (*InstrUpdate)(void);  ///extern
+
+/// Calibrated Time Unit (in seconds, initially 1s).
+/// Only valid after InstrCalibrate or InstrGetCTU: use InstrGetCTU.
 extern double InstrCTU;  ///extern
 
 /// Find the Calibrated Time Unit (CTU).
 /// Run and time a loop of basic memory and arithmetic operations to set
 /// a reasonably cpu-independent time unit.
+/// The result is saved in the CTU cache file (see InstrGetCTU).
 void InstrCalibrate(void) ;
 
+/// Get the Calibrated Time Unit.
+/// On first use, the CTU is read from a cache file, if it has a value for
+/// this CPU (model and frequency); if not, it is calibrated and saved there.
+/// The cache file is $INSTR_CTU_CACHE, or else $XDG_CACHE_HOME/instr_ctu,
+/// or else $HOME/.cache/instr_ctu.
+double InstrGetCTU(void) ;
+
 /// Reset counters to zero and store cpu_time.
 void InstrReset(void) ;
 
+/// Print times and all named counter values to stdout.
 void InstrPrint(void) ;
 
+/// Print times and all named counter values to file f.
+void InstrFPrint(FILE *f) ;
+
+/// Maximum number of values attached to a span
+#define INSTR_SPAN_ARGS 4
+
+/// A span being timed (see InstrSpanBegin).
+typedef struct {
+  const char *name;  // NULL if not being recorded
+  double start;
+  unsigned long count[NUMCOUNTERS];
+  int nargs;
+  const char *argName[INSTR_SPAN_ARGS];
+  long argValue[INSTR_SPAN_ARGS];
+} InstrSpan;
+
+/// Start recording spans, discarding the ones recorded before.
+void InstrTraceStart(void) ;
+
+/// Stop recording spans, and save the ones recorded since InstrTraceStart
+/// to file path, in the Chrome trace event format (JSON).
+/// Returns 1 on success, 0 on failure (errno set).
+int InstrTraceSave(const char *path) ;
+
+/// Name the calling thread in traces.
+void InstrTraceThreadName(const char *name) ;
+
+/// Begin a span named name (which is copied when the span ends).
+/// The span is only recorded if tracing is on when it begins.
+void InstrSpanBegin(InstrSpan *span, const char *name) ;
+
+/// Attach a named value to a span (ignored after INSTR_SPAN_ARGS values).
+/// The name must remain valid until the trace is saved (use a literal).
+void InstrSpanArg(InstrSpan *span, const char *name, long value) ;
+
+/// End a span, and record it with its values and the change of each named
+/// counter during the span (counters are shared by all threads).
+void InstrSpanEnd(InstrSpan *span) ;
+
 #endif
 
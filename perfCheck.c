@@ -0,0 +1,402 @@
+// perfCheck - Check the performance of image operations against a baseline.
+//
+// This program runs a fixed set of image8bit operations on generated
+// images, several times each, and compares the results to two baselines:
+//   - the pixel memory accesses (PIXMEM) of each operation must be equal
+//     to those in BASELINE, which is the same on every machine;
+//   - the times must not be significantly larger than those in TIMES,
+//     which is only meaningful on the machine that recorded it.  Times are
+//     compared with a one-sided Mann-Whitney U test, and a case only fails
+//     if the median time also grew by more than a given fraction.
+// If TIMES does not exist, the times are recorded there, and only PIXMEM
+// is checked.  Without TIMES, only PIXMEM is checked.
+// For each case, it prints the median times of the baseline and now, the
+// time saved (negative if slower), and their ratio.
+// Times are measured in CTU (see instrumentation.h), to make the baseline
+// less dependent on the machine.  Operations run on a single thread.
+// Each time is the average of enough runs to take at least MINTIME CTU,
+// since the times of single short runs vary too much.  The cases are
+// measured in turns, so that changes in the speed of the machine affect
+// all of them alike.  Even so, timings are only comparable on a quiet
+// machine.
+//
+// Usage: perfCheck [-u] [-n REPS] [-a ALPHA] [-s SLOWDOWN] BASELINE [TIMES]
+//   -u           Record new baselines in BASELINE and TIMES, instead of
+//                checking.
+//   -n REPS      Repetitions of each operation (default 15).
+//   -a ALPHA     Significance level of the test (default 0.01).
+//   -s SLOWDOWN  Minimum relative slowdown of the median (default 0.10).
+//
+// Exits with status 1 if any case regressed, or 2 on errors.
+
+#include <assert.h>
+#include <errno.h>
+#include "error.h"
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "image8bit.h"
+#include "instrumentation.h"
+
+#define MAXREPS 1000
+#define MINTIME 0.01
+
+// Size of the generated images
+#define WIDTH 1024
+#define HEIGHT 768
+
+// Images used by the cases
+static Image source;    // pseudo-random pixels
+static Image pattern;   // a small subimage of source, near its end
+
+// Each case runs one operation on img, a fresh copy of source.
+struct perfcase {
+  const char* name;
+  void (*run)(Image img);
+};
+
+static void runNeg(Image img) { ImageNegative(img); }
+static void runThr(Image img) { ImageThreshold(img, 128); }
+static void runBri(Image img) { ImageBrighten(img, 1.3); }
+static void runBlur(Image img) { ImageBlur(img, 7, 7); }
+static void runGauss(Image img) { ImageGaussian(img, 2.0); }
+static void runMedian(Image img) { ImageMedian(img, 2, 2); }
+static void runErode(Image img) { ImageErode(img, 3, 3); }
+
+static void runLocate(Image img) {
+  int x, y;
+  ImageLocateSubImage(img, &x, &y, pattern);
+}
+
+static void runRotate(Image img) {
+  Image out = ImageRotate(img);
+  ImageDestroy(&out);
+}
+
+static void runRotangle(Image img) {
+  Image out = ImageRotateAngle(img, 30.0, IMAGE_INTERP_BILINEAR, 0);
+  ImageDestroy(&out);
+}
+
+static void runMirror(Image img) {
+  Image out = ImageMirror(img);
+  ImageDestroy(&out);
+}
+
+static void runCopy(Image img) {
+  Image out = ImageCopy(img);
+  ImageDestroy(&out);
+}
+
+static void runCrop(Image img) {
+  Image out = ImageCrop(img, WIDTH / 8, HEIGHT / 8, WIDTH * 3 / 4, HEIGHT * 3 / 4);
+  ImageDestroy(&out);
+}
+
+static void runResize(Image img) {
+  Image out = ImageResize(img, WIDTH / 2, HEIGHT / 2, IMAGE_RESIZE_AREA);
+  ImageDestroy(&out);
+}
+
+static const struct perfcase cases[] = {
+  {"neg", runNeg},
+  {"thr 128", runThr},
+  {"bri 1.3", runBri},
+  {"blur 7,7", runBlur},
+  {"gauss 2.0", runGauss},
+  {"median 2,2", runMedian},
+  {"erode 3,3", runErode},
+  {"locate", runLocate},
+  {"rotate", runRotate},
+  {"rotangle 30", runRotangle},
+  {"mirror", runMirror},
+  {"copy", runCopy},
+  {"crop 128,96,768,576", runCrop},
+  {"resize 512,384", runResize},
+};
+#define NCASES (int)(sizeof(cases) / sizeof(cases[0]))
+
+// Results of a case
+struct result {
+  unsigned long pixmem;
+  int runs;              // runs per sample
+  int n;
+  double time[MAXREPS];  // in CTU
+};
+
+// Create the images used by the cases.
+static void generate(void) {
+  source = ImageCreate(WIDTH, HEIGHT, PixMax);
+  if (source == NULL) error(2, errno, "Creating image: %s", ImageErrMsg());
+  unsigned int state = 12345;
+  for (int y = 0; y < HEIGHT; y++) {
+    for (int x = 0; x < WIDTH; x++) {
+      state = state * 1103515245u + 12345u;  // fixed, portable sequence
+      ImageSetPixel(source, x, y, (uint8)(state >> 24));
+    }
+  }
+  pattern = ImageCrop(source, WIDTH - 100, HEIGHT - 80, 64, 48);
+  if (pattern == NULL) error(2, errno, "Creating image: %s", ImageErrMsg());
+}
+
+// Run case c once on a fresh copy of source.
+// Returns the time (in CTU) and sets (*pixmem).
+static double runOnce(const struct perfcase* c, unsigned long* pixmem) {
+  Image img = ImageCopy(source);
+  if (img == NULL) error(2, errno, "Copying image: %s", ImageErrMsg());
+  InstrReset();
+  c->run(img);
+  double time = cpu_time() - InstrTime;
+  *pixmem = InstrCount[0];  // "pixmem" counter
+  ImageDestroy(&img);
+  return time / InstrGetCTU();
+}
+
+// Warm up case c, and find how many runs make a sample.
+static void prepare(const struct perfcase* c, struct result* r) {
+  double time = runOnce(c, &r->pixmem);
+  r->runs = time > 0.0 && time < MINTIME ? (int)(MINTIME / time) + 1 : 1;
+  r->n = 0;
+}
+
+// Add a sample of case c to r.
+static void sample(const struct perfcase* c, struct result* r) {
+  double total = 0.0;
+  for (int j = 0; j < r->runs; j++) {
+    unsigned long pixmem;
+    total += runOnce(c, &pixmem);
+    if (pixmem != r->pixmem)
+      error(2, 0, "%s: pixmem varies between runs", c->name);
+  }
+  r->time[r->n++] = total / r->runs;
+}
+
+static int compareDoubles(const void* a, const void* b) {
+  double x = *(const double*)a, y = *(const double*)b;
+  return (x > y) - (x < y);
+}
+
+static double median(const double* v, int n) {
+  double s[MAXREPS];
+  memcpy(s, v, n * sizeof(double));
+  qsort(s, n, sizeof(double), compareDoubles);
+  return n % 2 ? s[n/2] : (s[n/2 - 1] + s[n/2]) / 2.0;
+}
+
+// A value, and whether it is from the first sample (see mannWhitney)
+struct ranked {
+  double v;
+  int inA;
+};
+
+// One-sided p-value of the Mann-Whitney U test for the hypothesis that
+// values in a[0..na-1] tend to be larger than values in b[0..nb-1].
+// Uses the normal approximation, with tie and continuity corrections.
+static double mannWhitney(const double* a, int na, const double* b, int nb) {
+  int n = na + nb;
+  struct ranked all[2 * MAXREPS];
+  for (int i = 0; i < na; i++) { all[i].v = a[i]; all[i].inA = 1; }
+  for (int i = 0; i < nb; i++) { all[na + i].v = b[i]; all[na + i].inA = 0; }
+  // Sort by value (insertion sort: n is small)
+  for (int i = 1; i < n; i++) {
+    for (int j = i; j > 0 && all[j-1].v > all[j].v; j--) {
+      struct ranked t = all[j]; all[j] = all[j-1]; all[j-1] = t;
+    }
+  }
+  // Sum the ranks of a, giving tied values their mean rank
+  double ranksA = 0.0, ties = 0.0;
+  for (int i = 0; i < n; ) {
+    int j = i;
+    while (j < n && all[j].v == all[i].v) j++;
+    double rank = (i + 1 + j) / 2.0;  // mean of ranks i+1..j
+    for (int k = i; k < j; k++)
+      if (all[k].inA) ranksA += rank;
+    double t = j - i;
+    ties += t * t * t - t;
+    i = j;
+  }
+  double u = ranksA - na * (na + 1) / 2.0;
+  double mean = na * nb / 2.0;
+  double var = na * nb / 12.0 * ((n + 1) - ties / ((double)n * (n - 1)));
+  if (var <= 0.0) return 1.0;  // all values equal
+  double z = (u - mean - 0.5) / sqrt(var);
+  return 0.5 * erfc(z / sqrt(2.0));
+}
+
+// Save results r of all cases to baseline file path: their PIXMEM counts,
+// or their times if times is set.
+static void saveBaseline(const char* path, struct result r[], int times) {
+  FILE* f = fopen(path, "w");
+  if (f == NULL) error(2, errno, "%s", path);
+  fprintf(f, "{%s\"cases\": [\n", times ? "\"unit\": \"ctu\", " : "");
+  for (int c = 0; c < NCASES; c++) {
+    fprintf(f, "  {\"name\": \"%s\", ", cases[c].name);
+    if (times) {
+      fprintf(f, "\"times\": [");
+      for (int i = 0; i < r[c].n; i++)
+        fprintf(f, "%s%.6g", i > 0 ? ", " : "", r[c].time[i]);
+      fprintf(f, "]");
+    } else {
+      fprintf(f, "\"pixmem\": %lu", r[c].pixmem);
+    }
+    fprintf(f, "}%s\n", c + 1 < NCASES ? "," : "");
+  }
+  fprintf(f, "]}\n");
+  if (fclose(f) != 0) error(2, errno, "%s", path);
+}
+
+// Find case name in baseline text json.
+// Only reads the format written by saveBaseline.
+// Returns a pointer to the fields of the case, or NULL if it is missing.
+static const char* findCase(const char* json, const char* name) {
+  char key[128];
+  snprintf(key, sizeof(key), "{\"name\": \"%s\",", name);
+  const char* p = strstr(json, key);
+  return p == NULL ? NULL : p + strlen(key);
+}
+
+// Read the PIXMEM count at p, the fields of a case, into r.
+// Returns 0 if it is missing.
+static int readPixmem(const char* p, struct result* r) {
+  return sscanf(p, " \"pixmem\": %lu", &r->pixmem) == 1;
+}
+
+// Read the times at p, the fields of a case, into r.
+// Returns 0 if they are missing.
+static int readTimes(const char* p, struct result* r) {
+  while (*p == ' ') p++;
+  if (strncmp(p, "\"times\": [", strlen("\"times\": [")) != 0) return 0;
+  p += strlen("\"times\": [");
+  r->n = 0;
+  int len;
+  while (r->n < MAXREPS && sscanf(p, " %lf%n", &r->time[r->n], &len) == 1) {
+    r->n++;
+    p += len;
+    while (*p == ' ' || *p == ',') p++;
+  }
+  return r->n > 0;
+}
+
+// Read the whole file path into a string (which the caller must free).
+static char* readFile(const char* path) {
+  FILE* f = fopen(path, "r");
+  if (f == NULL) error(2, errno, "%s", path);
+  size_t size = 0, max = 4096;
+  char* text = malloc(max);
+  size_t got;
+  while (text != NULL && (got = fread(text + size, 1, max - 1 - size, f)) > 0) {
+    size += got;
+    if (size == max - 1) text = realloc(text, max *= 2);
+  }
+  if (text == NULL) error(2, ENOMEM, "%s", path);
+  text[size] = '\0';
+  fclose(f);
+  return text;
+}
+
+int main(int argc, char* argv[]) {
+  program_name = argv[0];
+  int update = 0;
+  int reps = 15;
+  double alpha = 0.01;
+  double slowdown = 0.10;
+  int k = 1;
+  for (; k < argc - 1 && argv[k][0] == '-'; k++) {
+    if (strcmp(argv[k], "-u") == 0) {
+      update = 1;
+    } else if (strcmp(argv[k], "-n") == 0 && k + 2 < argc) {
+      reps = atoi(argv[++k]);
+    } else if (strcmp(argv[k], "-a") == 0 && k + 2 < argc) {
+      alpha = atof(argv[++k]);
+    } else if (strcmp(argv[k], "-s") == 0 && k + 2 < argc) {
+      slowdown = atof(argv[++k]);
+    } else {
+      break;
+    }
+  }
+  if (k < argc - 2 || k > argc - 1 || reps < 2 || reps > MAXREPS) {
+    error(2, 0, "Usage: perfCheck [-u] [-n REPS] [-a ALPHA] [-s SLOWDOWN] BASELINE [TIMES]");
+  }
+  const char* path = argv[k];
+  const char* timesPath = k + 1 < argc ? argv[k + 1] : NULL;
+
+  ImageInit();
+  ImageSetThreads(1);  // for stable timings
+  generate();
+
+  static struct result result[NCASES];
+  for (int c = 0; c < NCASES; c++) {
+    prepare(&cases[c], &result[c]);
+  }
+  for (int i = 0; i < reps; i++) {
+    for (int c = 0; c < NCASES; c++) {
+      sample(&cases[c], &result[c]);
+    }
+  }
+
+  if (update) {
+    saveBaseline(path, result, 0);
+    printf("# Saved baseline %s\n", path);
+    if (timesPath != NULL) {
+      saveBaseline(timesPath, result, 1);
+      printf("# Saved baseline %s\n", timesPath);
+    }
+    return 0;
+  }
+
+  char* json = readFile(path);
+  // Record the times on first use, as they only compare on one machine
+  char* timesJson = NULL;
+  FILE* f;
+  if (timesPath != NULL && (f = fopen(timesPath, "r")) != NULL) {
+    fclose(f);
+    timesJson = readFile(timesPath);
+  }
+  static struct result base;
+  int failed = 0;
+  printf("#%-19s %12s %12s %12s %7s %9s  %s\n", "case", "base(ctu)",
+         "now(ctu)", "saved(ctu)", "ratio", "p", "result");
+  for (int c = 0; c < NCASES; c++) {
+    const struct result* r = &result[c];
+    double mc = median(r->time, r->n);
+    const char* fields = findCase(json, cases[c].name);
+    if (fields == NULL || !readPixmem(fields, &base)) {
+      printf(" %-19s %12s %12.6f  NO BASELINE\n", cases[c].name, "-", mc);
+      failed = 1;
+      continue;
+    }
+    const char* timeFields = timesJson != NULL ?
+                             findCase(timesJson, cases[c].name) : NULL;
+    int timed = timeFields != NULL && readTimes(timeFields, &base);
+    double mb = 0.0, p = 1.0;
+    if (timed) {
+      mb = median(base.time, base.n);
+      p = mannWhitney(r->time, r->n, base.time, base.n);
+      printf(" %-19s %12.6f %12.6f %12.6f %7.3f %9.2g  ", cases[c].name, mb,
+             mc, mb - mc, mb > 0.0 ? mc / mb : 0.0, p);
+    } else {
+      printf(" %-19s %12s %12.6f %12s %7s %9s  ", cases[c].name, "-", mc,
+             "-", "-", "-");
+    }
+    if (r->pixmem != base.pixmem) {
+      printf("PIXMEM CHANGED (%lu, was %lu)\n", r->pixmem, base.pixmem);
+      failed = 1;
+    } else if (timed && p < alpha && mc > mb * (1.0 + slowdown)) {
+      printf("SLOWER\n");
+      failed = 1;
+    } else {
+      printf("ok\n");
+    }
+  }
+  if (timesPath != NULL && timesJson == NULL) {
+    saveBaseline(timesPath, result, 1);
+    printf("# Saved baseline %s\n", timesPath);
+  }
+  free(json);
+  free(timesJson);
+
+  ImageDestroy(&source);
+  ImageDestroy(&pattern);
+  return failed;
+}
@@ -0,0 +1,202 @@
+/// A shared thread pool for data-parallel loops.
+///
+/// Each PoolParallelFor call splits its chunks into one contiguous range per
+/// participating thread.  A thread takes chunks from the front of its own
+/// range; when it runs out, it steals chunks from the ranges of the other
+/// threads.  Taking a chunk is a single atomic increment, so chunks are
+/// claimed exactly once, with no locking.
+///
+/// Worker threads sleep on a condition variable between calls, and are
+/// stopped and joined at program exit.
+///
+/// The pool runs one job at a time.  A call made from another thread while
+/// the pool is busy does not wait: it runs its chunks in the calling thread.
+///
+/// When tracing (see instrumentation.h), each thread records a span for its
+/// part of each job, with the number of chunks it ran and stole.
+
+#include "threadpool.h"
+#include "instrumentation.h"
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+// Chunks [next, end) of one thread (padded to avoid false sharing)
+struct range {
+  long next;
+  long end;
+  char pad[64 - 2 * sizeof(long)];
+};
+
+static int poolSize = 1;    // threads to use (including the caller)
+static int poolStarted = 0; // worker threads created
+static int poolStop = 0;    // set to stop workers at exit
+static pthread_t poolWorker[POOL_MAX_THREADS];
+static pthread_mutex_t poolLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t poolBusy = PTHREAD_MUTEX_INITIALIZER; // held per job
+static pthread_cond_t poolWake = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t poolDone = PTHREAD_COND_INITIALIZER;
+
+// Current job
+static unsigned long jobGen = 0; // incremented for each job
+static int jobThreads;           // threads taking part in the job
+static int jobActive;            // workers still running the job
+static PoolTask jobTask;
+static void *jobArg;
+static long jobN;
+static long jobGrain;
+static struct range jobRange[POOL_MAX_THREADS];
+
+// Worker id of this thread, and whether it is running a task
+static __thread int workerId = 0;
+static __thread int inTask = 0;
+
+// Run chunks of the current job, starting with the range of thread id.
+static void runJob(int id) {
+  InstrSpan span;
+  InstrSpanBegin(&span, "pool job");
+  long chunks = 0; // chunks run
+  long stolen = 0; // chunks run from the ranges of other threads
+  inTask = 1;
+  for (int i = 0; i < jobThreads; i++) {
+    struct range *r = &jobRange[(id + i) % jobThreads];
+    for (;;) {
+      long c = __atomic_fetch_add(&r->next, 1, __ATOMIC_RELAXED);
+      if (c >= r->end)
+        break;
+      long begin = c * jobGrain;
+      long end = begin + jobGrain < jobN ? begin + jobGrain : jobN;
+      jobTask(jobArg, begin, end);
+      chunks++;
+      stolen += i > 0;
+    }
+  }
+  inTask = 0;
+  if (chunks > 0) { // threads that found no work are not recorded
+    InstrSpanArg(&span, "chunks", chunks);
+    InstrSpanArg(&span, "stolen", stolen);
+    InstrSpanEnd(&span);
+  }
+}
+
+static void *workerMain(void *p) {
+  int id = (int)(long)p;
+  workerId = id;
+  char name[32];
+  snprintf(name, sizeof(name), "worker %d", id);
+  InstrTraceThreadName(name);
+  unsigned long seen = 0;
+  pthread_mutex_lock(&poolLock);
+  for (;;) {
+    while (!poolStop && (jobGen == seen || id >= jobThreads)) {
+      seen = jobGen;
+      pthread_cond_wait(&poolWake, &poolLock);
+    }
+    if (poolStop)
+      break;
+    seen = jobGen;
+    pthread_mutex_unlock(&poolLock);
+    runJob(id);
+    pthread_mutex_lock(&poolLock);
+    if (--jobActive == 0)
+      pthread_cond_signal(&poolDone);
+  }
+  pthread_mutex_unlock(&poolLock);
+  return NULL;
+}
+
+// Stop and join all workers (registered with atexit).
+static void poolShutdown(void) {
+  pthread_mutex_lock(&poolLock);
+  poolStop = 1;
+  pthread_cond_broadcast(&poolWake);
+  pthread_mutex_unlock(&poolLock);
+  for (int i = 1; i < poolStarted; i++)
+    pthread_join(poolWorker[i], NULL);
+  poolStarted = 0;
+}
+
+// Make sure workers 1..n-1 exist.  Returns the number of usable threads.
+static int poolStart(int n) {
+  if (poolStarted == 0) {
+    poolStarted = 1;
+    atexit(poolShutdown);
+  }
+  while (poolStarted < n &&
+         pthread_create(&poolWorker[poolStarted], NULL, workerMain,
+                        (void *)(long)poolStarted) == 0)
+    poolStarted++;
+  return poolStarted < n ? poolStarted : n;
+}
+
+void PoolInit(int nthreads) { ///
+  if (nthreads <= 0) {
+    const char *env = getenv("IMAGE_THREADS");
+    nthreads = env != NULL ? atoi(env) : 0;
+  }
+  if (nthreads <= 0)
+    nthreads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+  if (nthreads <= 0)
+    nthreads = 1;
+  poolSize = nthreads < POOL_MAX_THREADS ? nthreads : POOL_MAX_THREADS;
+}
+
+int PoolThreads(void) { ///
+  return poolSize;
+}
+
+int PoolJobThreads(long n, long grain) { ///
+  assert(n >= 0 && grain >= 1);
+  long nchunks = (n + grain - 1) / grain;
+  if (inTask || nchunks <= 1)
+    return 1;
+  return nchunks < poolSize ? (int)nchunks : poolSize;
+}
+
+int PoolWorkerId(void) { ///
+  return inTask ? workerId : 0;
+}
+
+void PoolParallelFor(long n, long grain, PoolTask task, void *arg) { ///
+  assert(n >= 0 && grain >= 1);
+  int threads = PoolJobThreads(n, grain);
+  if (threads > 1 && pthread_mutex_trylock(&poolBusy) != 0)
+    threads = 1; // pool busy with a call from another thread
+  else if (threads > 1 && (threads = poolStart(threads)) <= 1)
+    pthread_mutex_unlock(&poolBusy);
+  if (threads <= 1) {
+    // Run all chunks here, in order, as worker 0
+    int id = workerId;
+    workerId = 0;
+    for (long begin = 0; begin < n; begin += grain)
+      task(arg, begin, begin + grain < n ? begin + grain : n);
+    workerId = id;
+    return;
+  }
+
+  long nchunks = (n + grain - 1) / grain;
+  pthread_mutex_lock(&poolLock);
+  jobTask = task;
+  jobArg = arg;
+  jobN = n;
+  jobGrain = grain;
+  jobThreads = threads;
+  for (int i = 0; i < threads; i++) {
+    jobRange[i].next = nchunks * i / threads;
+    jobRange[i].end = nchunks * (i + 1) / threads;
+  }
+  jobActive = threads - 1;
+  jobGen++;
+  pthread_cond_broadcast(&poolWake);
+  pthread_mutex_unlock(&poolLock);
+
+  runJob(0);
+
+  pthread_mutex_lock(&poolLock);
+  while (jobActive > 0)
+    pthread_cond_wait(&poolDone, &poolLock);
+  pthread_mutex_unlock(&poolLock);
+  pthread_mutex_unlock(&poolBusy);
+}
@@ -0,0 +1,49 @@
+/// A shared thread pool for data-parallel loops.
+///
+/// Use as follows:
+///
+/// PoolInit(0);  // Call once: use IMAGE_THREADS or the number of CPUs
+/// ...
+/// // Process items [0, n) in chunks of (at least) grain items:
+/// PoolParallelFor(n, grain, task, arg);
+///
+/// where task(arg, begin, end) processes items [begin, end).
+/// Worker threads are only created when first needed.
+
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+
+/// Maximum number of threads (including the calling thread)
+#define POOL_MAX_THREADS 64
+
+/// Task function: process items [begin, end).
+typedef void (*PoolTask)(void *arg, long begin, long end);
+
+/// Set the number of threads to use (including the calling thread).
+/// If nthreads <= 0, use the value of environment variable IMAGE_THREADS,
+/// or else the number of online CPUs.
+/// Threads are not created here, but only when first needed.
+void PoolInit(int nthreads) ;
+
+/// Number of threads that may be used (including the calling thread).
+int PoolThreads(void) ;
+
+/// Number of threads a PoolParallelFor(n, grain, ...) call will use.
+/// Worker ids in that call are in [0, PoolJobThreads(n, grain)).
+int PoolJobThreads(long n, long grain) ;
+
+/// Id of the calling thread within the running PoolParallelFor,
+/// in [0, PoolJobThreads(...)).  The thread that called it has id 0.
+int PoolWorkerId(void) ;
+
+/// Call task(arg, begin, end) for chunks [begin, end) covering [0, n).
+/// Chunk c is always [c*grain, min((c+1)*grain, n)), so tasks may use
+/// begin/grain as a chunk index.  Chunks run in parallel, in no specific
+/// order, and all are finished when this function returns.
+/// If there is a single chunk, or a single thread, or if called from within
+/// a task, or while the pool runs a call from another thread, all chunks run
+/// in the calling thread, in order.
+/// Requires: n >= 0, grain >= 1.
+void PoolParallelFor(long n, long grain, PoolTask task, void *arg) ;
+
+#endif